@@ -0,0 +1,335 @@
+/*
+ * Multi-symbol matching engine
+ *
+ * Owns one Orderbook per symbol and partitions the symbols over worker threads (shards), each
+ * pinned to its own core. A symbol always lives on the same shard and only that shard's thread
+ * ever touches its book, so every book stays single-writer: no locks anywhere near matching.
+ * Orders are routed by symbol to the shard's inbox, a single-producer/single-consumer ring
+ * (spsc_ring.h) the shard busy-polls with a configurable wait strategy, and applied there in
+ * submission order. The trades of a shard go either to that shard's own copy of the trade sink,
+ * on the shard's thread, or into the shard's outbound ring for one publisher thread to poll.
+ * Shards share nothing but their rings, so throughput scales with the number of cores.
+ *
+ * Tests live in orderbook.cpp, benchmarks in orderbook_bench.cpp.
+ */
+
+#pragma once
+
+#include "orderbook.h"
+#include "spsc_ring.h"
+#include <algorithm>
+#include <atomic>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+using SymbolId = std::uint32_t;
+
+enum class CommandType : std::uint8_t
+{
+    Add,
+    Cancel, // order.id
+    Modify  // order.id to order.price and order.quantity, see Orderbook::ModifyOrder
+};
+
+// one instruction for the book of symbol; fixed size, so it can be queued by value
+struct OrderCommand
+{
+    CommandType type;
+    SymbolId symbol;
+    OrderRequest order;
+};
+
+struct EngineConfig
+{
+    std::size_t symbols = 0;    // symbol ids are 0 .. symbols - 1
+    std::size_t shards = 0;     // worker threads; 0: one per hardware thread
+    bool pinThreads = true;     // pin shard i to core i (modulo the cores there are)
+    bool publishTrades = false; // trades go to the outbound rings for PollTrades, not to the sink
+    OrderbookConfig book = {};  // every book is built with this; client ids only
+};
+
+// Called with every trade on the thread of the shard that matched it. Each shard has its own
+// copy, so a sink needs no synchronization of its own for per-shard state.
+template <typename F>
+concept SymbolTradeSink = std::copy_constructible<F> && std::invocable<F &, SymbolId, const Trade &>;
+
+struct IgnoreTrades
+{
+    void operator()(SymbolId, const Trade &) const {}
+};
+
+// a trade as it comes out of an outbound ring
+struct SymbolTrade
+{
+    SymbolId symbol;
+    Trade trade;
+};
+
+// Pin thread to core (modulo the cores there are). Best effort: a container may not allow it,
+// and the thread still works unpinned.
+inline void PinToCore(std::thread &thread, std::size_t core)
+{
+#ifdef __linux__
+    cpu_set_t cores;
+    CPU_ZERO(&cores);
+    CPU_SET(core % std::max(1u, std::thread::hardware_concurrency()), &cores);
+    pthread_setaffinity_np(thread.native_handle(), sizeof(cores), &cores);
+#else
+    (void)thread;
+    (void)core;
+#endif
+}
+
+// Apply command to book, fills to sink. Returns false when the book refuses it (duplicate id,
+// unknown order, a price off the tick...), whether by returning false or by throwing: a worker
+// thread must keep going.
+template <typename Book, TradeSink Sink>
+bool ApplyCommand(Book &book, const OrderCommand &command, Sink &sink)
+{
+    try
+    {
+        switch (command.type)
+        {
+        case CommandType::Add:
+            return book.AddOrder(command.order, sink);
+        case CommandType::Cancel:
+            return book.CancelOrder(command.order.id);
+        case CommandType::Modify:
+            return book.ModifyOrder(command.order.id, command.order.price, command.order.quantity, sink);
+        }
+    }
+    catch (const std::exception &)
+    {
+    }
+    return false;
+}
+
+// Wait: what a shard does while its inbox is empty, and what Submit does while an inbox is
+// full, see BusySpin, SpinThenYield and SpinYieldSleep
+template <SymbolTradeSink Sink = IgnoreTrades, WaitStrategy Wait = SpinThenYield, typename Book = Orderbook<>>
+class MatchingEngine
+{
+public:
+    static constexpr std::size_t InboxSlots = 1 << 14;
+    static constexpr std::size_t OutboxSlots = 1 << 15;
+    // Submit publishes a shard's commands every this many (and on Flush); the worker applies at
+    // most this many before handing their slots back
+    static constexpr std::size_t PublishEvery = 64;
+    static constexpr std::size_t ApplyBatch = 256;
+
+private:
+    // Everything one worker thread owns. The rings keep their two ends on separate lines, and
+    // the counters below are split the same way: submitted is the producer's, the rest the worker's.
+    struct Shard
+    {
+        SpscRing<OrderCommand, InboxSlots> inbox;
+        SpscRing<SymbolTrade, OutboxSlots> outbox;
+        alignas(CacheLine) std::uint64_t submitted = 0;
+        alignas(CacheLine) std::atomic<std::uint64_t> processed{0};
+        std::atomic<std::uint64_t> rejected{0};
+        std::atomic<bool> stopping{false};
+        Sink sink;
+        Wait wait;
+        std::thread thread;
+
+        explicit Shard(const Sink &sink) : sink(sink) {}
+    };
+
+    std::vector<std::unique_ptr<Book>> books_; // by symbol
+    std::vector<std::unique_ptr<Shard>> shards_;
+    bool publishTrades_;
+
+    // Apply one command to its book. A rejected command is counted and otherwise dropped.
+    void Apply(Shard &shard, const OrderCommand &command)
+    {
+        Book &book = *books_[command.symbol];
+        auto sink = [this, &shard, symbol = command.symbol](const Trade &trade)
+        {
+            if (!publishTrades_)
+            {
+                shard.sink(symbol, trade);
+                return;
+            }
+            // the publisher is behind: wait for it, unless the engine is going away
+            for (std::uint32_t idle = 0; !shard.outbox.TryPush(SymbolTrade{symbol, trade}); ++idle)
+            {
+                shard.outbox.Publish();
+                if (shard.stopping.load(std::memory_order_relaxed))
+                    return;
+                shard.wait(idle);
+            }
+        };
+        if (!ApplyCommand(book, command, sink))
+        {
+            shard.rejected.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // poll the inbox, applying whatever is there in batches, until stopped with nothing left
+    void Run(Shard &shard)
+    {
+        for (std::uint32_t idle = 0;;)
+        {
+            // read before polling: everything submitted before the stop is published by then
+            const bool stopping = shard.stopping.load(std::memory_order_acquire);
+            const std::size_t applied = shard.inbox.Consume([this, &shard](const OrderCommand &command)
+                                                            { Apply(shard, command); }, ApplyBatch);
+            if (applied != 0)
+            {
+                if (publishTrades_)
+                    shard.outbox.Publish();
+                shard.processed.fetch_add(applied, std::memory_order_release);
+                idle = 0;
+            }
+            else if (stopping)
+            {
+                return;
+            }
+            else
+            {
+                shard.wait(idle++);
+            }
+        }
+    }
+
+public:
+    explicit MatchingEngine(const EngineConfig &config, const Sink &sink = {})
+        : publishTrades_(config.publishTrades)
+    {
+        if (config.book.engineIds)
+        {
+            throw std::invalid_argument("the engine routes client order ids");
+        }
+        books_.reserve(config.symbols);
+        for (std::size_t symbol = 0; symbol < config.symbols; ++symbol)
+        {
+            books_.push_back(std::make_unique<Book>(config.book));
+        }
+        const std::size_t shards = config.shards != 0 ? config.shards
+                                                      : std::max(1u, std::thread::hardware_concurrency());
+        shards_.reserve(shards);
+        for (std::size_t i = 0; i < shards; ++i)
+        {
+            shards_.push_back(std::make_unique<Shard>(sink));
+        }
+        for (std::size_t i = 0; i < shards; ++i)
+        {
+            Shard &shard = *shards_[i];
+            shard.thread = std::thread([this, &shard]
+                                       { Run(shard); });
+            if (config.pinThreads)
+            {
+                PinToCore(shard.thread, i);
+            }
+        }
+    }
+
+    MatchingEngine(const MatchingEngine &) = delete;
+    MatchingEngine &operator=(const MatchingEngine &) = delete;
+
+    // applies everything already submitted, then stops the workers; trades that don't fit in the
+    // outbound rings by then are dropped
+    ~MatchingEngine()
+    {
+        Flush();
+        for (const auto &shard : shards_)
+        {
+            shard->stopping.store(true, std::memory_order_release);
+        }
+        for (const auto &shard : shards_)
+        {
+            shard->thread.join();
+        }
+    }
+
+    std::size_t Symbols() const { return books_.size(); }
+    std::size_t Shards() const { return shards_.size(); }
+
+    // static partition: consecutive symbols go round-robin over the shards
+    std::size_t ShardOf(SymbolId symbol) const { return symbol % shards_.size(); }
+
+    // Queue command for its symbol's shard; commands for one symbol are applied in the order they
+    // were submitted. Submit, Flush and Drain are the producer end of every inbox: call them from
+    // one gateway thread. Commands reach the shard every PublishEvery of them, or on Flush.
+    // Waits while the shard's inbox is full.
+    void Submit(const OrderCommand &command)
+    {
+        if (command.symbol >= books_.size())
+        {
+            throw std::out_of_range("unknown symbol");
+        }
+        Shard &shard = *shards_[ShardOf(command.symbol)];
+        for (std::uint32_t idle = 0; !shard.inbox.TryPush(command); ++idle)
+        {
+            shard.inbox.Publish();
+            shard.wait(idle);
+        }
+        ++shard.submitted;
+        if (shard.inbox.Unpublished() == PublishEvery)
+        {
+            shard.inbox.Publish();
+        }
+    }
+
+    // hand every command submitted so far to the shards, e.g. at the end of each gateway read
+    void Flush()
+    {
+        for (const auto &shard : shards_)
+        {
+            shard->inbox.Publish();
+        }
+    }
+
+    // wait until every command submitted so far has been applied
+    void Drain()
+    {
+        Flush();
+        for (const auto &shard : shards_)
+        {
+            while (shard->processed.load(std::memory_order_acquire) < shard->submitted)
+            {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    // With publishTrades: hands every trade the shards have published to fn(symbol, trade), each
+    // shard's in the order they happened. Call it from one publisher thread, often enough that
+    // the outbound rings don't fill up: a shard with a full ring waits for it. Returns how many.
+    template <std::invocable<SymbolId, const Trade &> Fn>
+    std::size_t PollTrades(Fn &&fn)
+    {
+        std::size_t polled = 0;
+        for (const auto &shard : shards_)
+        {
+            polled += shard->outbox.Consume([&fn](const SymbolTrade &trade)
+                                            { fn(trade.symbol, trade.trade); });
+        }
+        return polled;
+    }
+
+    // commands that were dropped: duplicate ids, unknown orders, invalid prices...
+    std::uint64_t Rejected() const
+    {
+        std::uint64_t rejected = 0;
+        for (const auto &shard : shards_)
+        {
+            rejected += shard->rejected.load(std::memory_order_relaxed);
+        }
+        return rejected;
+    }
+
+    // A symbol's book, for reading once the engine is quiet: only after Drain, with nothing
+    // submitted since. Its shard's thread owns it the rest of the time.
+    const Book &book(SymbolId symbol) const { return *books_[symbol]; }
+};
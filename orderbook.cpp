@@ -1,209 +1,53 @@
 /*
- * Basic Limit Order Matching Engine
- *
- * Features:
- * - Price-time priority matching: Orders matched first by best price, then by arrival time (FIFO)
- * - Buy orders sorted descending (highest price first), sell orders ascending (lowest price first)
- * - Automatic matching on order insertion when bid price >= ask price
- * - Partial fills supported: Orders can be partially filled across multiple matches
- * - Order deduplication: Duplicate order IDs are rejected
- * - Trade execution: Returns all trades generated from a single order insertion
- * - Efficient lookups: O(1) order cancellation capability via hash map
- *
- * Matching Logic:
- * - Continuous matching: After adding an order, matches repeatedly until no cross exists
- * - Match price: Uses the price of the resting order (market maker gets their price)
- * - Order removal: Fully filled orders automatically removed from book
+ * Tests for the limit order matching engine in orderbook.h, the multi-symbol engines in
+ * matching_engine.h and work_stealing.h, the ring in spsc_ring.h and the pipeline in pipeline.h
  *
  * Print functions and the tests (main function) are AI-generated.
  */
 
+#include "orderbook.h"
+#include "matching_engine.h"
+#include "pipeline.h"
+#include "work_stealing.h"
+#include <atomic>
 #include <iostream>
-#include <map>
-#include <list>
-#include <unordered_map>
-#include <memory>
-#include <cstdint>
+#include <string>
 #include <vector>
 #include <iomanip>
 #include <cassert>
+#include <random>
+#include <unordered_map>
 
-using Price = std::int32_t;
-using Quantity = std::uint32_t;
-using OrderId = std::uint64_t;
-
-enum class Side
-{
-    Buy,
-    Sell
-};
-
-class Order
-{
-private:
-    OrderId id_;
-    Side side_;
-    Price price_;
-    Quantity quantity_;
-
-public:
-    Order(OrderId id, Side side, Price price, Quantity quantity) : id_(id), side_(side), price_(price),
-                                                                   quantity_(quantity)
-    {
-    }
-
-    OrderId getId() { return id_; }
-    Side getSide() { return side_; }
-    Price getPrice() { return price_; }
-    Quantity getQuantity() { return quantity_; }
-
-    void Fill(const Quantity filling)
-    {
-        if (filling > quantity_)
-        {
-            throw std::logic_error("filling too much");
-        }
-        quantity_ -= filling;
-    }
-
-    bool isFilled() const
-    {
-        return quantity_ == 0;
-    }
-
-    void print() const
-    {
-        using namespace std;
-        cout << "Id: " << id_ << " Side: " << static_cast<int>(side_) << " Price: " << price_ << " Quantity: " << quantity_ << '\n';
-    }
-};
-
-using OrderPointer = std::shared_ptr<Order>;
-
-using OrderPointers = std::list<OrderPointer>;
-
-struct TradeSide
-{
-    OrderId orderId;
-    Price price;
-    Quantity quantity;
-};
-
-struct Trade
-{
-    TradeSide buySide;
-    TradeSide sellSide;
-
-    void print() const
-    {
-        using namespace std;
-        cout << "Buy: " << buySide.orderId << ' ' << buySide.price << ' ' << buySide.quantity << '\n';
-        cout << "Sell: " << sellSide.orderId << ' ' << sellSide.price << ' ' << sellSide.quantity << '\n';
-    }
-};
-
-using Trades = std::vector<Trade>;
-
-class Orderbook
+// Prints one price level: total quantity and the order IDs in FIFO order
+template <template <Side> class L, typename A>
+void printLevel(const Orderbook<L, A> &ob, Price price, const OrderQueue &orders)
 {
-    struct OrderEntry
-    {
-        OrderPointer order_;
-        OrderPointers::iterator iter_;
-    };
-
-    std::map<Price, OrderPointers, std::greater<>> bids_;
-    std::map<Price, OrderPointers, std::less<>> asks_;
-    std::unordered_map<OrderId, OrderEntry> orders_hashmap;
-
-    Trades MatchOrders()
-    {
-        Trades trades = {};
-
-        while (!asks_.empty() && !bids_.empty())
-        {
-            auto &[bestBidPrice, bestBids] = *bids_.begin();
-            auto &[bestAskPrice, bestAsks] = *asks_.begin();
-            if (bestBidPrice < bestAskPrice)
-            {
-                return trades;
-            }
-
-            while (!bestBids.empty() && !bestAsks.empty())
-            {
-                const auto &oldestBid = bestBids.front();
-                const auto &oldestAsk = bestAsks.front();
-                const Quantity &bidQty = oldestBid->getQuantity();
-                const Quantity &askQty = oldestAsk->getQuantity();
-                const Quantity match_qty = std::min(bidQty, askQty);
-                const OrderId buyId = oldestBid->getId();
-                const OrderId sellId = oldestAsk->getId();
-                oldestBid->Fill(match_qty);
-                oldestAsk->Fill(match_qty);
-
-                TradeSide buySide{buyId, oldestBid->getPrice(), match_qty};
-                TradeSide sellSide{sellId, oldestAsk->getPrice(), match_qty};
-                trades.push_back({buySide, sellSide});
-
-                if (oldestBid->isFilled())
-                {
-                    bestBids.pop_front();
-                    orders_hashmap.erase(buyId);
-                }
-                if (oldestAsk->isFilled())
-                {
-                    bestAsks.pop_front();
-                    orders_hashmap.erase(sellId);
-                }
-            }
-            if (bestAsks.empty())
-            {
-                asks_.erase(asks_.begin()); // bestAsks invalid now
-            }
-            if (bestBids.empty())
-            {
-                bids_.erase(bids_.begin()); // bestBids invalid now
-            }
-        }
+    using namespace std;
 
-        return trades;
-    }
+    Quantity totalQty = 0;
+    vector<OrderId> ids;
 
-public:
-    Trades AddOrder(OrderPointer new_order)
+    for (OrderHandle handle = orders.front(); handle != NullHandle; handle = ob.pool_[handle].getNext())
     {
-        if (orders_hashmap.contains(new_order->getId()))
-        {
-            return {};
-        }
-
-        OrderPointers::iterator it;
-        if (new_order->getSide() == Side::Buy)
-        {
-            auto &bids_at_price = bids_[new_order->getPrice()];
-            it = bids_at_price.insert(bids_at_price.end(), new_order);
-        }
-        else
-        {
-            auto &asks_at_price = asks_[new_order->getPrice()];
-            it = asks_at_price.insert(asks_at_price.end(), new_order);
-        }
-        orders_hashmap[new_order->getId()] = {new_order, it};
-
-        return MatchOrders();
+        const Order &order = ob.pool_[handle];
+        totalQty += order.getQuantity();
+        ids.push_back(order.getId());
     }
 
-    int Size() const
+    assert(totalQty == orders.quantity() && ids.size() == orders.count() && "Level totals match its orders");
+    cout << setw(10) << price << " | " << setw(10) << totalQty << " | ";
+    for (size_t i = 0; i < ids.size(); ++i)
     {
-        return orders_hashmap.size();
+        if (i > 0)
+            cout << ", ";
+        cout << ids[i];
     }
-
-    // Friend function for printing
-    friend void print(const Orderbook &ob);
-};
+    cout << "\n";
+}
 
 // Overload 1: Print the current orderbook state
-void print(const Orderbook &ob)
+template <template <Side> class L, typename A>
+void print(const Orderbook<L, A> &ob)
 {
     using namespace std;
 
@@ -224,26 +68,12 @@ void print(const Orderbook &ob)
         cout << setw(10) << "Price" << " | " << setw(10) << "Quantity" << " | " << "Order IDs\n";
         cout << string(60, '-') << "\n";
 
-        for (auto it = ob.asks_.rbegin(); it != ob.asks_.rend(); ++it)
+        vector<pair<Price, const OrderQueue *>> asks;
+        ob.asks_.ForEach([&asks](Price price, const OrderQueue &orders)
+                         { asks.emplace_back(price, &orders); return true; });
+        for (auto it = asks.rbegin(); it != asks.rend(); ++it)
         {
-            const auto &[price, orders] = *it;
-            Quantity totalQty = 0;
-            vector<OrderId> ids;
-
-            for (const auto &order : orders)
-            {
-                totalQty += order->getQuantity();
-                ids.push_back(order->getId());
-            }
-
-            cout << setw(10) << price << " | " << setw(10) << totalQty << " | ";
-            for (size_t i = 0; i < ids.size(); ++i)
-            {
-                if (i > 0)
-                    cout << ", ";
-                cout << ids[i];
-            }
-            cout << "\n";
+            printLevel(ob, it->first, *it->second);
         }
     }
 
@@ -264,26 +94,8 @@ void print(const Orderbook &ob)
         cout << setw(10) << "Price" << " | " << setw(10) << "Quantity" << " | " << "Order IDs\n";
         cout << string(60, '-') << "\n";
 
-        for (const auto &[price, orders] : ob.bids_)
-        {
-            Quantity totalQty = 0;
-            vector<OrderId> ids;
-
-            for (const auto &order : orders)
-            {
-                totalQty += order->getQuantity();
-                ids.push_back(order->getId());
-            }
-
-            cout << setw(10) << price << " | " << setw(10) << totalQty << " | ";
-            for (size_t i = 0; i < ids.size(); ++i)
-            {
-                if (i > 0)
-                    cout << ", ";
-                cout << ids[i];
-            }
-            cout << "\n";
-        }
+        ob.bids_.ForEach([&ob](Price price, const OrderQueue &orders)
+                         { printLevel(ob, price, orders); return true; });
     }
 
     cout << string(60, '=') << "\n\n";
@@ -320,13 +132,13 @@ void print(const Trades &trades)
     cout << "\n";
 }
 
-int main()
+// Tests 1-11: the continuous matching scenario, run once per level container
+template <typename Book>
+void testContinuousMatching()
 {
     using namespace std;
 
-    cout << "\n*** LIMIT ORDER MATCHING ENGINE TEST ***\n";
-
-    Orderbook ob;
+    Book ob;
     Trades test_trades;
 
     // Test 1: Empty orderbook
@@ -336,7 +148,7 @@ int main()
 
     // Test 2: Add buy order with no match
     cout << "\n=== TEST 2: Add Buy Order (ID=1, Price=100, Qty=10) ===";
-    test_trades = ob.AddOrder(make_shared<Order>(1, Side::Buy, 100, 10));
+    test_trades = ob.AddOrder(1, Side::Buy, 100, 10);
     print(test_trades);
     print(ob);
     assert(test_trades.size() == 0 && "No matching orders, should produce 0 trades");
@@ -344,7 +156,7 @@ int main()
 
     // Test 3: Add sell order above best bid (no match)
     cout << "\n=== TEST 3: Add Sell Order (ID=2, Price=105, Qty=5) ===";
-    test_trades = ob.AddOrder(make_shared<Order>(2, Side::Sell, 105, 5));
+    test_trades = ob.AddOrder(2, Side::Sell, 105, 5);
     print(test_trades);
     print(ob);
     assert(test_trades.size() == 0 && "Sell price > buy price, no match");
@@ -352,7 +164,7 @@ int main()
 
     // Test 4: Add another buy order at different price
     cout << "\n=== TEST 4: Add Buy Order (ID=3, Price=98, Qty=8) ===";
-    test_trades = ob.AddOrder(make_shared<Order>(3, Side::Buy, 98, 8));
+    test_trades = ob.AddOrder(3, Side::Buy, 98, 8);
     print(test_trades);
     print(ob);
     assert(test_trades.size() == 0 && "No match at this price");
@@ -360,7 +172,7 @@ int main()
 
     // Test 5: Exact match
     cout << "\n=== TEST 5: Add Sell Order Matching Best Bid (ID=4, Price=100, Qty=10) ===";
-    test_trades = ob.AddOrder(make_shared<Order>(4, Side::Sell, 100, 10));
+    test_trades = ob.AddOrder(4, Side::Sell, 100, 10);
     print(test_trades);
     print(ob);
     assert(test_trades.size() == 1 && "Should produce exactly 1 trade");
@@ -371,7 +183,7 @@ int main()
 
     // Test 6: Partial fill - sell order larger than buy
     cout << "\n=== TEST 6: Partial Fill - Sell > Buy (ID=5, Price=98, Qty=15) ===";
-    test_trades = ob.AddOrder(make_shared<Order>(5, Side::Sell, 98, 15));
+    test_trades = ob.AddOrder(5, Side::Sell, 98, 15);
     print(test_trades);
     print(ob);
     assert(test_trades.size() == 1 && "One trade from partial fill");
@@ -382,15 +194,15 @@ int main()
     // Test 7: Multiple price levels - rebuild book
     cout << "\n=== TEST 7: Build Multi-Level Book ===";
     Trades accumulated_trades;
-    auto t1 = ob.AddOrder(make_shared<Order>(6, Side::Buy, 102, 20));
+    auto t1 = ob.AddOrder(6, Side::Buy, 102, 20);
     accumulated_trades.insert(accumulated_trades.end(), t1.begin(), t1.end());
-    auto t2 = ob.AddOrder(make_shared<Order>(7, Side::Buy, 101, 15));
+    auto t2 = ob.AddOrder(7, Side::Buy, 101, 15);
     accumulated_trades.insert(accumulated_trades.end(), t2.begin(), t2.end());
-    auto t3 = ob.AddOrder(make_shared<Order>(8, Side::Buy, 100, 10));
+    auto t3 = ob.AddOrder(8, Side::Buy, 100, 10);
     accumulated_trades.insert(accumulated_trades.end(), t3.begin(), t3.end());
-    auto t4 = ob.AddOrder(make_shared<Order>(9, Side::Sell, 108, 12));
+    auto t4 = ob.AddOrder(9, Side::Sell, 108, 12);
     accumulated_trades.insert(accumulated_trades.end(), t4.begin(), t4.end());
-    auto t5 = ob.AddOrder(make_shared<Order>(10, Side::Sell, 109, 18));
+    auto t5 = ob.AddOrder(10, Side::Sell, 109, 18);
     accumulated_trades.insert(accumulated_trades.end(), t5.begin(), t5.end());
     print(accumulated_trades);
     print(ob);
@@ -399,7 +211,7 @@ int main()
 
     // Test 8: Aggressive sell order matching multiple levels
     cout << "\n=== TEST 8: Aggressive Sell Crossing Multiple Levels (ID=11, Price=100, Qty=40) ===";
-    test_trades = ob.AddOrder(make_shared<Order>(11, Side::Sell, 100, 40));
+    test_trades = ob.AddOrder(11, Side::Sell, 100, 40);
     print(test_trades);
     print(ob);
     assert(test_trades.size() == 3 && "Should match 3 buy orders at different levels");
@@ -413,11 +225,11 @@ int main()
     // To rest in the book, the Buy Price must be < Best Ask.
     cout << "\n=== TEST 9: FIFO Test - Multiple Orders at Same Price (90) ===";
     accumulated_trades.clear();
-    auto t9a = ob.AddOrder(make_shared<Order>(12, Side::Buy, 90, 5));
+    auto t9a = ob.AddOrder(12, Side::Buy, 90, 5);
     accumulated_trades.insert(accumulated_trades.end(), t9a.begin(), t9a.end());
-    auto t9b = ob.AddOrder(make_shared<Order>(13, Side::Buy, 90, 3));
+    auto t9b = ob.AddOrder(13, Side::Buy, 90, 3);
     accumulated_trades.insert(accumulated_trades.end(), t9b.begin(), t9b.end());
-    auto t9c = ob.AddOrder(make_shared<Order>(14, Side::Buy, 90, 7));
+    auto t9c = ob.AddOrder(14, Side::Buy, 90, 7);
     accumulated_trades.insert(accumulated_trades.end(), t9c.begin(), t9c.end());
     print(accumulated_trades);
     print(ob);
@@ -427,7 +239,7 @@ int main()
     // Test 9b: FIFO Execution
     // NOTE: Sell Price set to 90 to cross Bids. Qty set to 8 to match exactly ID 12(5) and 13(3).
     cout << "\n=== TEST 9b: Sell Order Matching FIFO Queue (ID=15, Price=90, Qty=8) ===";
-    test_trades = ob.AddOrder(make_shared<Order>(15, Side::Sell, 90, 8));
+    test_trades = ob.AddOrder(15, Side::Sell, 90, 8);
     print(test_trades);
     print(ob);
     assert(test_trades.size() == 2 && "Should match exactly 2 orders (5+3=8)");
@@ -439,7 +251,7 @@ int main()
     // NOTE: Using ID 11 (which exists in book) to verify rejection.
     // (ID 12 was removed in Test 9b, so re-adding it would actually be valid).
     cout << "\n=== TEST 10: Duplicate Order ID (ID=11 again) ===";
-    test_trades = ob.AddOrder(make_shared<Order>(11, Side::Sell, 200, 5));
+    test_trades = ob.AddOrder(11, Side::Sell, 200, 5);
     print(test_trades);
     print(ob);
     cout << "(Should show no trades - duplicate rejected)\n";
@@ -449,13 +261,1699 @@ int main()
     // Test 11: Final aggressive order clearing remaining book
     // NOTE: Price 80 is aggressive enough to cross remaining Bid at 90.
     cout << "\n=== TEST 11: Clear Remaining Bids (ID=16, Price=80, Qty=100) ===";
-    test_trades = ob.AddOrder(make_shared<Order>(16, Side::Sell, 80, 100));
+    test_trades = ob.AddOrder(16, Side::Sell, 80, 100);
     print(test_trades);
     print(ob);
     assert(test_trades.size() == 1 && "Should match remaining buy order (ID 14)");
     assert(test_trades[0].buySide.orderId == 14);
     assert(ob.Size() == 5 && "Bid 14 removed, new Sell 16 added (rests with qty 93). Total 5 Asks.");
 
+}
+
+// Tests 14-18: cancel and modify, run once per level container
+template <typename Book>
+void testCancelModify()
+{
+    using namespace std;
+
+    Book ob;
+    Trades test_trades;
+
+    // Test 14: Cancel from the middle of a level and unknown ids
+    cout << "\n=== TEST 14: Cancel Orders ===";
+    ob.AddOrder(1, Side::Buy, 100, 10);
+    ob.AddOrder(2, Side::Buy, 100, 5);
+    ob.AddOrder(3, Side::Buy, 100, 7);
+    ob.AddOrder(4, Side::Buy, 99, 4);
+    ob.AddOrder(5, Side::Sell, 105, 3);
+    bool cancelled = ob.CancelOrder(2);
+    assert(cancelled && "Order 2 rests in the middle of level 100");
+    cancelled = ob.CancelOrder(2);
+    assert(!cancelled && "Already cancelled");
+    cancelled = ob.CancelOrder(42);
+    assert(!cancelled && "Never existed");
+    print(ob);
+    assert(ob.Size() == 4 && "Order 2 removed");
+
+    // Test 15: Quantity reduction at the same price keeps queue priority
+    cout << "\n=== TEST 15: Modify Down Keeps Priority (ID=1 to Qty=6) ===";
+    test_trades = ob.ModifyOrder(1, 100, 6);
+    assert(test_trades.empty() && "Reduction never trades");
+    test_trades = ob.AddOrder(6, Side::Sell, 100, 8);
+    print(test_trades);
+    assert(test_trades.size() == 2 && "Fills order 1 (6) then order 3 (2)");
+    assert(test_trades[0].buySide.orderId == 1 && test_trades[0].buySide.quantity == 6);
+    assert(test_trades[1].buySide.orderId == 3 && test_trades[1].buySide.quantity == 2);
+
+    // Test 16: Quantity increase loses priority
+    cout << "\n=== TEST 16: Modify Up Goes To The Back (ID=3 to Qty=9) ===";
+    ob.AddOrder(7, Side::Buy, 100, 2);
+    test_trades = ob.ModifyOrder(3, 100, 9);
+    assert(test_trades.empty());
+    test_trades = ob.AddOrder(8, Side::Sell, 100, 3);
+    print(test_trades);
+    assert(test_trades.size() == 2 && "Order 7 is now ahead of order 3");
+    assert(test_trades[0].buySide.orderId == 7 && test_trades[1].buySide.orderId == 3);
+
+    // Test 17: Price change re-enters the book and can trade immediately
+    cout << "\n=== TEST 17: Modify Price Crosses The Spread (ID=4 to Price=105, Qty=4) ===";
+    test_trades = ob.ModifyOrder(4, 105, 4);
+    print(test_trades);
+    print(ob);
+    assert(test_trades.size() == 1 && test_trades[0].buySide.orderId == 4 && test_trades[0].sellSide.orderId == 5);
+    assert(test_trades[0].buySide.quantity == 3 && "Ask 5 only had 3");
+    assert(ob.Size() == 2 && "Order 4 rests at 105 with 1, order 3 at 100 with 8");
+
+    // Test 18: Cancelling the only order at the touch reclaims the level
+    cout << "\n=== TEST 18: Cancel Empties The Best Level ===";
+    cancelled = ob.CancelOrder(4);
+    assert(cancelled);
+    test_trades = ob.ModifyOrder(3, 100, 0);
+    assert(test_trades.empty() && ob.Size() == 0 && "Quantity 0 cancels");
+    for (OrderId id = 100; id < 400; ++id)
+    {
+        ob.AddOrder(id, Side::Sell, 200 + static_cast<Price>(id), 1);
+    }
+    for (OrderId id = 101; id < 400; ++id)
+    {
+        cancelled = ob.CancelOrder(id);
+        assert(cancelled); // every level but the best one empties
+    }
+    test_trades = ob.AddOrder(400, Side::Buy, 1000, 5);
+    print(test_trades);
+    print(ob);
+    assert(test_trades.size() == 1 && test_trades[0].sellSide.orderId == 100 && test_trades[0].sellSide.price == 300);
+    assert(ob.Size() == 1 && "The rest of the buy rests");
+}
+
+// Test 19: every level container must produce the same trades for the same random flow
+void testContainersAgree()
+{
+    using namespace std;
+
+    cout << "\n=== TEST 19: Map, Vector and Ladder Books Agree On 20000 Random Operations ===\n";
+    Orderbook<MapLevels> map_book;
+    VectorOrderbook vector_book;
+    LadderOrderbook ladder_book;
+
+    mt19937 rng(7);
+    uniform_int_distribution<int> op(0, 9);
+    uniform_int_distribution<Price> price(90, 110);
+    uniform_int_distribution<Quantity> qty(1, 20);
+    OrderId next_id = 1;
+    size_t trade_count = 0;
+
+    auto same = [](const Trades &a, const Trades &b)
+    {
+        if (a.size() != b.size())
+            return false;
+        for (size_t i = 0; i < a.size(); ++i)
+        {
+            if (a[i].buySide.orderId != b[i].buySide.orderId || a[i].sellSide.orderId != b[i].sellSide.orderId ||
+                a[i].buySide.quantity != b[i].buySide.quantity || a[i].sellSide.price != b[i].sellSide.price)
+                return false;
+        }
+        return true;
+    };
+
+    for (int i = 0; i < 20000; ++i)
+    {
+        const int what = op(rng);
+        if (what < 6)
+        {
+            const Side side = what % 2 ? Side::Buy : Side::Sell;
+            const Price p = price(rng);
+            const Quantity q = qty(rng);
+            const Trades a = map_book.AddOrder(next_id, side, p, q);
+            const Trades b = vector_book.AddOrder(next_id, side, p, q);
+            const Trades c = ladder_book.AddOrder(next_id, side, p, q);
+            assert(same(a, b) && same(a, c));
+            trade_count += a.size();
+            ++next_id;
+        }
+        else if (what < 9)
+        {
+            const OrderId id = uniform_int_distribution<OrderId>(1, next_id)(rng);
+            const bool cancelled = map_book.CancelOrder(id);
+            const bool vector_cancelled = vector_book.CancelOrder(id);
+            const bool ladder_cancelled = ladder_book.CancelOrder(id);
+            assert(cancelled == vector_cancelled && cancelled == ladder_cancelled);
+        }
+        else
+        {
+            const OrderId id = uniform_int_distribution<OrderId>(1, next_id)(rng);
+            const Price p = price(rng);
+            const Quantity q = qty(rng);
+            const Trades a = map_book.ModifyOrder(id, p, q);
+            const Trades b = vector_book.ModifyOrder(id, p, q);
+            const Trades c = ladder_book.ModifyOrder(id, p, q);
+            assert(same(a, b) && same(a, c));
+            trade_count += a.size();
+        }
+        assert(map_book.Size() == vector_book.Size() && map_book.Size() == ladder_book.Size());
+
+        // the per-level totals agree too
+        for (const Side side : {Side::Buy, Side::Sell})
+        {
+            LevelInfo a[8], b[8], c[8];
+            const size_t n = map_book.Depth(side, a);
+            assert(n == vector_book.Depth(side, b) && n == ladder_book.Depth(side, c));
+            for (size_t l = 0; l < n; ++l)
+            {
+                assert(a[l].price == b[l].price && a[l].price == c[l].price);
+                assert(a[l].quantity == b[l].quantity && a[l].quantity == c[l].quantity);
+                assert(a[l].orders == b[l].orders && a[l].orders == c[l].orders);
+            }
+        }
+    }
+    cout << "Trades: " << trade_count << ", resting orders: " << map_book.Size() << "\n";
+}
+
+void testTradeSink()
+{
+    using namespace std;
+
+    // Test 20: Fills streamed into a caller-owned buffer that is reused across orders
+    cout << "\n=== TEST 20: Trade Sink Into A Reused Buffer ===\n";
+    Orderbook ob;
+    Trades buffer;
+    buffer.reserve(64);
+    const Trade *const storage = buffer.data();
+    auto sink = [&buffer](const Trade &trade)
+    { buffer.push_back(trade); };
+
+    for (OrderId id = 1; id <= 10; ++id)
+    {
+        const bool added = ob.AddOrder(id, Side::Sell, 100 + static_cast<Price>(id % 3), 5, sink);
+        assert(added);
+    }
+    assert(buffer.empty() && "Nothing crosses yet");
+    bool accepted = ob.AddOrder(3, Side::Sell, 100, 5, sink);
+    assert(!accepted && "Duplicate id is reported");
+
+    accepted = ob.AddOrder(11, Side::Buy, 101, 12, sink);
+    assert(accepted);
+    print(buffer);
+    assert(buffer.size() == 3 && "Level 100 holds 3 (5 each); 12 takes two of them and part of the third");
+    assert(buffer[0].sellSide.orderId == 3 && buffer[1].sellSide.orderId == 6 && buffer[2].sellSide.orderId == 9);
+    assert(buffer[2].sellSide.quantity == 2);
+
+    buffer.clear();
+    size_t count = 0;
+    Quantity volume = 0;
+    auto counter = [&count, &volume](const Trade &trade)
+    {
+        ++count;
+        volume += trade.buySide.quantity;
+    };
+    bool modified = ob.ModifyOrder(9, 102, 3, counter);
+    assert(modified && "Reprice, no cross");
+    modified = ob.ModifyOrder(99, 102, 3, counter);
+    assert(!modified && "Unknown id is reported");
+    accepted = ob.AddOrder(12, Side::Buy, 102, 100, counter);
+    assert(accepted);
+    cout << "Counted " << count << " fills, volume " << volume << "\n";
+    assert(count == 8 && volume == 38 && "Sweeps every remaining ask (3 + 5*7)");
+    assert(buffer.data() == storage && "The buffer never reallocated");
+}
+
+// Test 21: AddOrders gives the same result as one AddOrder per request, on every container
+template <typename Book>
+void testBatchSubmission()
+{
+    using namespace std;
+
+    cout << "\n=== TEST 21: Batch Submission Matches One-By-One Submission ===\n";
+    Book batched;
+    Book single;
+    Trades trades;
+    vector<uint32_t> offsets;
+
+    mt19937 rng(11);
+    uniform_int_distribution<Price> price(95, 105);
+    uniform_int_distribution<Quantity> qty(1, 10);
+    OrderId next_id = 1;
+    size_t total_trades = 0;
+
+    for (int round = 0; round < 200; ++round)
+    {
+        vector<OrderRequest> batch;
+        const size_t size = 1 + round % 50;
+        for (size_t i = 0; i < size; ++i)
+        {
+            // every 7th request reuses an id from earlier in the flow, to exercise duplicate rejection
+            const OrderId id = i % 7 == 6 ? next_id - 3 : next_id++;
+            const Side side = rng() % 2 ? Side::Buy : Side::Sell;
+            // bursts at one price, as a gateway tends to forward them
+            const Price p = i % 4 == 0 || batch.empty() ? price(rng) : batch.back().price;
+            batch.push_back({id, side, p, qty(rng)});
+        }
+
+        size_t expected_accepted = 0;
+        Trades expected;
+        vector<uint32_t> expected_offsets;
+        for (const OrderRequest &request : batch)
+        {
+            expected_offsets.push_back(static_cast<uint32_t>(expected.size()));
+            const bool accepted = single.AddOrder(request.id, request.side, request.price, request.quantity,
+                                                  [&expected](const Trade &trade)
+                                                  { expected.push_back(trade); });
+            expected_accepted += accepted;
+        }
+        expected_offsets.push_back(static_cast<uint32_t>(expected.size()));
+
+        const size_t accepted = batched.AddOrders(batch, trades, offsets);
+        assert(accepted == expected_accepted);
+        assert(offsets == expected_offsets && "Per-order offsets line up with one-by-one submission");
+        assert(trades.size() == expected.size());
+        for (size_t i = 0; i < trades.size(); ++i)
+        {
+            assert(trades[i].buySide.orderId == expected[i].buySide.orderId);
+            assert(trades[i].sellSide.orderId == expected[i].sellSide.orderId);
+            assert(trades[i].buySide.quantity == expected[i].buySide.quantity);
+            assert(trades[i].sellSide.price == expected[i].sellSide.price);
+        }
+        assert(batched.Size() == single.Size());
+        total_trades += trades.size();
+    }
+    cout << "Trades: " << total_trades << ", resting orders: " << batched.Size() << "\n";
+}
+
+void testOrderIndex()
+{
+    using namespace std;
+
+    // Test 22: The flat index agrees with std::unordered_map under heavy insert/erase churn
+    cout << "\n=== TEST 22: Open-Addressing Order Index vs std::unordered_map ===\n";
+    OrderIndex index(8);
+    unordered_map<OrderId, OrderHandle> reference;
+    mt19937_64 rng(5);
+
+    for (int i = 0; i < 200000; ++i)
+    {
+        // mostly sequential ids, like a venue assigns them, plus some random ones
+        const OrderId key = i % 5 == 0 ? rng() : static_cast<OrderId>(i / 2);
+        const bool present = reference.contains(key);
+        assert(index.contains(key) == present);
+        if (!present && rng() % 3 != 0)
+        {
+            index.insert(key, static_cast<OrderHandle>(i));
+            reference[key] = static_cast<OrderHandle>(i);
+        }
+        else if (present)
+        {
+            assert(*index.find(key) == reference[key]);
+            const bool erased = index.erase(key);
+            assert(erased);
+            reference.erase(key);
+        }
+        else
+        {
+            const bool erased = index.erase(key);
+            assert(!erased);
+        }
+        assert(index.size() == reference.size());
+    }
+    for (const auto &[key, value] : reference)
+    {
+        assert(index.find(key) != nullptr && *index.find(key) == value);
+    }
+    cout << "Entries left: " << index.size() << "\n";
+}
+
+void testEngineIds()
+{
+    using namespace std;
+
+    // Test 23: The book issues generation-tagged slot ids; stale ids never resolve
+    cout << "\n=== TEST 23: Engine-Assigned Order Ids ===\n";
+    Orderbook ob(OrderbookConfig{.engineIds = true});
+    Trades trades;
+    auto sink = [&trades](const Trade &trade)
+    { trades.push_back(trade); };
+
+    const OrderId bid1 = ob.AddOrder(Side::Buy, 100, 10, sink);
+    const OrderId bid2 = ob.AddOrder(Side::Buy, 100, 5, sink);
+    const OrderId ask1 = ob.AddOrder(Side::Sell, 105, 4, sink);
+    cout << "Issued ids: " << hex << bid1 << ", " << bid2 << ", " << ask1 << dec << "\n";
+    assert(bid1 != bid2 && bid2 != ask1 && ob.Size() == 3 && trades.empty());
+
+    const OrderId sell = ob.AddOrder(Side::Sell, 100, 10, sink);
+    assert(trades.size() == 1 && trades[0].buySide.orderId == bid1 && trades[0].sellSide.orderId == sell);
+    assert(ob.Size() == 2 && "Bid 1 and the aggressive sell are gone");
+    bool cancelled = ob.CancelOrder(bid1);
+    assert(!cancelled && "Filled order's id is stale");
+    cancelled = ob.CancelOrder(sell);
+    assert(!cancelled && "A fully filled aggressor never rested");
+
+    // the freed slots are reused, but under a new generation
+    const OrderId reused = ob.AddOrder(Side::Buy, 99, 1, sink);
+    assert(static_cast<uint32_t>(reused) == static_cast<uint32_t>(sell) || static_cast<uint32_t>(reused) == static_cast<uint32_t>(bid1));
+    assert(reused != bid1 && reused != sell);
+    cancelled = ob.CancelOrder(bid1) || ob.CancelOrder(sell);
+    assert(!cancelled && "Old ids still don't resolve to the new order");
+
+    trades.clear();
+    const bool modified = ob.ModifyOrder(bid2, 105, 6, sink);
+    assert(modified && "Reprice through the ask keeps the id");
+    assert(trades.size() == 1 && trades[0].buySide.orderId == bid2 && trades[0].buySide.quantity == 4);
+    cancelled = ob.CancelOrder(bid2);
+    assert(cancelled && "Rest of bid 2 still rests under the same id");
+    cancelled = ob.CancelOrder(reused);
+    assert(cancelled && ob.Size() == 0);
+    cancelled = ob.CancelOrder(12345) || ob.CancelOrder(~OrderId{0});
+    assert(!cancelled && "Ids that were never issued");
+
+    bool threw = false;
+    try
+    {
+        ob.AddOrder(1, Side::Buy, 100, 1);
+    }
+    catch (const logic_error &)
+    {
+        threw = true;
+    }
+    assert(threw && "Client ids are refused by an engine-id book");
+}
+
+// Test 24: Top of book and depth follow adds, fills, cancels and reductions
+template <typename Book>
+void testTopOfBook()
+{
+    using namespace std;
+
+    cout << "\n=== TEST 24: Best Bid/Ask, Spread and Depth ===\n";
+    Book ob;
+    assert(!ob.BestBid() && !ob.BestAsk() && !ob.Spread() && "Empty book has no top");
+
+    ob.AddOrder(1, Side::Buy, 100, 10);
+    ob.AddOrder(2, Side::Buy, 100, 5);
+    ob.AddOrder(3, Side::Buy, 98, 7);
+    ob.AddOrder(4, Side::Sell, 103, 4);
+    ob.AddOrder(5, Side::Sell, 104, 6);
+    ob.AddOrder(6, Side::Sell, 104, 1);
+    assert(ob.BestBid()->price == 100 && ob.BestBid()->quantity == 15 && ob.BestBid()->orders == 2);
+    assert(ob.BestAsk()->price == 103 && ob.BestAsk()->quantity == 4 && ob.BestAsk()->orders == 1);
+    assert(*ob.Spread() == 3);
+
+    LevelInfo levels[5];
+    assert(ob.Depth(Side::Sell, levels) == 2);
+    assert(levels[1].price == 104 && levels[1].quantity == 7 && levels[1].orders == 2);
+    assert(ob.Depth(Side::Buy, span<LevelInfo>(levels, 1)) == 1 && levels[0].price == 100 && "Only n levels written");
+
+    ob.AddOrder(7, Side::Sell, 100, 12); // fills order 1, partially fills order 2
+    assert(ob.BestBid()->price == 100 && ob.BestBid()->quantity == 3 && ob.BestBid()->orders == 1);
+    ob.ModifyOrder(2, 100, 1); // reduce in place
+    assert(ob.BestBid()->quantity == 1);
+    ob.CancelOrder(2);
+    assert(ob.BestBid()->price == 98 && ob.BestBid()->quantity == 7 && *ob.Spread() == 5);
+    ob.CancelOrder(4);
+    assert(ob.BestAsk()->price == 104 && ob.BestAsk()->orders == 2);
+    cout << "Best bid " << ob.BestBid()->price << " x " << ob.BestBid()->quantity << ", best ask "
+         << ob.BestAsk()->price << " x " << ob.BestAsk()->quantity << "\n";
+}
+
+void testPoolReuse()
+{
+    using namespace std;
+
+    // Test 12: Filled orders return their slot to the pool, so add/fill cycles don't grow it
+    cout << "\n=== TEST 12: Pool Reuse Over 100000 Add/Fill Cycles ===\n";
+    Trades test_trades;
+    Orderbook pooled(16);
+    const size_t warm_capacity = pooled.Capacity();
+    for (OrderId id = 1; id <= 200000; id += 2)
+    {
+        pooled.AddOrder(id, Side::Buy, 100, 10);
+        test_trades = pooled.AddOrder(id + 1, Side::Sell, 100, 10);
+        assert(test_trades.size() == 1 && "Every sell fills the resting buy");
+    }
+    cout << "Pool capacity before: " << warm_capacity << " after: " << pooled.Capacity() << "\n";
+    assert(pooled.Size() == 0 && "All orders filled");
+    assert(pooled.Capacity() == warm_capacity && "Filled orders are recycled, pool never grows");
+}
+
+void testLadderRecentering()
+{
+    using namespace std;
+
+    // Test 13: Ladder re-centers when prices drift out of its window, and grows when the book is too wide
+    cout << "\n=== TEST 13: Ladder Re-centering (tick 5, 64-level window) ===";
+    LadderOrderbook ob(OrderbookConfig{.tickSize = 5, .ladderLevels = 64});
+    Trades test_trades;
+    ob.AddOrder(1, Side::Buy, 1000, 10);
+    ob.AddOrder(2, Side::Sell, 1010, 10);
+    ob.AddOrder(3, Side::Sell, 5000, 7);  // far above the window: re-center and grow
+    ob.AddOrder(4, Side::Buy, 50, 3);     // far below
+    ob.AddOrder(5, Side::Sell, 1005, 4);  // new best ask after the move
+    print(ob);
+    assert(ob.Size() == 5 && "All orders rest, nothing crosses");
+
+    test_trades = ob.AddOrder(6, Side::Buy, 5000, 21);
+    print(test_trades);
+    assert(test_trades.size() == 3 && "Sweeps asks 1005, 1010 and 5000 in price order");
+    assert(test_trades[0].sellSide.orderId == 5 && test_trades[0].sellSide.price == 1005);
+    assert(test_trades[1].sellSide.orderId == 2 && test_trades[1].sellSide.price == 1010);
+    assert(test_trades[2].sellSide.orderId == 3 && test_trades[2].sellSide.quantity == 7);
+
+    test_trades = ob.AddOrder(7, Side::Sell, 50, 13);
+    print(test_trades);
+    print(ob);
+    assert(test_trades.size() == 2 && "Hits bid 1000 then bid 50");
+    assert(test_trades[0].buySide.orderId == 1 && test_trades[1].buySide.orderId == 4);
+    assert(ob.Size() == 0 && "Book is empty again");
+
+    bool threw = false;
+    try
+    {
+        ob.AddOrder(8, Side::Buy, 1001, 1);
+    }
+    catch (const invalid_argument &)
+    {
+        threw = true;
+    }
+    assert(threw && "Prices off the tick grid are rejected");
+
+    // the window stops growing at windowLimit: a price that would stretch the live range past
+    // half of it is rejected before it trades, and the book is left as it was
+    LadderOrderbook capped(OrderbookConfig{.ladderLevels = 64, .windowLimit = 256});
+    capped.AddOrder(1, Side::Sell, 100, 5);
+    capped.AddOrder(2, Side::Sell, 220, 5); // 121 ticks: re-center and grow to the limit
+    threw = false;
+    try
+    {
+        capped.AddOrder(3, Side::Sell, 100000000, 5);
+    }
+    catch (const invalid_argument &)
+    {
+        threw = true;
+    }
+    assert(threw && "An outlier beyond the window is rejected");
+    threw = false;
+    try
+    {
+        capped.ModifyOrder(1, 400, 5);
+    }
+    catch (const invalid_argument &)
+    {
+        threw = true;
+    }
+    assert(threw && capped.Size() == 2 && capped.BestAsk()->price == 100 && "A move beyond the window changes nothing");
+
+    // a fired stop-limit has nobody to throw to: its remainder is dropped instead of resting
+    capped.AddStopLimitOrder(4, Side::Buy, 100, 160, 10);
+    capped.AddOrder(5, Side::Buy, 25, 1);
+    const Trades trigger_trades = capped.AddOrder(6, Side::Buy, 100, 1);
+    assert(trigger_trades.size() == 2 && trigger_trades[1].buySide.orderId == 4 && trigger_trades[1].buySide.quantity == 4);
+    assert(capped.Size() == 2 && capped.BestBid()->price == 25 && capped.BestAsk()->price == 220);
+    const bool cancelled = capped.CancelOrder(4);
+    assert(!cancelled && "The remainder did not rest");
+}
+
+void testDepthIndex()
+{
+    using namespace std;
+
+    cout << "\n=== TEST 25: Fenwick Depth Index Agrees With Walking The Levels ===\n";
+    Orderbook<MapLevels> ob(OrderbookConfig{.tickSize = 5, .ladderLevels = 64, .depthIndex = true});
+    ob.AddOrder(1, Side::Sell, 105, 10);
+    ob.AddOrder(2, Side::Sell, 110, 20);
+    ob.AddOrder(3, Side::Sell, 120, 30);
+    ob.AddOrder(4, Side::Buy, 100, 5);
+    ob.AddOrder(5, Side::Buy, 90, 15);
+    assert(ob.QuantityAtOrBetter(Side::Sell, 110) == 30 && ob.QuantityAtOrBetter(Side::Sell, 100) == 0);
+    assert(ob.QuantityAtOrBetter(Side::Buy, 90) == 20 && ob.QuantityAtOrBetter(Side::Buy, 10000) == 0);
+    assert(*ob.SweepVwap(Side::Buy, 20) == (105.0 * 10 + 110.0 * 10) / 20);
+    assert(*ob.SweepVwap(Side::Sell, 20) == (100.0 * 5 + 90.0 * 15) / 20);
+    assert(!ob.SweepVwap(Side::Buy, 61) && "Not enough liquidity to fill");
+    cout << "VWAP to buy 20: " << *ob.SweepVwap(Side::Buy, 20) << "\n";
+
+    // a far-off outlier doesn't stretch the window past its limit, it stays out of the index
+    Orderbook<MapLevels> outlier(OrderbookConfig{.depthIndex = true});
+    outlier.AddOrder(1, Side::Sell, 100, 10);
+    outlier.AddOrder(2, Side::Sell, 1000000000, 5);
+    assert(outlier.Size() == 2 && *outlier.SweepVwap(Side::Buy, 10) == 100.0);
+    assert(*outlier.SweepVwap(Side::Buy, 15) == (100.0 * 10 + 1e9 * 5) / 15);
+    assert(outlier.QuantityAtOrBetter(Side::Sell, 1000000000) == 15);
+    const bool cancelled = outlier.CancelOrder(2);
+    assert(cancelled && outlier.Size() == 1);
+
+    // random flow on a narrow window, so the index re-centers and grows along the way
+    Orderbook<MapLevels> indexed(OrderbookConfig{.tickSize = 5, .ladderLevels = 64, .depthIndex = true});
+    Orderbook<MapLevels> plain(OrderbookConfig{.tickSize = 5});
+    // and on one capped below the price range, so part of each side is left unindexed
+    Orderbook<MapLevels> capped(OrderbookConfig{.tickSize = 5, .ladderLevels = 64, .windowLimit = 128, .depthIndex = true});
+    mt19937 rng(25);
+    uniform_int_distribution<int> op(0, 9);
+    uniform_int_distribution<Price> tick(0, 400);
+    uniform_int_distribution<Quantity> qty(1, 20);
+    OrderId next_id = 1;
+    for (int i = 0; i < 20000; ++i)
+    {
+        const int what = op(rng);
+        const Price p = 5 * tick(rng);
+        if (what < 6)
+        {
+            const Side side = what % 2 ? Side::Buy : Side::Sell;
+            const Quantity q = qty(rng);
+            indexed.AddOrder(next_id, side, p, q);
+            plain.AddOrder(next_id, side, p, q);
+            capped.AddOrder(next_id, side, p, q);
+            ++next_id;
+        }
+        else if (what < 9)
+        {
+            const OrderId id = uniform_int_distribution<OrderId>(1, next_id)(rng);
+            const bool found = plain.CancelOrder(id);
+            const bool indexed_found = indexed.CancelOrder(id);
+            const bool capped_found = capped.CancelOrder(id);
+            assert(indexed_found == found && capped_found == found);
+        }
+        else
+        {
+            const OrderId id = uniform_int_distribution<OrderId>(1, next_id)(rng);
+            const Quantity q = qty(rng);
+            indexed.ModifyOrder(id, p, q);
+            plain.ModifyOrder(id, p, q);
+            capped.ModifyOrder(id, p, q);
+        }
+
+        const Price limit = 5 * tick(rng);
+        const uint64_t amount = qty(rng) * 10;
+        for (const Side side : {Side::Buy, Side::Sell})
+        {
+            assert(indexed.QuantityAtOrBetter(side, limit) == plain.QuantityAtOrBetter(side, limit));
+            assert(capped.QuantityAtOrBetter(side, limit) == plain.QuantityAtOrBetter(side, limit));
+            const optional<double> a = indexed.SweepVwap(side, amount), b = plain.SweepVwap(side, amount);
+            assert(a.has_value() == b.has_value() && (!a || *a == *b));
+            const optional<double> c = capped.SweepVwap(side, amount);
+            assert(c.has_value() == b.has_value() && (!c || *c == *b));
+        }
+    }
+    cout << "Resting orders: " << indexed.Size() << ", bid depth at or above 1000: "
+         << indexed.QuantityAtOrBetter(Side::Buy, 1000) << "\n";
+}
+
+template <typename Book>
+void testQueuePosition()
+{
+    using namespace std;
+
+    cout << "\n=== TEST 26: Quantity Ahead In The Queue ===\n";
+    Book ob(OrderbookConfig{.queuePositions = true});
+    ob.AddOrder(1, Side::Buy, 100, 10);
+    ob.AddOrder(2, Side::Buy, 100, 20);
+    ob.AddOrder(3, Side::Buy, 100, 30);
+    ob.AddOrder(4, Side::Buy, 99, 40);
+    assert(*ob.QuantityAhead(1) == 0 && *ob.QuantityAhead(3) == 30 && *ob.QuantityAhead(4) == 0);
+    ob.AddOrder(5, Side::Sell, 100, 15); // fills 1, takes 5 off order 2
+    assert(*ob.QuantityAhead(2) == 0 && *ob.QuantityAhead(3) == 15);
+    ob.ModifyOrder(2, 100, 5);           // reduce in place keeps its place
+    assert(*ob.QuantityAhead(3) == 5);
+    ob.ModifyOrder(2, 100, 50);          // increase goes to the back
+    assert(*ob.QuantityAhead(3) == 0 && *ob.QuantityAhead(2) == 30);
+    assert(!ob.QuantityAhead(1) && !ob.QuantityAhead(5) && "Filled orders have no place");
+
+    // deep levels with fills, cancels and modifies all over them, checked against walking the queue
+    Book indexed(OrderbookConfig{.queuePositions = true});
+    Book plain;
+    mt19937 rng(26);
+    uniform_int_distribution<int> op(0, 9);
+    uniform_int_distribution<Quantity> qty(1, 100);
+    uniform_int_distribution<Price> level(200, 202);
+    OrderId next_id = 1;
+    for (; next_id <= 30000; ++next_id)
+    {
+        const Quantity q = qty(rng);
+        const Price p = level(rng);
+        indexed.AddOrder(next_id, Side::Sell, p, q);
+        plain.AddOrder(next_id, Side::Sell, p, q);
+    }
+    for (int i = 0; i < 30000; ++i)
+    {
+        const int what = op(rng);
+        const OrderId id = uniform_int_distribution<OrderId>(1, next_id)(rng);
+        const Quantity q = qty(rng);
+        const Price p = level(rng);
+        if (what < 4)
+        {
+            indexed.AddOrder(next_id, Side::Sell, p, q);
+            plain.AddOrder(next_id, Side::Sell, p, q);
+            ++next_id;
+        }
+        else if (what < 6)
+        {
+            indexed.AddOrder(next_id, Side::Buy, 200, q * 3); // eats the front of the 200 level
+            plain.AddOrder(next_id, Side::Buy, 200, q * 3);
+            ++next_id;
+        }
+        else if (what < 8)
+        {
+            const bool cancelled = indexed.CancelOrder(id);
+            const bool plain_cancelled = plain.CancelOrder(id);
+            assert(cancelled == plain_cancelled);
+        }
+        else
+        {
+            indexed.ModifyOrder(id, p, q);
+            plain.ModifyOrder(id, p, q);
+        }
+        const OrderId probe = uniform_int_distribution<OrderId>(1, next_id)(rng);
+        assert(indexed.QuantityAhead(probe) == plain.QuantityAhead(probe));
+    }
+    cout << "Resting orders: " << indexed.Size() << ", ahead of the newest: "
+         << indexed.QuantityAhead(next_id - 1).value_or(0) << "\n";
+}
+
+template <typename Book>
+void testTimeInForce()
+{
+    using namespace std;
+
+    cout << "\n=== TEST 27: IOC, FOK And Market Orders ===\n";
+    for (const bool indexed : {false, true}) // FOK checks liquidity by walking levels, or with the depth index
+    {
+        Book ob(OrderbookConfig{.depthIndex = indexed});
+        Trades test_trades;
+        ob.AddOrder(1, Side::Sell, 101, 10);
+        ob.AddOrder(2, Side::Sell, 102, 10);
+        ob.AddOrder(3, Side::Sell, 104, 10);
+        ob.AddOrder(4, Side::Buy, 99, 10);
+
+        test_trades = ob.AddOrder(5, Side::Buy, 102, 25, TimeInForce::ImmediateOrCancel);
+        assert(test_trades.size() == 2 && "IOC takes what crosses");
+        const bool cancelled = ob.CancelOrder(5);
+        assert(ob.Size() == 2 && !cancelled && "and the rest is dropped, not rested");
+
+        ob.AddOrder(6, Side::Sell, 102, 10);
+        test_trades = ob.AddOrder(7, Side::Buy, 103, 11, TimeInForce::FillOrKill);
+        assert(test_trades.empty() && ob.Size() == 3 && "Only 10 at or below 103: killed, book untouched");
+        test_trades = ob.AddOrder(8, Side::Buy, 104, 20, TimeInForce::FillOrKill);
+        assert(test_trades.size() == 2 && test_trades[1].buySide.quantity == 10 && ob.Size() == 1);
+
+        ob.AddOrder(9, Side::Sell, 105, 5);
+        test_trades = ob.AddMarketOrder(10, Side::Sell, 30);
+        assert(test_trades.size() == 1 && test_trades[0].sellSide.price == 99 && "Market trades at the resting price");
+        assert(!ob.BestBid() && ob.Size() == 1 && "The unfilled 20 never rests");
+        test_trades = ob.AddMarketOrder(11, Side::Buy, 6, TimeInForce::FillOrKill);
+        assert(test_trades.empty() && ob.Size() == 1);
+        test_trades = ob.AddMarketOrder(12, Side::Buy, 5, TimeInForce::FillOrKill);
+        assert(test_trades.size() == 1 && test_trades[0].buySide.price == 105 && ob.Size() == 0);
+
+        // a batch mixes them freely
+        vector<OrderRequest> batch = {
+            {20, Side::Sell, 100, 10},
+            {21, Side::Buy, 100, 15, TimeInForce::ImmediateOrCancel},
+            {22, Side::Sell, 100, 10},
+            {23, Side::Buy, 0, 25, TimeInForce::FillOrKill, OrderType::Market},
+            {24, Side::Buy, 0, 4, TimeInForce::ImmediateOrCancel, OrderType::Market},
+        };
+        Trades trades;
+        vector<uint32_t> offsets;
+        const size_t accepted = ob.AddOrders(batch, trades, offsets);
+        assert(accepted == 5);
+        assert(offsets[2] - offsets[1] == 1 && offsets[4] == offsets[3] && offsets[5] - offsets[4] == 1);
+        assert(ob.Size() == 1 && ob.BestAsk()->quantity == 6);
+    }
+
+    Book engine(OrderbookConfig{.engineIds = true});
+    auto ignore = [](const Trade &) {};
+    const OrderId resting = engine.AddOrder(Side::Buy, 100, 10, ignore);
+    engine.AddOrder(Side::Sell, 100, 15, TimeInForce::ImmediateOrCancel, ignore);
+    const bool cancelled = engine.CancelOrder(resting);
+    assert(engine.Size() == 0 && !cancelled);
+    cout << "IOC, FOK and market orders never rest\n";
+}
+
+template <typename Book>
+void testIceberg()
+{
+    using namespace std;
+
+    cout << "\n=== TEST 28: Iceberg Orders ===\n";
+    Book ob(OrderbookConfig{.depthIndex = true, .queuePositions = true});
+    Trades test_trades;
+    ob.AddIcebergOrder(1, Side::Sell, 100, 100, 10);
+    ob.AddOrder(2, Side::Sell, 100, 5);
+    assert(ob.BestAsk()->quantity == 15 && ob.BestAsk()->orders == 2 && "Only the clip is displayed");
+    assert(ob.QuantityAtOrBetter(Side::Sell, 100) == 15 && *ob.QuantityAhead(2) == 10);
+
+    test_trades = ob.AddOrder(3, Side::Buy, 100, 12);
+    print(test_trades);
+    assert(test_trades.size() == 2 && "Clip fills, refills at the back, then order 2 is next");
+    assert(test_trades[0].sellSide.orderId == 1 && test_trades[0].sellSide.quantity == 10);
+    assert(test_trades[1].sellSide.orderId == 2 && test_trades[1].sellSide.quantity == 2);
+    assert(ob.BestAsk()->quantity == 13 && *ob.QuantityAhead(1) == 3);
+
+    test_trades = ob.AddOrder(4, Side::Buy, 100, 50);
+    assert(test_trades.size() == 6 && test_trades[0].sellSide.orderId == 2 && "Order 2, then five clips");
+    assert(test_trades[5].sellSide.orderId == 1 && test_trades[5].sellSide.quantity == 7);
+    assert(ob.Size() == 1 && ob.BestAsk()->quantity == 3);
+    print(ob);
+
+    // 43 left in total, 3 of it shown: the reserve is what a fill-or-kill can count on
+    test_trades = ob.AddOrder(5, Side::Buy, 100, 44, TimeInForce::FillOrKill);
+    assert(test_trades.empty());
+    ob.ModifyOrder(1, 100, 20); // cuts the reserve, the clip keeps its place
+    assert(ob.BestAsk()->quantity == 3);
+    test_trades = ob.AddOrder(6, Side::Buy, 100, 21, TimeInForce::FillOrKill);
+    assert(test_trades.empty());
+    test_trades = ob.AddOrder(7, Side::Buy, 100, 20, TimeInForce::FillOrKill);
+    assert(test_trades.size() == 3 && ob.Size() == 0 && "3, then clips of 10 and 7");
+
+    // an aggressive iceberg matches its full size, then rests as clips; moving it keeps the clip size
+    ob.AddOrder(8, Side::Sell, 101, 5);
+    test_trades = ob.AddIcebergOrder(9, Side::Buy, 101, 30, 4);
+    assert(test_trades.size() == 1 && test_trades[0].buySide.quantity == 5);
+    assert(ob.BestBid()->price == 101 && ob.BestBid()->quantity == 4);
+    ob.ModifyOrder(9, 99, 25);
+    assert(ob.BestBid()->price == 99 && ob.BestBid()->quantity == 4);
+    test_trades = ob.AddMarketOrder(10, Side::Sell, 25);
+    assert(test_trades.size() == 7 && ob.Size() == 0 && "Six clips of 4 and the last 1");
+    ob.AddIcebergOrder(11, Side::Sell, 100, 30, 4);
+    const bool cancelled = ob.CancelOrder(11);
+    test_trades = ob.AddMarketOrder(12, Side::Buy, 1, TimeInForce::FillOrKill);
+    assert(cancelled && ob.Size() == 0 && test_trades.empty());
+    cout << "Iceberg clips refill inside matching\n";
+}
+
+template <typename Book>
+void testStopOrders()
+{
+    using namespace std;
+
+    cout << "\n=== TEST 29: Stop And Stop-Limit Orders ===\n";
+    Book ob;
+    Trades test_trades;
+    ob.AddOrder(1, Side::Sell, 101, 5);
+    ob.AddOrder(2, Side::Sell, 102, 5);
+    ob.AddOrder(3, Side::Sell, 103, 5);
+    ob.AddOrder(4, Side::Sell, 105, 10);
+    ob.AddOrder(5, Side::Buy, 99, 10);
+    ob.AddStopOrder(10, Side::Buy, 102, 4);
+    ob.AddStopOrder(11, Side::Sell, 98, 3);
+    ob.AddStopLimitOrder(12, Side::Buy, 101, 102, 20);
+    assert(ob.PendingStops() == 3 && ob.Size() == 5 && "Pending stops are not in the book");
+    test_trades = ob.ModifyOrder(10, 103, 5);
+    assert(!ob.QuantityAhead(10) && test_trades.empty() && ob.PendingStops() == 3);
+    test_trades = ob.AddOrder(12, Side::Buy, 90, 1);
+    assert(test_trades.empty() && ob.Size() == 5 && "Stop ids are taken");
+
+    // 101 prints, firing 12 (stop 101), whose fill at 102 fires 10 (stop 102) in turn
+    test_trades = ob.AddOrder(13, Side::Buy, 101, 7);
+    print(test_trades);
+    assert(test_trades.size() == 3 && *ob.LastTradePrice() == 103);
+    assert(test_trades[0].buySide.orderId == 13 && test_trades[0].sellSide.price == 101);
+    assert(test_trades[1].buySide.orderId == 12 && test_trades[1].sellSide.price == 102);
+    assert(test_trades[2].buySide.orderId == 10 && test_trades[2].sellSide.price == 103 && test_trades[2].buySide.quantity == 4);
+    assert(ob.PendingStops() == 1 && ob.BestBid()->price == 102 && ob.BestBid()->quantity == 15);
+
+    test_trades = ob.AddMarketOrder(14, Side::Sell, 30);
+    assert(test_trades.size() == 3 && *ob.LastTradePrice() == 99 && ob.PendingStops() == 1 && "99 doesn't reach 98");
+    ob.AddOrder(20, Side::Buy, 98, 5);
+    test_trades = ob.AddOrder(21, Side::Sell, 98, 1);
+    assert(test_trades.size() == 2 && test_trades[1].sellSide.orderId == 11 && test_trades[1].sellSide.quantity == 3);
+    assert(ob.PendingStops() == 0 && ob.BestBid()->quantity == 1);
+
+    ob.AddStopOrder(30, Side::Sell, 50, 2);
+    bool cancelled = ob.CancelOrder(30);
+    assert(cancelled && ob.PendingStops() == 0);
+    cancelled = ob.CancelOrder(30);
+    assert(!cancelled);
+    test_trades = ob.AddStopOrder(31, Side::Buy, 90, 1);
+    assert(test_trades.size() == 1 && test_trades[0].sellSide.orderId == 3 && "Already reached: enters at once");
+
+    // in a batch, the fired stops' fills land with the order that fired them
+    ob.AddStopOrder(40, Side::Buy, 104, 10);
+    vector<OrderRequest> batch = {{41, Side::Buy, 105, 2}, {42, Side::Buy, 100, 1}};
+    Trades trades;
+    vector<uint32_t> offsets;
+    ob.AddOrders(batch, trades, offsets);
+    assert(offsets[1] - offsets[0] == 2 && offsets[2] == offsets[1] && "Its own fill at 105, then the stop's 8");
+    assert(trades[1].buySide.orderId == 40 && trades[1].sellSide.quantity == 8);
+    assert(ob.PendingStops() == 0 && !ob.BestAsk() && ob.BestBid()->price == 100);
+    cout << "Stops fired in trigger order\n";
+}
+
+template <template <Side> class L>
+void testAllocationPolicies()
+{
+    using namespace std;
+
+    cout << "\n=== TEST 30: Pro-Rata And Top-Priority Allocation ===\n";
+    auto fills = [](const Trades &trades)
+    {
+        vector<pair<OrderId, Quantity>> out;
+        for (const Trade &trade : trades)
+            out.emplace_back(trade.buySide.orderId, trade.buySide.quantity);
+        return out;
+    };
+    using Fills = vector<pair<OrderId, Quantity>>;
+
+    Orderbook<L, ProRataAllocation> pro_rata;
+    pro_rata.AddOrder(1, Side::Buy, 100, 10);
+    pro_rata.AddOrder(2, Side::Buy, 100, 30);
+    pro_rata.AddOrder(3, Side::Buy, 100, 60);
+    Trades trades = pro_rata.AddOrder(4, Side::Sell, 100, 50);
+    assert(fills(trades) == (Fills{{1, 5}, {2, 15}, {3, 30}}));
+    // 0.4, 1.2 and 2.4 round down to 0, 1 and 2, and the lot left goes to the oldest
+    trades = pro_rata.AddOrder(5, Side::Sell, 100, 4);
+    assert(fills(trades) == (Fills{{1, 1}, {2, 1}, {3, 2}}));
+    assert(pro_rata.BestBid()->quantity == 46 && pro_rata.BestBid()->orders == 3);
+    pro_rata.AddOrder(6, Side::Buy, 99, 10);
+    trades = pro_rata.AddOrder(7, Side::Sell, 99, 50);
+    assert(fills(trades) == (Fills{{1, 4}, {2, 14}, {3, 28}, {6, 4}}) &&
+           "Taking a whole level fills it FIFO, the next level is shared");
+    print(pro_rata);
+
+    // exact shares are never rounded down: 7 and 63 of 70, nothing left over for the oldest
+    Orderbook<L, ProRataAllocation> exact;
+    exact.AddOrder(1, Side::Buy, 100, 10);
+    exact.AddOrder(2, Side::Buy, 100, 90);
+    const Trades exact_trades = exact.AddOrder(3, Side::Sell, 100, 70);
+    assert(fills(exact_trades) == (Fills{{1, 7}, {2, 63}}));
+
+    Orderbook<L, TopPriorityProRataAllocation> top;
+    top.AddOrder(1, Side::Buy, 100, 10);
+    top.AddOrder(2, Side::Buy, 100, 30);
+    top.AddOrder(3, Side::Buy, 100, 60);
+    // 10 to the front order, then 40 over 90: 13.3 and 26.7 round down, the lot left goes to 2
+    trades = top.AddOrder(4, Side::Sell, 100, 50);
+    assert(fills(trades) == (Fills{{1, 10}, {2, 14}, {3, 26}}));
+    assert(top.Size() == 2 && top.BestBid()->quantity == 50);
+
+    // shares always add up to the incoming quantity, with icebergs refilling along the way
+    Orderbook<L, ProRataAllocation> random_book;
+    mt19937 rng(30);
+    uniform_int_distribution<Quantity> qty(1, 50);
+    OrderId next_id = 1;
+    for (int i = 0; i < 5000; ++i)
+    {
+        const Quantity q = qty(rng);
+        if (i % 3 != 2)
+        {
+            if (i % 7 == 0)
+                random_book.AddIcebergOrder(next_id++, Side::Buy, 100, q * 4, q);
+            else
+                random_book.AddOrder(next_id++, Side::Buy, 100, q);
+            continue;
+        }
+        Quantity filled = 0;
+        for (const Trade &trade : random_book.AddOrder(next_id++, Side::Sell, 100, q))
+            filled += trade.sellSide.quantity;
+        assert(filled == q);
+    }
+    cout << "Resting after random pro-rata flow: " << random_book.Size() << "\n";
+}
+
+template <typename Book>
+void testCallAuction()
+{
+    using namespace std;
+
+    cout << "\n=== TEST 31: Call Auction And Uncross ===\n";
+    Book ob(OrderbookConfig{.depthIndex = true});
+    ob.StartAuction();
+    Trades test_trades = ob.AddOrder(1, Side::Buy, 102, 10);
+    assert(test_trades.empty());
+    ob.AddOrder(2, Side::Buy, 101, 20);
+    ob.AddOrder(3, Side::Buy, 100, 30);
+    test_trades = ob.AddOrder(4, Side::Sell, 99, 25);
+    assert(test_trades.empty() && "Crossing orders wait for the uncross");
+    ob.AddOrder(5, Side::Sell, 100, 10);
+    ob.AddOrder(6, Side::Sell, 101, 15);
+    ob.AddOrder(7, Side::Sell, 103, 5);
+    ob.AddStopOrder(8, Side::Sell, 100, 5);
+    ob.AddOrder(9, Side::Sell, 104, 1);
+    ob.ModifyOrder(9, 98, 1);
+    ob.CancelOrder(9);
+    assert(ob.Size() == 7 && ob.BestBid()->price == 102 && ob.BestAsk()->price == 99);
+    bool threw = false;
+    try
+    {
+        ob.AddMarketOrder(10, Side::Buy, 5);
+    }
+    catch (const logic_error &)
+    {
+        threw = true;
+    }
+    assert(threw && "Market orders can't wait for an auction");
+
+    // demand/supply at 99: 60/25, 100: 60/35, 101: 30/50, 102: 10/50 -> 35 at 100
+    const optional<AuctionResult> indicative = ob.IndicativeUncross();
+    assert(indicative && indicative->price == 100 && indicative->volume == 35);
+    test_trades.clear();
+    const optional<AuctionResult> result = ob.Uncross(test_trades);
+    print(test_trades);
+    assert(result && result->price == 100 && result->volume == 35 && !ob.InAuction());
+    assert(test_trades.size() == 5 && "Four auction fills, then the stop at 100 fires");
+    for (size_t i = 0; i < 4; ++i)
+        assert(test_trades[i].buySide.price == 100 && test_trades[i].sellSide.price == 100);
+    assert(test_trades[0].buySide.orderId == 1 && test_trades[0].sellSide.orderId == 4 && test_trades[0].buySide.quantity == 10);
+    assert(test_trades[3].buySide.orderId == 3 && test_trades[3].sellSide.orderId == 5 && test_trades[3].buySide.quantity == 5);
+    assert(test_trades[4].sellSide.orderId == 8 && test_trades[4].buySide.orderId == 3);
+    assert(ob.BestBid()->price == 100 && ob.BestBid()->quantity == 20 && ob.BestAsk()->price == 101);
+    assert(ob.QuantityAtOrBetter(Side::Buy, 100) == 20 && ob.QuantityAtOrBetter(Side::Sell, 103) == 20);
+    print(ob);
+
+    // back to continuous matching
+    test_trades = ob.AddOrder(11, Side::Buy, 101, 5);
+    assert(test_trades.size() == 1);
+
+    // stops the last trade reached before the auction wait for the uncross instead of firing into it
+    Book held;
+    held.AddOrder(20, Side::Buy, 100, 1);
+    held.AddOrder(21, Side::Sell, 100, 1);
+    held.StartAuction();
+    held.AddStopOrder(22, Side::Buy, 99, 5);
+    held.AddStopLimitOrder(23, Side::Sell, 101, 100, 5);
+    Trades held_trades = held.AddOrder(24, Side::Sell, 105, 3);
+    assert(held_trades.empty() && "Nothing fires while orders are collected");
+    held.ModifyOrder(24, 104, 3);
+    assert(held.Size() == 1 && held.BestAsk()->price == 104);
+    bool cancelled = held.CancelOrder(22);
+    assert(cancelled);
+    cancelled = held.CancelOrder(22);
+    assert(!cancelled);
+    const optional<AuctionResult> held_result = held.Uncross(held_trades);
+    assert(!held_result && held_trades.empty());
+    assert(held.Size() == 2 && held.BestAsk()->price == 100 && "The stop-limit fires once the auction is over");
+
+    // a rejected engine-id order gives its slot back
+    Book engine(OrderbookConfig{.engineIds = true});
+    engine.StartAuction();
+    threw = false;
+    try
+    {
+        engine.AddOrder(Side::Buy, 100, 5, TimeInForce::ImmediateOrCancel, [](const Trade &) {});
+    }
+    catch (const logic_error &)
+    {
+        threw = true;
+    }
+    assert(threw && engine.Size() == 0);
+
+    // random auctions always leave an uncrossed book with the volume executed
+    Book random_book;
+    mt19937 rng(31);
+    uniform_int_distribution<Price> price(90, 110);
+    uniform_int_distribution<Quantity> qty(1, 20);
+    OrderId next_id = 100;
+    for (int round = 0; round < 200; ++round)
+    {
+        random_book.StartAuction();
+        for (int i = 0; i < 50; ++i)
+        {
+            if (i % 9 == 0)
+                random_book.AddIcebergOrder(next_id++, i % 2 ? Side::Buy : Side::Sell, price(rng), qty(rng) * 3, qty(rng));
+            else
+                random_book.AddOrder(next_id++, i % 2 ? Side::Buy : Side::Sell, price(rng), qty(rng));
+        }
+        Trades trades;
+        const optional<AuctionResult> uncrossed = random_book.Uncross(trades);
+        uint64_t executed = 0;
+        for (const Trade &trade : trades)
+            executed += trade.buySide.quantity;
+        assert(executed == (uncrossed ? uncrossed->volume : 0));
+        assert(!random_book.Spread() || *random_book.Spread() > 0);
+    }
+    cout << "Resting after 200 random auctions: " << random_book.Size() << "\n";
+}
+
+template <typename Book>
+void testExpiry()
+{
+    using namespace std;
+
+    cout << "\n=== TEST 32: Good-Till-Date And Day Orders ===\n";
+    Book ob;
+    ob.AddOrder(1, Side::Buy, 100, 10, TimeInForce::GoodTillDate, 1000);
+    ob.AddOrder(2, Side::Buy, 99, 10, TimeInForce::GoodTillDate, 2000);
+    ob.AddOrder(3, Side::Buy, 98, 10, TimeInForce::GoodTillDate, 1000);
+    ob.AddOrder(4, Side::Sell, 105, 10, TimeInForce::Day);
+    ob.AddOrder(5, Side::Sell, 106, 10);
+    ob.AddOrder(6, Side::Sell, 107, 10, TimeInForce::GoodTillDate, 500);
+    ob.CancelOrder(6);
+    ob.ModifyOrder(3, 97, 5);                            // keeps its expiry
+    ob.AddOrder(7, Side::Sell, 100, 10);                 // fills 1 before its deadline
+    bool threw = false;
+    try
+    {
+        ob.AddOrder(8, Side::Buy, 90, 1, TimeInForce::GoodTillDate);
+    }
+    catch (const invalid_argument &)
+    {
+        threw = true;
+    }
+    assert(threw && "Good-till-date needs an expiry");
+    assert(ob.Size() == 4);
+
+    vector<OrderId> expired;
+    auto note = [&expired](OrderId id)
+    { expired.push_back(id); };
+    size_t count = ob.ExpireOrders(999, note);
+    assert(count == 0);
+    count = ob.ExpireOrders(1000, note);
+    assert(count == 1 && expired == vector<OrderId>{3} && "Filling or cancelling an order removed its timer, only 3 was left due");
+    count = ob.ExpireOrders(5000, note);
+    assert(count == 1 && expired.back() == 2);
+    count = ob.ExpireOrders(UINT64_MAX);
+    assert(count == 0 && ob.Size() == 2 && "Day orders wait for the end of the session");
+    count = ob.ExpireDayOrders(note);
+    assert(count == 1 && expired.back() == 4);
+    assert(ob.Size() == 1 && ob.BestAsk()->price == 106 && !ob.BestBid());
+
+    // batches schedule too, and the end-of-day purge is one call however many orders it takes
+    vector<OrderRequest> batch;
+    for (OrderId id = 100; id < 100100; ++id)
+        batch.push_back(OrderRequest{id, Side::Buy, static_cast<Price>(50 + id % 50), 1, TimeInForce::Day});
+    batch.push_back(OrderRequest{100100, Side::Buy, 40, 1, TimeInForce::GoodTillDate, OrderType::Limit, 0, 10});
+    Trades trades;
+    vector<uint32_t> offsets;
+    ob.AddOrders(batch, trades, offsets);
+    assert(ob.Size() == 100002);
+    count = ob.ExpireDayOrders();
+    assert(count == 100000);
+    count = ob.ExpireOrders(10);
+    assert(count == 1 && ob.Size() == 1);
+    cout << "Expired " << expired.size() << " timed orders, then 100000 day orders in one call\n";
+
+    Book engine(OrderbookConfig{.engineIds = true});
+    auto ignore = [](const Trade &) {};
+    const OrderId id = engine.AddOrder(Side::Buy, 100, 10, TimeInForce::GoodTillDate, Timestamp{50}, ignore);
+    count = engine.ExpireOrders(50);
+    const bool cancelled = engine.CancelOrder(id);
+    assert(count == 1 && !cancelled);
+
+    // churn: cancels take their timers with them, and every sweep evicts exactly what is due
+    Book churn;
+    mt19937 rng(32);
+    unordered_map<OrderId, Timestamp> expiries;
+    for (OrderId id = 1; id <= 4000; ++id)
+    {
+        const bool buy = id % 2 == 0;
+        const Timestamp expiry = 1 + rng() % 1000;
+        churn.AddOrder(id, buy ? Side::Buy : Side::Sell, buy ? Price(90 + rng() % 10) : Price(110 + rng() % 10), 1,
+                       TimeInForce::GoodTillDate, expiry);
+        expiries[id] = expiry;
+        if (rng() % 2 == 0)
+        {
+            const OrderId victim = 1 + rng() % id;
+            if (churn.CancelOrder(victim))
+                expiries.erase(victim);
+        }
+    }
+    assert(churn.Size() == static_cast<int>(expiries.size()));
+    Timestamp previous = 0;
+    for (Timestamp now = 0; now <= 1000; now += 50)
+    {
+        vector<OrderId> due;
+        churn.ExpireOrders(now, [&due](OrderId id)
+                           { due.push_back(id); });
+        for (const OrderId id : due)
+        {
+            assert(expiries.at(id) > previous && expiries.at(id) <= now);
+            expiries.erase(id);
+        }
+        previous = now;
+    }
+    count = churn.ExpireDayOrders();
+    assert(expiries.empty() && churn.Size() == 0 && count == 0);
+}
+
+template <typename Book>
+void testBulkCancel()
+{
+    using namespace std;
+
+    cout << "\n=== TEST 33: Bulk Cancel By Side, Range And Owner ===\n";
+    Book ob(OrderbookConfig{.depthIndex = true, .queuePositions = true});
+    ob.AddOrder(OrderRequest{.id = 1, .side = Side::Buy, .price = 100, .quantity = 10, .owner = 7});
+    ob.AddOrder(OrderRequest{.id = 2, .side = Side::Buy, .price = 100, .quantity = 10});
+    ob.AddOrder(OrderRequest{.id = 3, .side = Side::Buy, .price = 99, .quantity = 30, .displayQuantity = 10, .owner = 7});
+    ob.AddOrder(OrderRequest{.id = 4, .side = Side::Buy, .price = 97, .quantity = 10, .owner = 8});
+    ob.AddOrder(OrderRequest{.id = 5, .side = Side::Buy, .price = 96, .quantity = 10, .owner = 7});
+    ob.AddOrder(OrderRequest{.id = 6, .side = Side::Sell, .price = 105, .quantity = 10, .owner = 7});
+    ob.AddOrder(OrderRequest{.id = 7, .side = Side::Sell, .price = 106, .quantity = 10, .owner = 8});
+    ob.AddStopOrder(8, Side::Sell, 90, 5);
+    assert(ob.Size() == 7 && ob.PendingStops() == 1);
+
+    vector<OrderId> cancelled;
+    auto note = [&cancelled](OrderId id)
+    { cancelled.push_back(id); };
+    size_t count = ob.CancelRange(Side::Buy, 97, 99, note);
+    assert(count == 2);
+    assert((cancelled == vector<OrderId>{3, 4}) && "Whole levels, best first");
+    assert(ob.QuantityAtOrBetter(Side::Buy, 90) == 30 && *ob.QuantityAhead(5) == 0);
+    count = ob.CancelRange(Side::Sell, 100, 104);
+    assert(count == 0 && ob.Size() == 5);
+
+    // owner 7 still has 1, 5 and 6, spread over both sides; its fully filled order leaves its list
+    ob.AddOrder(9, Side::Sell, 100, 10);
+    const bool found = ob.CancelOrder(1);
+    assert(!found);
+    cancelled.clear();
+    count = ob.CancelOwner(7, note);
+    assert(count == 2 && (cancelled == vector<OrderId>{6, 5}) && "Newest first");
+    count = ob.CancelOwner(7) + ob.CancelOwner(NoOwner);
+    assert(count == 0);
+    assert(ob.Size() == 2 && ob.BestBid()->price == 100 && ob.BestAsk()->price == 106);
+
+    // a side goes with its pending stops; ids are free for reuse and the other side untouched
+    ob.AddOrder(10, Side::Buy, 98, 5);
+    ob.AddIcebergOrder(11, Side::Buy, 97, 20, 5);
+    count = ob.CancelSide(Side::Sell);
+    assert(count == 2);
+    count = ob.CancelSide(Side::Buy);
+    assert(count == 3);
+    assert(ob.Size() == 0 && ob.PendingStops() == 0 && !ob.BestBid() && !ob.BestAsk());
+    assert(ob.QuantityAtOrBetter(Side::Buy, 0) == 0 && ob.QuantityAtOrBetter(Side::Sell, 1000) == 0);
+    count = ob.CancelOwner(8);
+    assert(count == 0 && "Owner 8's bid went with the range, its ask with the side");
+
+    ob.AddOrder(OrderRequest{.id = 3, .side = Side::Buy, .price = 99, .quantity = 30, .displayQuantity = 10, .owner = 7});
+    ob.AddOrder(OrderRequest{.id = 12, .side = Side::Buy, .price = 99, .quantity = 5, .owner = 7});
+    assert(*ob.QuantityAhead(12) == 10 && "Reused queue position tree starts from zero");
+    Trades trades = ob.AddOrder(OrderRequest{.id = 13, .side = Side::Sell, .price = 99, .quantity = 35});
+    assert(trades.size() == 4 && ob.Size() == 0);
+    count = ob.CancelOwner(7);
+    assert(count == 0 && "Filled orders are off the owner's list");
+
+    // an owner with orders all over a deep book: the cancel only walks that owner's orders
+    for (OrderId id = 100; id < 10100; ++id)
+        ob.AddOrder(OrderRequest{.id = id, .side = Side::Buy, .price = static_cast<Price>(1 + id % 80),
+                                 .quantity = 1, .owner = id % 100 == 0 ? OwnerId{42} : OwnerId{43}});
+    count = ob.CancelOwner(42);
+    assert(count == 100 && ob.Size() == 9900);
+    count = ob.CancelRange(Side::Buy, 1, 40);
+    count += ob.CancelSide(Side::Buy);
+    assert(count == 9900);
+    count = ob.CancelOwner(43);
+    assert(count == 0);
+    cout << "Pulled a side, a price range and two owners' orders in bulk\n";
+}
+
+void testMatchingEngine()
+{
+    using namespace std;
+
+    cout << "\n=== TEST 34: Multi-Symbol Sharded Engine ===\n";
+    atomic<uint64_t> traded{0};
+    auto count = [&traded](SymbolId, const Trade &trade)
+    { traded.fetch_add(trade.buySide.quantity); };
+    {
+        MatchingEngine<decltype(count)> engine(EngineConfig{.symbols = 10, .shards = 3}, count);
+        assert(engine.Shards() == 3 && engine.ShardOf(4) == 1);
+        for (SymbolId symbol = 0; symbol < 10; ++symbol)
+        {
+            // the same ids in every book: each symbol has its own id space
+            engine.Submit({CommandType::Add, symbol, {.id = 1, .side = Side::Sell, .price = 101, .quantity = 10}});
+            engine.Submit({CommandType::Add, symbol, {.id = 2, .side = Side::Buy, .price = 100, .quantity = 10}});
+            engine.Submit({CommandType::Add, symbol, {.id = 3, .side = Side::Buy, .price = 101, .quantity = 4 + symbol % 6}});
+            engine.Submit({CommandType::Modify, symbol, {.id = 2, .side = Side::Buy, .price = 100, .quantity = 5}});
+            engine.Submit({CommandType::Cancel, symbol, {.id = 2}});
+            engine.Submit({CommandType::Cancel, symbol, {.id = 2}});                  // already gone
+            engine.Submit({CommandType::Add, symbol, {.id = 1, .side = Side::Buy, .price = 90, .quantity = 1}}); // duplicate
+        }
+        bool threw = false;
+        try
+        {
+            engine.Submit({CommandType::Cancel, 10, {.id = 1}});
+        }
+        catch (const out_of_range &)
+        {
+            threw = true;
+        }
+        assert(threw && "Unknown symbols are refused at routing");
+        engine.Drain();
+
+        assert(engine.Rejected() == 20);
+        for (SymbolId symbol = 0; symbol < 10; ++symbol)
+        {
+            const auto &book = engine.book(symbol);
+            assert(!book.BestBid() && book.BestAsk()->quantity == 6 - symbol % 6);
+        }
+        assert(traded == 61);
+
+        // a stream spread over the symbols: each book still sees its own orders in order
+        for (OrderId id = 10; id < 20010; ++id)
+        {
+            const SymbolId symbol = id % 10;
+            engine.Submit({CommandType::Add, symbol,
+                           {.id = id, .side = id % 20 < 10 ? Side::Buy : Side::Sell, .price = 100, .quantity = 1}});
+        }
+    } // the destructor applies everything still queued before stopping
+    assert(traded == 61 + 10000);
+    cout << "Matched " << traded << " lots across 10 symbols on 3 shards\n";
+}
+
+void testSpscRing()
+{
+    using namespace std;
+
+    cout << "\n=== TEST 35: SPSC Ring And Outbound Trades ===\n";
+    SpscRing<uint64_t, 8> ring;
+    vector<uint64_t> seen;
+    auto collect = [&seen](uint64_t value)
+    { seen.push_back(value); };
+    for (uint64_t i = 0; i < 8; ++i)
+    {
+        const bool pushed = ring.TryPush(i);
+        assert(pushed);
+    }
+    bool pushed = ring.TryPush(8);
+    assert(!pushed && "Full at capacity");
+    size_t consumed = ring.Consume(collect);
+    assert(consumed == 0 && ring.Unpublished() == 8 && "Nothing is visible before Publish");
+    ring.Publish();
+    consumed = ring.Consume(collect, 3);
+    pushed = ring.TryPush(8) && ring.TryPush(9);
+    assert(consumed == 3 && pushed);
+    ring.Publish();
+    // the consumer only rereads the tail once it has used up what it saw last time
+    consumed = ring.Consume(collect);
+    assert(consumed == 5);
+    consumed = ring.Consume(collect);
+    assert(consumed == 2);
+    consumed = ring.Consume(collect);
+    assert(consumed == 0);
+    assert(seen == (vector<uint64_t>{0, 1, 2, 3, 4, 5, 6, 7, 8, 9}) && "In order across the wrap");
+
+    // one producer thread, one consumer thread, far more elements than slots
+    SpscRing<uint64_t, 64> pipe;
+    uint64_t sum = 0;
+    thread consumer([&pipe, &sum]
+                    {
+        for (uint64_t expected = 0; expected < 100000;)
+            pipe.Consume([&](uint64_t value)
+                         { assert(value == expected); sum += value; ++expected; });
+                    });
+    for (uint64_t i = 0; i < 100000;)
+    {
+        if (pipe.TryPush(i))
+            ++i;
+        if (i % 16 == 0 || i == 100000)
+            pipe.Publish();
+    }
+    consumer.join();
+    assert(sum == 99999ull * 100000 / 2);
+
+    // trades through the engine's outbound rings, polled from this thread
+    MatchingEngine<IgnoreTrades, BusySpin> engine(EngineConfig{.symbols = 4, .shards = 2, .publishTrades = true});
+    for (SymbolId symbol = 0; symbol < 4; ++symbol)
+    {
+        engine.Submit({CommandType::Add, symbol, {.id = 1, .side = Side::Sell, .price = 100, .quantity = 5}});
+        engine.Submit({CommandType::Add, symbol, {.id = 2, .side = Side::Sell, .price = 101, .quantity = 5}});
+        engine.Submit({CommandType::Add, symbol, {.id = 3, .side = Side::Buy, .price = 101, .quantity = 10}});
+    }
+    engine.Drain();
+    vector<pair<SymbolId, OrderId>> fills;
+    size_t polled = engine.PollTrades([&fills](SymbolId symbol, const Trade &trade)
+                                      { fills.emplace_back(symbol, trade.sellSide.orderId); });
+    assert(polled == 8);
+    sort(fills.begin(), fills.end()); // shards interleave, each shard's trades stay in order
+    assert(fills.front() == make_pair(SymbolId{0}, OrderId{1}) && fills.back() == make_pair(SymbolId{3}, OrderId{2}));
+    polled = engine.PollTrades([](SymbolId, const Trade &) {});
+    assert(polled == 0);
+    cout << "Ring kept order over " << seen.size() << " + 100000 elements; engine published " << fills.size() << " trades\n";
+}
+
+struct CollectTrades
+{
+    Trades trades;
+    void operator()(const PipelineEvent &event) { trades.insert(trades.end(), event.trades.begin(), event.trades.end()); }
+};
+
+struct RecordVerdicts
+{
+    std::vector<Verdict> verdicts;
+    void operator()(const PipelineEvent &event) { verdicts.push_back(event.verdict); }
+};
+
+void testPipeline()
+{
+    using namespace std;
+
+    cout << "\n=== TEST 36: Staged Order Pipeline ===\n";
+    OrderPipeline<CollectTrades, RecordVerdicts> pipeline(
+        PipelineConfig{.slots = 8, .book = {.tickSize = 5}, .maxQuantity = 100, .maxNotional = 5000, .minPrice = 50, .maxPrice = 150});
+    auto add = [](OrderId id, Side side, Price price, Quantity quantity)
+    { return EncodeWire({CommandType::Add, 0, {.id = id, .side = side, .price = price, .quantity = quantity}}); };
+    WireMessage garbage = add(9, Side::Buy, 100, 1);
+    garbage.bytes[32] = byte{7}; // no such command type
+    vector<WireMessage> batch = {
+        add(1, Side::Sell, 100, 10),
+        add(2, Side::Sell, 105, 10),
+        add(1, Side::Buy, 100, 1),   // duplicate
+        add(3, Side::Buy, 101, 1),   // off the tick
+        add(4, Side::Buy, 200, 1),   // outside the band
+        add(5, Side::Buy, 100, 101), // over the quantity limit
+        add(6, Side::Buy, 100, 60),  // over the notional limit
+        garbage,
+        add(7, Side::Buy, 105, 15),
+        EncodeWire({CommandType::Cancel, 0, {.id = 1}}), // filled already
+        EncodeWire({CommandType::Modify, 0, {.id = 2, .price = 110, .quantity = 5}}),
+        EncodeWire({CommandType::Add, 0, {.id = 8, .side = Side::Buy, .quantity = 2, .timeInForce = TimeInForce::ImmediateOrCancel, .type = OrderType::Market}}),
+        // a market order has no price of its own: its notional is taken at the top of the band
+        EncodeWire({CommandType::Add, 0, {.id = 10, .side = Side::Buy, .quantity = 40, .timeInForce = TimeInForce::ImmediateOrCancel, .type = OrderType::Market}}),
+    };
+    pipeline.Submit(batch); // more events than slots: the gateway waits for the stages
+    for (OrderId id = 100; id < 1100; ++id)
+        pipeline.Submit(add(id, id % 2 ? Side::Buy : Side::Sell, 90, 1));
+    pipeline.Drain();
+
+    const vector<Verdict> &verdicts = pipeline.journal().verdicts;
+    assert(verdicts.size() == batch.size() + 1000);
+    assert((vector<Verdict>(verdicts.begin(), verdicts.begin() + 13) ==
+            vector<Verdict>{Verdict::Accepted, Verdict::Accepted, Verdict::Duplicate, Verdict::BadPrice,
+                            Verdict::BadPrice, Verdict::RiskLimit, Verdict::RiskLimit, Verdict::Malformed,
+                            Verdict::Accepted, Verdict::Refused, Verdict::Accepted, Verdict::Accepted,
+                            Verdict::RiskLimit}));
+    const Trades &trades = pipeline.publisher().trades;
+    assert(trades.size() == 2 + 1 + 500);
+    assert(trades[0].sellSide.orderId == 1 && trades[1].sellSide.orderId == 2 && trades[1].sellSide.quantity == 5);
+    assert(trades[2].buySide.orderId == 8 && trades[2].sellSide.price == 110 && trades[2].sellSide.quantity == 2);
+    assert(pipeline.book().BestAsk()->quantity == 3 && !pipeline.book().BestBid());
+    cout << "Journaled " << verdicts.size() << " events, published " << trades.size() << " trades\n";
+
+    // duplicates are told apart within the id window only: older ids are turned away, and the
+    // bits of ids that fell out of it are cleared before they're reused
+    OrderPipeline<CollectTrades, RecordVerdicts> windowed(PipelineConfig{.slots = 8, .idWindow = 64});
+    windowed.Submit(vector<WireMessage>{
+        add(200, Side::Buy, 100, 1),
+        add(100, Side::Buy, 100, 1), // 100 ids behind the newest: too old to tell
+        add(186, Side::Buy, 100, 1),
+        add(150, Side::Buy, 100, 1),
+        add(150, Side::Buy, 100, 1), // duplicate
+        add(300, Side::Buy, 100, 1),
+        add(250, Side::Buy, 100, 1), // shares a bit with 186, cleared when 300 came
+        // a modify to quantity 0 cancels, whatever its price
+        EncodeWire({CommandType::Modify, 0, {.id = 150, .price = 0, .quantity = 0}}),
+    });
+    windowed.Drain();
+    assert((windowed.journal().verdicts ==
+            vector<Verdict>{Verdict::Accepted, Verdict::Duplicate, Verdict::Accepted, Verdict::Accepted,
+                            Verdict::Duplicate, Verdict::Accepted, Verdict::Accepted, Verdict::Accepted}));
+    assert(windowed.book().Size() == 4);
+}
+
+// each symbol's fills, in the order they happened: a symbol only ever runs on one worker at a time
+struct FillsBySymbol
+{
+    std::vector<std::vector<OrderId>> *fills;
+    void operator()(SymbolId symbol, const Trade &trade) const { (*fills)[symbol].push_back(trade.sellSide.orderId); }
+};
+
+void testWorkStealing()
+{
+    using namespace std;
+
+    cout << "\n=== TEST 37: Work-Stealing Multi-Symbol Engine ===\n";
+    vector<vector<OrderId>> fills(4);
+    vector<Quantity> resting(4, 0);
+    {
+        WorkStealingEngine<FillsBySymbol> engine(ExecutorConfig{.symbols = 4, .workers = 3}, FillsBySymbol{&fills});
+        assert(engine.Workers() == 3 && engine.HomeOf(4) == 1);
+
+        // nine commands in ten for symbol 0, the rest spread over the others: symbol 0's inbox
+        // fills up and it keeps getting queued again while the others come and go
+        OrderId id = 1;
+        for (int i = 0; i < 40000; ++i, id += 2)
+        {
+            const SymbolId symbol = i % 10 == 9 ? 1 + i / 10 % 3 : 0;
+            engine.Submit({CommandType::Add, symbol, {.id = id, .side = Side::Sell, .price = 100, .quantity = 1}});
+            engine.Submit({CommandType::Add, symbol, {.id = id + 1, .side = Side::Sell, .price = 99, .quantity = 5}});
+            engine.Submit({CommandType::Cancel, symbol, {.id = id + 1}}); // refused if run before its add
+            ++resting[symbol];
+        }
+        bool threw = false;
+        try
+        {
+            engine.Submit({CommandType::Cancel, 4, {.id = 1}});
+        }
+        catch (const out_of_range &)
+        {
+            threw = true;
+        }
+        assert(threw && "Unknown symbols are refused at routing");
+        engine.Drain();
+        assert(engine.Rejected() == 0 && "Every cancel ran after its add");
+
+        for (SymbolId symbol = 0; symbol < 4; ++symbol)
+        {
+            assert(engine.book(symbol).Size() == static_cast<int>(resting[symbol]));
+            engine.Submit({CommandType::Add, symbol, {.id = id++, .side = Side::Buy, .price = 100, .quantity = resting[symbol]}});
+        }
+        engine.Submit({CommandType::Cancel, 2, {.id = 1}}); // symbol 0's order, not symbol 2's
+        engine.Drain();
+        assert(engine.Rejected() == 1);
+        for (SymbolId symbol = 0; symbol < 4; ++symbol)
+        {
+            assert(engine.book(symbol).Size() == 0);
+            assert(fills[symbol].size() == resting[symbol]);
+            assert(is_sorted(fills[symbol].begin(), fills[symbol].end()) && "Time priority as submitted");
+        }
+        cout << "Applied 120000 commands over 4 symbols, 90% on one, with " << engine.Steals() << " steals\n";
+
+        for (OrderId next = id; next < id + 1000; ++next)
+        {
+            engine.Submit({CommandType::Add, 3, {.id = next, .side = Side::Sell, .price = 100, .quantity = 1}});
+        }
+        engine.Submit({CommandType::Add, 3, {.id = id + 1000, .side = Side::Buy, .price = 100, .quantity = 1000}});
+    } // the destructor applies everything still queued before stopping
+    assert(fills[3].size() == resting[3] + 1000);
+}
+
+void testSeqlockTopOfBook()
+{
+    using namespace std;
+
+    cout << "\n=== TEST 38: Seqlock Top Of Book ===\n";
+    bool threw = false;
+    try
+    {
+        Orderbook<>().ReadTop();
+    }
+    catch (const logic_error &)
+    {
+        threw = true;
+    }
+    assert(threw && "Nothing is published unless asked for");
+
+    Orderbook<> book(OrderbookConfig{.publishTop = true});
+    TopOfBook top = book.ReadTop();
+    assert(top.version == 0 && top.bidLevels == 0 && top.askLevels == 0);
+
+    book.AddOrder(1, Side::Buy, 100, 10);
+    book.AddOrder(2, Side::Buy, 100, 5);
+    book.AddOrder(3, Side::Buy, 99, 7);
+    book.AddOrder(4, Side::Sell, 102, 4);
+    top = book.ReadTop();
+    assert(top.version == 4 && top.bidLevels == 2 && top.askLevels == 1);
+    assert((top.bids[0] == LevelInfo{100, 15, 2}) && (top.bids[1] == LevelInfo{99, 7, 1}));
+    assert((top.asks[0] == LevelInfo{102, 4, 1}));
+
+    // changes below the top TopLevels levels, and calls that change nothing, publish nothing
+    for (Price price = 98; price > 98 - Price(TopLevels); --price)
+    {
+        book.AddOrder(OrderId(1000 + price), Side::Buy, price, 1);
+    }
+    assert(book.ReadTop().version == 4 + TopLevels - 2);
+    book.AddOrder(5, Side::Buy, 50, 1);
+    book.CancelOrder(5);
+    book.CancelOrder(5);
+    book.AddOrder(1, Side::Buy, 90, 1); // duplicate
+    assert(book.ReadTop().version == 4 + TopLevels - 2);
+
+    // fills, modifies and bulk cancels publish like adds
+    book.AddOrder(6, Side::Sell, 100, 12);
+    top = book.ReadTop();
+    assert((top.bids[0] == LevelInfo{100, 3, 1}) && top.askLevels == 1);
+    book.ModifyOrder(4, 101, 4);
+    assert(book.ReadTop().asks[0].price == 101);
+    book.CancelSide(Side::Buy);
+    top = book.ReadTop();
+    assert(top.bidLevels == 0 && top.askLevels == 1 && book.TryReadTop(top));
+    book.AddOrder(7, Side::Buy, 100, 2, TimeInForce::GoodTillDate, Timestamp{10});
+    assert(book.ReadTop().bidLevels == 1);
+    book.ExpireOrders(10);
+    assert(book.ReadTop().bidLevels == 0);
+
+    // the top is patched in place as levels change: after every call it is what a walk would give
+    auto churn = []<typename Book>()
+    {
+        Book random_book(OrderbookConfig{.publishTop = true});
+        mt19937 rng(39);
+        array<LevelInfo, TopLevels> walked;
+        for (OrderId id = 1; id <= 20000; ++id)
+        {
+            const Side side = rng() % 2 ? Side::Buy : Side::Sell;
+            const Price price = side == Side::Buy ? Price(80 + rng() % 24) : Price(100 + rng() % 24); // some cross
+            switch (rng() % 6)
+            {
+            case 0:
+                random_book.CancelOrder(1 + rng() % id);
+                break;
+            case 1:
+                random_book.ModifyOrder(1 + rng() % id, price, Quantity(1 + rng() % 10));
+                break;
+            case 2:
+                random_book.AddOrder({.id = id, .side = side, .price = price, .quantity = 20, .displayQuantity = 4});
+                break;
+            case 3:
+                random_book.AddOrder({.id = id, .side = side, .quantity = Quantity(1 + rng() % 30),
+                                      .timeInForce = TimeInForce::ImmediateOrCancel, .type = OrderType::Market});
+                break;
+            default:
+                random_book.AddOrder(id, side, price, Quantity(1 + rng() % 10));
+            }
+            const TopOfBook top = random_book.ReadTop();
+            const size_t bids = random_book.Depth(Side::Buy, walked);
+            assert(top.bidLevels == bids && equal(walked.begin(), walked.begin() + bids, top.bids.begin()));
+            const size_t asks = random_book.Depth(Side::Sell, walked);
+            assert(top.askLevels == asks && equal(walked.begin(), walked.begin() + asks, top.asks.begin()));
+        }
+    };
+    churn.operator()<Orderbook<MapLevels>>();
+    churn.operator()<LadderOrderbook>();
+    churn.operator()<VectorOrderbook>();
+
+    // the seqlock on its own: every word of every copy comes from the same store
+    {
+        Seqlock<array<uint64_t, 16>> lock;
+        lock.Store({});
+        atomic<bool> done{false};
+        constexpr uint64_t Stores = 200000;
+        thread reader([&lock, &done]
+                      {
+            uint64_t last = 0;
+            while (!done.load(memory_order_acquire))
+            {
+                const array<uint64_t, 16> value = lock.Load();
+                assert(all_of(value.begin(), value.end(), [&value](uint64_t word)
+                              { return word == value[0]; }) && "Torn read");
+                assert(value[0] >= last && "Went back in time");
+                last = value[0];
+            } });
+        for (uint64_t i = 1; i <= Stores; ++i)
+        {
+            array<uint64_t, 16> value;
+            value.fill(i);
+            lock.Store(value);
+        }
+        done.store(true, memory_order_release);
+        reader.join();
+        assert(lock.Load()[15] == Stores);
+    }
+
+    // readers on other threads while the book trades: every copy is a book that could exist
+    {
+        Orderbook<> live(OrderbookConfig{.publishTop = true});
+        atomic<bool> done{false};
+        atomic<uint64_t> reads{0};
+        vector<thread> readers;
+        for (int r = 0; r < 2; ++r)
+        {
+            readers.emplace_back([&live, &done, &reads]
+                                 {
+                uint64_t version = 0;
+                while (!done.load(memory_order_acquire))
+                {
+                    const TopOfBook top = live.ReadTop();
+                    assert(top.version >= version && top.bidLevels <= TopLevels && top.askLevels <= TopLevels);
+                    version = top.version;
+                    for (uint32_t i = 0; i < top.bidLevels; ++i)
+                    {
+                        assert(top.bids[i].quantity == 3u * top.bids[i].orders && "Every order is 3 lots");
+                        assert(i == 0 || top.bids[i].price < top.bids[i - 1].price);
+                    }
+                    for (uint32_t i = 0; i < top.askLevels; ++i)
+                    {
+                        assert(top.asks[i].quantity == 3u * top.asks[i].orders);
+                        assert(i == 0 || top.asks[i].price > top.asks[i - 1].price);
+                    }
+                    assert(top.bidLevels == 0 || top.askLevels == 0 || top.bids[0].price < top.asks[0].price);
+                    reads.fetch_add(1, memory_order_relaxed);
+                } });
+        }
+        mt19937 rng(38);
+        for (OrderId id = 1; id <= 100000; ++id)
+        {
+            const Side side = rng() % 2 ? Side::Buy : Side::Sell;
+            const Price price = side == Side::Buy ? Price(95 + rng() % 8) : Price(98 + rng() % 8); // some cross
+            live.AddOrder(id, side, price, 3);
+            if (id > 20 && rng() % 2)
+            {
+                live.CancelOrder(id - rng() % 20);
+            }
+        }
+        done.store(true, memory_order_release);
+        for (thread &reader : readers)
+        {
+            reader.join();
+        }
+        cout << "Published " << live.ReadTop().version << " top-of-book versions, " << reads << " consistent reads\n";
+    }
+}
+
+int main()
+{
+    using namespace std;
+
+    cout << "\n*** LIMIT ORDER MATCHING ENGINE TEST ***\n";
+
+    cout << "\n##### std::map levels #####\n";
+    testContinuousMatching<Orderbook<MapLevels>>();
+    cout << "\n##### Tick ladder levels #####\n";
+    testContinuousMatching<LadderOrderbook>();
+    cout << "\n##### Sorted vector levels #####\n";
+    testContinuousMatching<VectorOrderbook>();
+    testPoolReuse();
+    testLadderRecentering();
+    testCancelModify<Orderbook<MapLevels>>();
+    testCancelModify<LadderOrderbook>();
+    testCancelModify<VectorOrderbook>();
+    testContainersAgree();
+    testOrderIndex();
+    testEngineIds();
+    testTopOfBook<Orderbook<MapLevels>>();
+    testTopOfBook<LadderOrderbook>();
+    testTopOfBook<VectorOrderbook>();
+    testTradeSink();
+    testBatchSubmission<Orderbook<MapLevels>>();
+    testBatchSubmission<LadderOrderbook>();
+    testBatchSubmission<VectorOrderbook>();
+    testDepthIndex();
+    testQueuePosition<Orderbook<MapLevels>>();
+    testQueuePosition<LadderOrderbook>();
+    testQueuePosition<VectorOrderbook>();
+    testTimeInForce<Orderbook<MapLevels>>();
+    testTimeInForce<LadderOrderbook>();
+    testTimeInForce<VectorOrderbook>();
+    testIceberg<Orderbook<MapLevels>>();
+    testIceberg<LadderOrderbook>();
+    testIceberg<VectorOrderbook>();
+    testStopOrders<Orderbook<MapLevels>>();
+    testStopOrders<LadderOrderbook>();
+    testStopOrders<VectorOrderbook>();
+    testAllocationPolicies<MapLevels>();
+    testAllocationPolicies<LadderLevels>();
+    testAllocationPolicies<VectorLevels>();
+    testCallAuction<Orderbook<MapLevels>>();
+    testCallAuction<LadderOrderbook>();
+    testCallAuction<VectorOrderbook>();
+    testExpiry<Orderbook<MapLevels>>();
+    testExpiry<LadderOrderbook>();
+    testExpiry<VectorOrderbook>();
+    testBulkCancel<Orderbook<MapLevels>>();
+    testBulkCancel<LadderOrderbook>();
+    testBulkCancel<VectorOrderbook>();
+    testMatchingEngine();
+    testSpscRing();
+    testPipeline();
+    testWorkStealing();
+    testSeqlockTopOfBook();
+
     cout << "\n*** ALL TESTS COMPLETED SUCCESSFULLY ***\n\n";
 
     return 0;
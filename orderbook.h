@@ -0,0 +1,3427 @@
+/*
+ * Basic Limit Order Matching Engine
+ *
+ * Features:
+ * - Price-time priority matching: Orders matched first by best price, then by arrival time (FIFO)
+ * - Buy orders sorted descending (highest price first), sell orders ascending (lowest price first)
+ * - Automatic matching on order insertion when bid price >= ask price
+ * - Partial fills supported: Orders can be partially filled across multiple matches
+ * - Order deduplication: Duplicate order IDs are rejected
+ * - Iceberg orders: a displayed clip plus a hidden reserve that refills the clip at the back of
+ *   the level from inside matching
+ * - Stop and stop-limit orders: wait in a trigger index ordered by stop price and are released
+ *   in one ordered sweep when the last trade reaches them, then matched like new orders
+ * - Call auctions: StartAuction collects orders without matching, Uncross executes the volume
+ *   maximizing equilibrium price found in one pass over cumulative depth, in one bulk pass
+ * - Time in force and order types: immediate-or-cancel, fill-or-kill (with a liquidity check
+ *   before any matching) and market orders are handled inside matching and never rest
+ * - Bulk cancels: CancelSide and CancelRange drop whole levels at once, CancelOwner walks a
+ *   per-owner intrusive list, so pulling a session costs O(its orders), not O(book)
+ * - Expiry: good-till-date orders go on a heap by expiry and day orders on a list, both left
+ *   by cancels and fills in O(log n) at most, and ExpireOrders / ExpireDayOrders evict
+ *   everything due in one sweep
+ * - Batch submission: AddOrders processes a span of orders into one contiguous trade buffer
+ * - Market data: every level keeps its total quantity and order count, so BestBid, BestAsk,
+ *   Spread and Depth read them without walking the order queues
+ * - Top of book for other threads: optionally, the best levels of both sides are published
+ *   through a seqlock after every change, and ReadTop returns a consistent copy on any thread
+ *   without ever making the matching thread wait
+ * - Cumulative depth: an optional Fenwick-tree DepthIndex per side answers "quantity at or
+ *   better than X" and "VWAP to sweep Q" in O(log W)
+ * - Queue position: optional per-level Fenwick trees over arrival order answer QuantityAhead
+ *   in O(log n)
+ * - Trade execution: Returns all trades generated from a single order insertion, or streams them
+ *   into a caller-supplied sink (TradeSink) so matching itself never allocates
+ * - Efficient lookups: O(1) order cancellation capability via a flat open-addressing hash map,
+ *   or, when the book issues ids itself, generation-tagged slot ids that need no hashing at all
+ * - Cancel and modify: CancelOrder unlinks through the order's own links, ModifyOrder keeps
+ *   queue priority when only the quantity goes down at the same price
+ * - Pooled order storage: orders live in engine-owned slabs and are recycled through a freelist,
+ *   so once the pool is warm adding and filling orders does not allocate Order objects
+ * - Intrusive FIFO queues: each order carries its own prev/next links, so a price level is just
+ *   a head and a tail handle and walking it touches one order record per step
+ * - Allocation policies: strict price-time (FifoAllocation), pro-rata or pro-rata after the
+ *   front order (ProRataAllocation, TopPriorityProRataAllocation), chosen at compile time
+ * - Pluggable level containers: a std::map per side (MapLevels, any price) or a tick-indexed
+ *   ladder with a bitmap of live levels (LadderLevels, O(1) insert and best-price lookup)
+ *   or a sorted vector with the touch at the back (VectorLevels, for thin books)
+ *
+ * Matching Logic:
+ * - Aggressive first: an incoming order is matched against the opposite side before it rests,
+ *   and only the leftover quantity enters the book, so the book itself is never crossed
+ * - Match price: Uses the price of the resting order (market maker gets their price)
+ * - Order removal: Fully filled orders automatically removed from book
+ *
+ * Tests live in orderbook.cpp, benchmarks in orderbook_bench.cpp.
+ */
+
+#pragma once
+
+#include <iostream>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstdlib>
+#include <concepts>
+#include <functional>
+#include <initializer_list>
+#include <limits>
+#include <map>
+#include <new>
+#include <optional>
+#include <span>
+#include <type_traits>
+#include <utility>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+using Price = std::int32_t;
+using Quantity = std::uint32_t;
+using OrderId = std::uint64_t;
+
+enum class Side : std::uint8_t
+{
+    Buy,
+    Sell
+};
+
+// stable handle to an order living in an OrderPool: an index, never invalidated while the order is alive
+using OrderHandle = std::uint32_t;
+inline constexpr OrderHandle NullHandle = UINT32_MAX;
+
+class Order
+{
+private:
+    OrderId id_;
+    Price price_;
+    Quantity quantity_;
+    // intrusive FIFO links to the neighbours at the same price level
+    OrderHandle prev_ = NullHandle;
+    OrderHandle next_ = NullHandle;
+    std::uint32_t sequence_ = 0; // arrival number within the level, see QueuePositions
+    Side side_;
+    bool iceberg_ = false; // has a hidden reserve, kept by the book next to the pool
+    bool stop_ = false;    // waiting for its stop price, in the book's trigger index instead of a level
+    bool owned_ = false;   // on its owner's list, kept by the book next to the pool
+
+    friend class OrderQueue;
+    friend class QueuePositions;
+
+public:
+    Order() = default; // pool slots are default constructed, then assigned on allocation
+    Order(OrderId id, Side side, Price price, Quantity quantity) : id_(id), price_(price), quantity_(quantity),
+                                                                   side_(side)
+    {
+    }
+
+    OrderId getId() const { return id_; }
+    Side getSide() const { return side_; }
+    Price getPrice() const { return price_; }
+    Quantity getQuantity() const { return quantity_; }
+    OrderHandle getNext() const { return next_; }
+    OrderHandle getPrev() const { return prev_; }
+    bool isIceberg() const { return iceberg_; }
+    void setIceberg(bool iceberg) { iceberg_ = iceberg; }
+    bool isStop() const { return stop_; }
+    void setStop(bool stop) { stop_ = stop; }
+    bool isOwned() const { return owned_; }
+    void setOwned(bool owned) { owned_ = owned; }
+
+    void Fill(const Quantity filling)
+    {
+        if (filling > quantity_)
+        {
+            throw std::logic_error("filling too much");
+        }
+        quantity_ -= filling;
+    }
+
+    // new price and quantity for a cancel-replace that keeps the order's id and slot
+    void Replace(const Price price, const Quantity quantity)
+    {
+        price_ = price;
+        quantity_ = quantity;
+    }
+
+    // a filled iceberg clip is topped up from the reserve
+    void Refill(const Quantity quantity)
+    {
+        quantity_ = quantity;
+    }
+
+    // quantity reduction requested by the owner, not a trade
+    void ReduceTo(const Quantity quantity)
+    {
+        if (quantity > quantity_)
+        {
+            throw std::logic_error("reducing to a larger quantity");
+        }
+        quantity_ = quantity;
+    }
+
+    bool isFilled() const
+    {
+        return quantity_ == 0;
+    }
+
+    void print() const
+    {
+        using namespace std;
+        cout << "Id: " << id_ << " Side: " << static_cast<int>(side_) << " Price: " << price_ << " Quantity: " << quantity_ << '\n';
+    }
+};
+
+// Engine-owned slab allocator for orders.
+// Slabs are never moved or freed while the pool lives, so a handle (and a reference obtained from it)
+// stays valid until the order is released. Released slots go on a freelist and are reused first,
+// so in steady state Allocate and Release don't touch the heap at all.
+class OrderPool
+{
+private:
+    static constexpr std::size_t SlabSize = 4096;
+
+    std::vector<std::unique_ptr<Order[]>> slabs_;
+    std::vector<OrderHandle> freelist_; // capacity always matches the slots, so push_back never reallocates
+    // bumped on every allocate and release: odd while the slot holds a live order
+    std::vector<std::uint32_t> generations_;
+
+    void Grow()
+    {
+        const std::size_t first = slabs_.size() * SlabSize;
+        slabs_.push_back(std::make_unique<Order[]>(SlabSize));
+        generations_.resize(first + SlabSize, 0);
+        freelist_.reserve(first + SlabSize);
+        // push in reverse so the lowest handles are handed out first
+        for (std::size_t i = first + SlabSize; i > first; --i)
+        {
+            freelist_.push_back(static_cast<OrderHandle>(i - 1));
+        }
+    }
+
+public:
+    explicit OrderPool(std::size_t capacity = 0)
+    {
+        Reserve(capacity);
+    }
+
+    // preallocate enough slabs to hold at least capacity live orders
+    void Reserve(std::size_t capacity)
+    {
+        while (Capacity() < capacity)
+        {
+            Grow();
+        }
+    }
+
+    OrderHandle Allocate(OrderId id, Side side, Price price, Quantity quantity)
+    {
+        if (freelist_.empty())
+        {
+            Grow();
+        }
+        const OrderHandle handle = freelist_.back();
+        freelist_.pop_back();
+        ++generations_[handle];
+        (*this)[handle] = Order(id, side, price, quantity);
+        return handle;
+    }
+
+    // allocate an order whose id is its own slot id, see SlotId
+    OrderHandle AllocateWithSlotId(Side side, Price price, Quantity quantity)
+    {
+        const OrderHandle handle = Allocate(0, side, price, quantity);
+        (*this)[handle] = Order(SlotId(handle), side, price, quantity);
+        return handle;
+    }
+
+    void Release(OrderHandle handle)
+    {
+        ++generations_[handle];
+        freelist_.push_back(handle);
+    }
+
+    // Engine-issued id: the slot handle in the low 32 bits, the slot's generation in the high 32.
+    // Resolving it is an array index and a compare, and a stale id (order gone, slot reused)
+    // never resolves because the generation moved on.
+    OrderId SlotId(OrderHandle handle) const
+    {
+        return (static_cast<OrderId>(generations_[handle]) << 32) | handle;
+    }
+
+    // NullHandle when the id is stale or was never issued
+    OrderHandle ResolveSlotId(OrderId id) const
+    {
+        const OrderHandle handle = static_cast<OrderHandle>(id);
+        const std::uint32_t generation = static_cast<std::uint32_t>(id >> 32);
+        if (handle >= generations_.size() || generations_[handle] != generation || generation % 2 == 0)
+        {
+            return NullHandle;
+        }
+        return handle;
+    }
+
+    Order &operator[](OrderHandle handle) { return slabs_[handle / SlabSize][handle % SlabSize]; }
+    const Order &operator[](OrderHandle handle) const { return slabs_[handle / SlabSize][handle % SlabSize]; }
+
+    std::size_t Capacity() const { return slabs_.size() * SlabSize; }
+    std::size_t Live() const { return Capacity() - freelist_.size(); }
+};
+
+// FIFO of orders at one price level, linked through the orders themselves.
+// No node allocation on insert, and any order can be unlinked in O(1) from its handle alone.
+// The level also keeps its total quantity and order count up to date on every add, fill and
+// cancel, so depth queries read them directly instead of walking the orders. Quantity is what is
+// displayed; iceberg reserves are counted separately.
+class OrderQueue
+{
+private:
+    OrderHandle head_ = NullHandle;
+    OrderHandle tail_ = NullHandle;
+    std::uint32_t count_ = 0;
+    std::uint32_t positions_ = NullHandle; // this level's QueuePositions tree, if it has one
+    std::uint64_t quantity_ = 0;
+    std::uint64_t hidden_ = 0; // iceberg reserves behind the displayed quantity
+
+    friend class QueuePositions;
+
+public:
+    bool empty() const { return head_ == NullHandle; }
+    OrderHandle front() const { return head_; }
+    OrderHandle back() const { return tail_; }
+    std::uint32_t count() const { return count_; }
+    std::uint64_t quantity() const { return quantity_; }
+    std::uint64_t hidden() const { return hidden_; }
+
+    // an order of this level traded or was reduced by quantity
+    void Deduct(Quantity quantity)
+    {
+        quantity_ -= quantity;
+    }
+
+    // iceberg reserve joined (positive) or left (negative) this level
+    void AddHidden(std::int64_t quantity)
+    {
+        hidden_ += quantity;
+    }
+
+    void push_back(OrderPool &pool, OrderHandle handle)
+    {
+        Order &order = pool[handle];
+        ++count_;
+        quantity_ += order.quantity_;
+        order.prev_ = tail_;
+        order.next_ = NullHandle;
+        if (tail_ == NullHandle)
+        {
+            head_ = handle;
+        }
+        else
+        {
+            pool[tail_].next_ = handle;
+        }
+        tail_ = handle;
+    }
+
+    void erase(OrderPool &pool, OrderHandle handle)
+    {
+        Order &order = pool[handle];
+        --count_;
+        quantity_ -= order.quantity_;
+        if (order.prev_ == NullHandle)
+        {
+            head_ = order.next_;
+        }
+        else
+        {
+            pool[order.prev_].next_ = order.next_;
+        }
+        if (order.next_ == NullHandle)
+        {
+            tail_ = order.prev_;
+        }
+        else
+        {
+            pool[order.next_].prev_ = order.prev_;
+        }
+        order.prev_ = order.next_ = NullHandle;
+    }
+
+    void pop_front(OrderPool &pool)
+    {
+        erase(pool, head_);
+    }
+};
+
+// Per-level Fenwick trees of order quantity indexed by arrival sequence, so the quantity queued
+// ahead of an order is a prefix sum. An order joining the back of a level takes the level's next
+// sequence number. When the numbers run out, the level renumbers its live orders from zero into a
+// tree twice their count, so renumbering is amortized over the pushes that filled the old one.
+// An emptied level hands its tree back; every entry is zero by then, so it is reused as is.
+class QueuePositions
+{
+private:
+    struct Tree
+    {
+        std::vector<std::int64_t> sums; // 1-based Fenwick tree
+        std::uint32_t next = 0;          // sequence number of the next order to join
+    };
+    std::vector<Tree> trees_;
+    std::vector<std::uint32_t> free_;
+
+    static void Update(Tree &tree, std::uint32_t sequence, std::int64_t delta)
+    {
+        for (std::size_t i = sequence + 1; i < tree.sums.size(); i += i & (~i + 1))
+        {
+            tree.sums[i] += delta;
+        }
+    }
+
+    static void Renumber(Tree &tree, const OrderQueue &level, OrderPool &pool)
+    {
+        const std::size_t capacity = std::max<std::size_t>(16, std::bit_ceil(2 * std::size_t{level.count()}));
+        tree.sums.assign(capacity + 1, 0);
+        std::uint32_t sequence = 0;
+        for (OrderHandle handle = level.front(); handle != NullHandle; handle = pool[handle].next_)
+        {
+            Order &order = pool[handle];
+            order.sequence_ = sequence++;
+            tree.sums[sequence] = order.quantity_;
+        }
+        tree.next = sequence;
+        // linear-time build: push each node's sum into its parent
+        for (std::size_t i = 1; i <= capacity; ++i)
+        {
+            const std::size_t parent = i + (i & (~i + 1));
+            if (parent <= capacity)
+            {
+                tree.sums[parent] += tree.sums[i];
+            }
+        }
+    }
+
+public:
+    // handle has just been pushed to the back of level
+    void Push(OrderQueue &level, OrderPool &pool, OrderHandle handle)
+    {
+        if (level.positions_ == NullHandle)
+        {
+            if (free_.empty())
+            {
+                level.positions_ = static_cast<std::uint32_t>(trees_.size());
+                trees_.emplace_back();
+            }
+            else
+            {
+                level.positions_ = free_.back();
+                free_.pop_back();
+            }
+        }
+        Tree &tree = trees_[level.positions_];
+        if (tree.next + 1 >= tree.sums.size())
+        {
+            Renumber(tree, level, pool); // numbers handle too
+            return;
+        }
+        Order &order = pool[handle];
+        order.sequence_ = tree.next++;
+        Update(tree, order.sequence_, order.quantity_);
+    }
+
+    // order of level traded, was reduced or left the level by delta (negative)
+    void Add(const OrderQueue &level, const Order &order, std::int64_t delta)
+    {
+        Update(trees_[level.positions_], order.sequence_, delta);
+    }
+
+    // level has just become empty
+    void Release(OrderQueue &level)
+    {
+        trees_[level.positions_].next = 0;
+        free_.push_back(level.positions_);
+        level.positions_ = NullHandle;
+    }
+
+    // level is dropped with its orders still in it: zero its tree before handing it back
+    void Discard(OrderQueue &level)
+    {
+        std::vector<std::int64_t> &sums = trees_[level.positions_].sums;
+        std::fill(sums.begin(), sums.end(), 0);
+        Release(level);
+    }
+
+    std::uint64_t Ahead(const OrderQueue &level, const Order &order) const
+    {
+        const Tree &tree = trees_[level.positions_];
+        std::int64_t sum = 0;
+        for (std::size_t i = order.sequence_; i > 0; i -= i & (~i + 1))
+        {
+            sum += tree.sums[i];
+        }
+        return static_cast<std::uint64_t>(sum);
+    }
+};
+
+struct TradeSide
+{
+    OrderId orderId;
+    Price price;
+    Quantity quantity;
+};
+
+struct Trade
+{
+    TradeSide buySide;
+    TradeSide sellSide;
+
+    void print() const
+    {
+        using namespace std;
+        cout << "Buy: " << buySide.orderId << ' ' << buySide.price << ' ' << buySide.quantity << '\n';
+        cout << "Sell: " << sellSide.orderId << ' ' << sellSide.price << ' ' << sellSide.quantity << '\n';
+    }
+};
+
+using Trades = std::vector<Trade>;
+
+// Aggregate view of one price level, see Orderbook::BestBid and Orderbook::Depth
+struct LevelInfo
+{
+    Price price;
+    std::uint64_t quantity; // total resting quantity
+    std::uint32_t orders;   // number of resting orders
+
+    bool operator==(const LevelInfo &) const = default;
+};
+
+// levels per side in a TopOfBook
+inline constexpr std::size_t TopLevels = 8;
+
+// The best TopLevels levels of both sides as they were at one instant, see Orderbook::ReadTop
+struct TopOfBook
+{
+    std::uint64_t version = 0;   // publications so far: the same version is the same picture
+    std::uint32_t bidLevels = 0; // bids[0 .. bidLevels) are live, best first
+    std::uint32_t askLevels = 0;
+    std::array<LevelInfo, TopLevels> bids{};
+    std::array<LevelInfo, TopLevels> asks{};
+};
+
+// One writer publishes a trivially copyable value, any number of readers copy it, and nobody
+// ever waits for anybody: the sequence is odd while a store is in progress, and a reader that
+// saw it odd, or saw it change while copying, throws its copy away. Readers only read, so they
+// never pull the writer's lines away from it; the writer pays a few plain stores per publish.
+// The value is held as relaxed atomic words, so a copy torn by a concurrent store is merely
+// discarded rather than undefined behaviour.
+template <typename T>
+class Seqlock
+{
+    static_assert(std::is_trivially_copyable_v<T>, "the value is copied in and out as words");
+
+private:
+    static constexpr std::size_t Words = (sizeof(T) + sizeof(std::uint64_t) - 1) / sizeof(std::uint64_t);
+
+    // its own lines, away from whatever the writer works on
+    alignas(64) std::atomic<std::uint64_t> sequence_{0};
+    std::atomic<std::uint64_t> words_[Words] = {};
+
+public:
+    // writer only
+    void Store(const T &value)
+    {
+        std::uint64_t buffer[Words] = {};
+        std::memcpy(buffer, &value, sizeof(T));
+        const std::uint64_t sequence = sequence_.load(std::memory_order_relaxed);
+        sequence_.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release); // odd before any word changes
+        for (std::size_t i = 0; i < Words; ++i)
+        {
+            words_[i].store(buffer[i], std::memory_order_relaxed);
+        }
+        sequence_.store(sequence + 2, std::memory_order_release);
+    }
+
+    // Writer only: Store for a value that differs from the last one stored only within the given
+    // [from, to) byte ranges. Just the words covering them are written, the rest stay as stored.
+    void Store(const T &value, std::initializer_list<std::pair<std::size_t, std::size_t>> changed)
+    {
+        const auto *bytes = reinterpret_cast<const std::byte *>(&value);
+        const std::uint64_t sequence = sequence_.load(std::memory_order_relaxed);
+        sequence_.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (const auto &[from, to] : changed)
+        {
+            for (std::size_t i = from / sizeof(std::uint64_t); i * sizeof(std::uint64_t) < to; ++i)
+            {
+                std::uint64_t word = 0;
+                const std::size_t offset = i * sizeof(std::uint64_t);
+                std::memcpy(&word, bytes + offset, std::min(sizeof(word), sizeof(T) - offset));
+                words_[i].store(word, std::memory_order_relaxed);
+            }
+        }
+        sequence_.store(sequence + 2, std::memory_order_release);
+    }
+
+    // Any thread: copies the value into out and returns true, or returns false leaving out alone
+    // when a store was in progress or overlapped the copy.
+    bool TryLoad(T &out) const
+    {
+        const std::uint64_t before = sequence_.load(std::memory_order_acquire);
+        if (before & 1)
+        {
+            return false;
+        }
+        std::uint64_t buffer[Words];
+        for (std::size_t i = 0; i < Words; ++i)
+        {
+            buffer[i] = words_[i].load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire); // the words before the second look
+        if (sequence_.load(std::memory_order_relaxed) != before)
+        {
+            return false;
+        }
+        std::memcpy(&out, buffer, sizeof(T));
+        return true;
+    }
+
+    // any thread: retries until it gets a consistent copy
+    T Load() const
+    {
+        T value;
+        while (!TryLoad(value))
+        {
+        }
+        return value;
+    }
+};
+
+// time on the caller's clock (the book has none of its own), e.g. nanoseconds since the epoch
+using Timestamp = std::uint64_t;
+
+// deadline of Day orders: they go when the session ends, see Orderbook::ExpireDayOrders
+inline constexpr Timestamp SessionEnd = UINT64_MAX;
+
+enum class TimeInForce : std::uint8_t
+{
+    GoodTillCancel,    // whatever doesn't fill right away rests in the book
+    ImmediateOrCancel, // fills what it can right away, the rest is dropped
+    FillOrKill,        // fills completely right away, or does nothing at all
+    GoodTillDate,      // rests until its expiry, see Orderbook::ExpireOrders
+    Day                // rests until the end of the session
+};
+
+enum class OrderType : std::uint8_t
+{
+    Limit,
+    Market // no limit price: takes whatever the other side offers and never rests
+};
+
+// Session, account or trader an order belongs to, for bulk cancels, see Orderbook::CancelOwner.
+// 0 is no owner.
+using OwnerId = std::uint32_t;
+inline constexpr OwnerId NoOwner = 0;
+
+// Outcome of a call auction, see Orderbook::Uncross
+struct AuctionResult
+{
+    Price price;          // equilibrium price every auction fill executes at
+    std::uint64_t volume; // quantity executed
+};
+
+// One order to add, see Orderbook::AddOrder and Orderbook::AddOrders
+struct OrderRequest
+{
+    OrderId id = 0;
+    Side side = Side::Buy;
+    Price price = 0; // ignored for market orders
+    Quantity quantity = 0;
+    TimeInForce timeInForce = TimeInForce::GoodTillCancel;
+    OrderType type = OrderType::Limit;
+    Quantity displayQuantity = 0; // iceberg clip size; 0 displays the whole quantity
+    Timestamp expiry = 0;         // good-till-date orders only
+    OwnerId owner = NoOwner;
+};
+
+// Anything that can be called with each Trade as it happens: a lambda writing into a reusable
+// buffer, a publisher encoding straight into its send buffer... The Trade lives on the matcher's
+// stack, so consuming it in place costs no allocation and no copy beyond what the sink does.
+template <typename F>
+concept TradeSink = std::invocable<F &, const Trade &>;
+
+// Configuration shared by the book and its level containers
+struct OrderbookConfig
+{
+    std::size_t capacity = 0;     // orders to preallocate pool slots for
+    bool engineIds = false;       // the book issues order ids itself (slot ids), see Orderbook::AddOrder
+    Price tickSize = 1;           // prices must be multiples of this
+    std::size_t ladderLevels = 4096; // LadderLevels and the depth index: initial window width in ticks
+    std::size_t windowLimit = std::size_t{1} << 20; // LadderLevels and the depth index: widest window in ticks
+    bool depthIndex = false;      // keep a DepthIndex per side for O(log) cumulative depth queries
+    bool queuePositions = false;  // keep QueuePositions so QuantityAhead is O(log n) in the level's orders
+    bool publishTop = false;      // publish a TopOfBook after every change, for ReadTop on other threads
+};
+
+// Level containers: one per side, each keeps the price levels of that side in priority order
+// (best first). Orderbook only needs this interface from them:
+//   empty(), BestPrice(), Best(), PopBest(), operator[](price) (find or create), Find(price),
+//   Release(price) (that level just became empty), ForEach(fn) over live levels in priority order
+//   (fn returns false to stop early), Fits(price) (operator[] would take that price; a container
+//   with a bounded window says no instead of growing without limit), and StableLevels: whether
+//   a level's OrderQueue stays at one address for as long as it has orders. When it does, the book keeps that address for
+//   every resting order and reaches the level of a cancelled or modified order through it;
+//   otherwise it looks the level up by price.
+// The best level is never empty; any other emptied level may be kept around and reclaimed later.
+
+// emptied levels a container may keep before it sweeps them all in one pass
+inline constexpr std::size_t ReclaimThreshold = 64;
+
+// better(a, b) is true when price a has priority over price b on side S
+template <Side S>
+using PriceBetter = std::conditional_t<S == Side::Buy, std::greater<>, std::less<>>;
+
+// Red-black tree of levels: any price, O(log L) to reach a level.
+// Levels emptied by cancels below the touch stay in the tree (a later order at that price
+// reuses the node) and are erased in bulk once there are too many, so cancels don't rebalance.
+template <Side S>
+class MapLevels
+{
+private:
+    std::map<Price, OrderQueue, PriceBetter<S>> levels_;
+    std::size_t emptied_ = 0; // empty levels still in the tree
+
+public:
+    static constexpr bool StableLevels = true; // tree nodes never move
+
+    explicit MapLevels(const OrderbookConfig &) {}
+
+    bool Fits(Price) const { return true; }
+    bool empty() const { return levels_.empty(); }
+    Price BestPrice() const { return levels_.begin()->first; }
+    OrderQueue &Best() { return levels_.begin()->second; }
+    const OrderQueue &Best() const { return levels_.begin()->second; }
+
+    void PopBest()
+    {
+        levels_.erase(levels_.begin());
+        // keep the best level live
+        while (!levels_.empty() && levels_.begin()->second.empty())
+        {
+            levels_.erase(levels_.begin());
+            --emptied_;
+        }
+    }
+
+    OrderQueue &operator[](Price price)
+    {
+        auto [it, inserted] = levels_.try_emplace(price);
+        if (!inserted && it->second.empty())
+        {
+            --emptied_; // revived
+        }
+        return it->second;
+    }
+
+    OrderQueue *Find(Price price)
+    {
+        auto it = levels_.find(price);
+        return it == levels_.end() ? nullptr : &it->second;
+    }
+
+    const OrderQueue *Find(Price price) const { return const_cast<MapLevels *>(this)->Find(price); }
+
+    void Release(Price price)
+    {
+        if (price == levels_.begin()->first)
+        {
+            PopBest();
+        }
+        else if (++emptied_ > ReclaimThreshold && emptied_ * 2 > levels_.size())
+        {
+            std::erase_if(levels_, [](const auto &level)
+                          { return level.second.empty(); });
+            emptied_ = 0;
+        }
+    }
+
+    template <typename Fn>
+    void ForEach(Fn fn) const
+    {
+        for (const auto &[price, level] : levels_)
+        {
+            if (!level.empty() && !fn(price, level))
+            {
+                return;
+            }
+        }
+    }
+};
+
+// Tick-indexed array of levels covering a window of prices around the touch.
+// A level lives at index (price - base) / tick, and a two-level bitmap of non-empty levels
+// finds the best one with a couple of bit scans, so insert and best-price lookup are O(1).
+// When a price falls outside the window the ladder re-centers on the live range,
+// doubling the window if the live range doesn't fit anymore, up to
+// OrderbookConfig::windowLimit: a price that would stretch the live range past half of that
+// doesn't Fit, and the book rejects it before it trades.
+template <Side S>
+class LadderLevels
+{
+private:
+    static constexpr std::size_t WordBits = 64;
+
+    Price tick_;
+    std::size_t limit_; // widest window, a multiple of WordBits
+    Price base_ = 0; // price at index 0
+    bool anchored_ = false; // base_ is chosen by the first price we see
+    std::size_t count_ = 0; // non-empty levels
+    std::vector<OrderQueue> levels_;
+    std::vector<std::uint64_t> words_;   // bit i: level i is live
+    std::vector<std::uint64_t> summary_; // bit j: words_[j] != 0
+
+    static std::size_t RoundUp(std::size_t width)
+    {
+        return (width + WordBits - 1) / WordBits * WordBits;
+    }
+
+    void Resize(std::size_t width)
+    {
+        levels_.assign(width, OrderQueue{});
+        words_.assign(width / WordBits, 0);
+        summary_.assign((words_.size() + WordBits - 1) / WordBits, 0);
+    }
+
+    // the lowest price on the tick grid (base_'s grid, that is: multiples of the tick) that a
+    // window can start at, so that the window's prices stay within Price
+    Price Lowest() const { return std::numeric_limits<Price>::min() / tick_ * tick_; }
+
+    // ticks from low to high, both included
+    std::size_t Span(Price low, Price high) const
+    {
+        return static_cast<std::size_t>((static_cast<std::int64_t>(high) - low) / tick_) + 1;
+    }
+
+    std::size_t Width() const { return levels_.size(); }
+    Price PriceAt(std::size_t index) const { return base_ + static_cast<Price>(index) * tick_; }
+
+    // signed tick offset from base_, throws when the price is not on the tick grid
+    std::int64_t Offset(Price price) const
+    {
+        if (price % tick_ != 0)
+        {
+            throw std::invalid_argument("price is not a multiple of the tick size");
+        }
+        return (static_cast<std::int64_t>(price) - base_) / tick_;
+    }
+
+    void Set(std::size_t index)
+    {
+        words_[index / WordBits] |= std::uint64_t{1} << (index % WordBits);
+        summary_[index / WordBits / WordBits] |= std::uint64_t{1} << (index / WordBits % WordBits);
+        ++count_;
+    }
+
+    void Clear(std::size_t index)
+    {
+        std::uint64_t &word = words_[index / WordBits];
+        word &= ~(std::uint64_t{1} << (index % WordBits));
+        if (word == 0)
+        {
+            summary_[index / WordBits / WordBits] &= ~(std::uint64_t{1} << (index / WordBits % WordBits));
+        }
+        --count_;
+    }
+
+    bool IsSet(std::size_t index) const
+    {
+        return (words_[index / WordBits] >> (index % WordBits)) & 1;
+    }
+
+    std::size_t LowestIndex() const
+    {
+        std::size_t s = 0;
+        while (summary_[s] == 0)
+            ++s;
+        const std::size_t w = s * WordBits + std::countr_zero(summary_[s]);
+        return w * WordBits + std::countr_zero(words_[w]);
+    }
+
+    std::size_t HighestIndex() const
+    {
+        std::size_t s = summary_.size() - 1;
+        while (summary_[s] == 0)
+            --s;
+        const std::size_t w = s * WordBits + (WordBits - 1 - std::countl_zero(summary_[s]));
+        return w * WordBits + (WordBits - 1 - std::countl_zero(words_[w]));
+    }
+
+    // index of the best live level: lowest for asks, highest for bids
+    std::size_t BestIndex() const { return S == Side::Sell ? LowestIndex() : HighestIndex(); }
+
+    // Move every live level into a window wide enough for [low, high] and centered on it. The
+    // new window is built aside and swapped in whole, so a failed allocation changes nothing.
+    void Recenter(Price low, Price high)
+    {
+        const std::size_t span = Span(low, high);
+        std::size_t width = Width();
+        while (width < span * 2 && width < limit_) // leave room to drift on both sides
+        {
+            width *= 2;
+        }
+        width = std::min(width, limit_);
+
+        const std::int64_t center = (static_cast<std::int64_t>(low) + high) / 2;
+        const std::int64_t half = static_cast<std::int64_t>(width / 2) * tick_;
+        const std::int64_t start = center - half - (center - half - base_) % tick_; // stay on the tick grid
+        const Price base = static_cast<Price>(std::max<std::int64_t>(start, Lowest()));
+
+        std::vector<OrderQueue> levels(width);
+        std::vector<std::uint64_t> words(width / WordBits, 0);
+        std::vector<std::uint64_t> summary((words.size() + WordBits - 1) / WordBits, 0);
+        ForEach([&](Price price, const OrderQueue &level)
+                {
+                    const std::size_t index = static_cast<std::size_t>((static_cast<std::int64_t>(price) - base) / tick_);
+                    levels[index] = level;
+                    words[index / WordBits] |= std::uint64_t{1} << (index % WordBits);
+                    summary[index / WordBits / WordBits] |= std::uint64_t{1} << (index / WordBits % WordBits);
+                    return true; });
+        levels_.swap(levels);
+        words_.swap(words);
+        summary_.swap(summary);
+        base_ = base;
+    }
+
+public:
+    // Recenter moves every level, but finding one by price is O(1) anyway
+    static constexpr bool StableLevels = false;
+
+    explicit LadderLevels(const OrderbookConfig &config) : tick_(config.tickSize)
+    {
+        if (tick_ <= 0)
+        {
+            throw std::invalid_argument("tick size must be positive");
+        }
+        Resize(std::max(RoundUp(config.ladderLevels), WordBits));
+        limit_ = std::max(config.windowLimit / WordBits * WordBits, Width());
+    }
+
+    // whether operator[] can hold a level at price: it is in the window already, or the live
+    // range stretched to take it in spans at most half the widest window
+    bool Fits(Price price) const
+    {
+        if (anchored_ && price % tick_ == 0)
+        {
+            const std::int64_t offset = (static_cast<std::int64_t>(price) - base_) / tick_;
+            if (offset >= 0 && offset < static_cast<std::int64_t>(Width()))
+            {
+                return true;
+            }
+        }
+        const Price low = empty() ? price : std::min(price, PriceAt(LowestIndex()));
+        const Price high = empty() ? price : std::max(price, PriceAt(HighestIndex()));
+        return Span(low, high) * 2 <= limit_;
+    }
+
+    bool empty() const { return count_ == 0; }
+    Price BestPrice() const { return PriceAt(BestIndex()); }
+    OrderQueue &Best() { return levels_[BestIndex()]; }
+    const OrderQueue &Best() const { return levels_[BestIndex()]; }
+
+    void PopBest()
+    {
+        const std::size_t index = BestIndex();
+        levels_[index] = OrderQueue{};
+        Clear(index);
+    }
+
+    // throws, changing nothing, when the price doesn't Fit
+    OrderQueue &operator[](Price price)
+    {
+        std::int64_t offset = Offset(price);
+        if (!anchored_)
+        {
+            // first price ever: put it in the middle of the window
+            base_ = static_cast<Price>(std::max<std::int64_t>(price - static_cast<std::int64_t>(Width() / 2) * tick_, Lowest()));
+            anchored_ = true;
+            offset = Offset(price);
+        }
+        if (offset < 0 || offset >= static_cast<std::int64_t>(Width()))
+        {
+            if (!Fits(price))
+            {
+                throw std::invalid_argument("price is too far from the book for the ladder's window");
+            }
+            Price low = price;
+            Price high = price;
+            if (!empty())
+            {
+                low = std::min(low, PriceAt(LowestIndex()));
+                high = std::max(high, PriceAt(HighestIndex()));
+            }
+            Recenter(low, high);
+            offset = Offset(price);
+        }
+        const std::size_t index = static_cast<std::size_t>(offset);
+        if (!IsSet(index))
+        {
+            Set(index);
+        }
+        return levels_[index];
+    }
+
+    OrderQueue *Find(Price price)
+    {
+        if (!anchored_ || price % tick_ != 0)
+        {
+            return nullptr;
+        }
+        const std::int64_t offset = (static_cast<std::int64_t>(price) - base_) / tick_;
+        if (offset < 0 || offset >= static_cast<std::int64_t>(Width()) || !IsSet(static_cast<std::size_t>(offset)))
+        {
+            return nullptr;
+        }
+        return &levels_[static_cast<std::size_t>(offset)];
+    }
+
+    const OrderQueue *Find(Price price) const { return const_cast<LadderLevels *>(this)->Find(price); }
+
+    // clearing a bit is already O(1), so emptied levels are reclaimed right away
+    void Release(Price price)
+    {
+        if (OrderQueue *level = Find(price))
+        {
+            *level = OrderQueue{};
+            Clear(static_cast<std::size_t>(Offset(price)));
+        }
+    }
+
+    // walk the live levels best first, one bit scan per level
+    template <typename Fn>
+    void ForEach(Fn fn) const
+    {
+        if constexpr (S == Side::Sell)
+        {
+            for (std::size_t w = 0; w < words_.size(); ++w)
+            {
+                for (std::uint64_t bits = words_[w]; bits != 0; bits &= bits - 1)
+                {
+                    const std::size_t index = w * WordBits + std::countr_zero(bits);
+                    if (!fn(PriceAt(index), levels_[index]))
+                        return;
+                }
+            }
+        }
+        else
+        {
+            for (std::size_t w = words_.size(); w-- > 0;)
+            {
+                for (std::uint64_t bits = words_[w]; bits != 0;)
+                {
+                    const std::size_t bit = WordBits - 1 - std::countl_zero(bits);
+                    bits &= ~(std::uint64_t{1} << bit);
+                    const std::size_t index = w * WordBits + bit;
+                    if (!fn(PriceAt(index), levels_[index]))
+                        return;
+                }
+            }
+        }
+    }
+};
+
+// Contiguous vector of levels sorted worst to best, so the touch is at the back:
+// adding or removing the best level is a push_back/pop_back and every search is a linear scan
+// from the back, which the prefetcher handles well. Meant for thin books (a few dozen levels),
+// where it beats both the tree and the ladder.
+// The vector holds prices and pointers, so inserting a level shifts 16-byte entries and the
+// queues themselves never move; queues of removed levels are kept for reuse.
+// Like MapLevels, levels emptied away from the touch are left in place and swept in bulk.
+template <Side S>
+class VectorLevels
+{
+private:
+    std::vector<std::pair<Price, std::unique_ptr<OrderQueue>>> levels_;
+    std::vector<std::unique_ptr<OrderQueue>> spare_; // queues of removed levels
+    std::size_t emptied_ = 0;                        // empty levels still in the vector
+
+    // insertion point for price: every level from there to the back is strictly better
+    auto Seek(Price price)
+    {
+        auto it = levels_.end();
+        while (it != levels_.begin() && PriceBetter<S>{}((it - 1)->first, price))
+        {
+            --it;
+        }
+        return it;
+    }
+
+    void PopBack()
+    {
+        spare_.push_back(std::move(levels_.back().second));
+        levels_.pop_back();
+    }
+
+public:
+    static constexpr bool StableLevels = true;
+
+    explicit VectorLevels(const OrderbookConfig &) {}
+
+    bool Fits(Price) const { return true; }
+    bool empty() const { return levels_.empty(); }
+    Price BestPrice() const { return levels_.back().first; }
+    OrderQueue &Best() { return *levels_.back().second; }
+    const OrderQueue &Best() const { return *levels_.back().second; }
+
+    void PopBest()
+    {
+        PopBack();
+        // keep the best level live
+        while (!levels_.empty() && levels_.back().second->empty())
+        {
+            PopBack();
+            --emptied_;
+        }
+    }
+
+    OrderQueue &operator[](Price price)
+    {
+        auto it = Seek(price);
+        if (it != levels_.begin() && (it - 1)->first == price)
+        {
+            if ((it - 1)->second->empty())
+            {
+                --emptied_; // revived
+            }
+            return *(it - 1)->second;
+        }
+        std::unique_ptr<OrderQueue> queue;
+        if (spare_.empty())
+        {
+            queue = std::make_unique<OrderQueue>();
+        }
+        else
+        {
+            queue = std::move(spare_.back());
+            spare_.pop_back();
+            *queue = OrderQueue{};
+        }
+        return *levels_.insert(it, {price, std::move(queue)})->second;
+    }
+
+    OrderQueue *Find(Price price)
+    {
+        auto it = Seek(price);
+        return it != levels_.begin() && (it - 1)->first == price ? (it - 1)->second.get() : nullptr;
+    }
+
+    const OrderQueue *Find(Price price) const { return const_cast<VectorLevels *>(this)->Find(price); }
+
+    void Release(Price price)
+    {
+        if (price == levels_.back().first)
+        {
+            PopBest();
+        }
+        else if (++emptied_ > ReclaimThreshold && emptied_ * 2 > levels_.size())
+        {
+            std::size_t kept = 0;
+            for (auto &level : levels_)
+            {
+                if (level.second->empty())
+                    spare_.push_back(std::move(level.second));
+                else
+                    std::swap(levels_[kept++], level);
+            }
+            levels_.resize(kept);
+            emptied_ = 0;
+        }
+    }
+
+    template <typename Fn>
+    void ForEach(Fn fn) const
+    {
+        for (auto it = levels_.rbegin(); it != levels_.rend(); ++it)
+        {
+            if (!it->second->empty() && !fn(it->first, *it->second))
+            {
+                return;
+            }
+        }
+    }
+};
+
+// Cumulative depth of one side over a window of tick prices: two Fenwick trees, one of level
+// quantities and one of level notionals (price * quantity), indexed best price first.
+// Each level change is an O(log W) update, and "how much is there at or better than X" or
+// "what does sweeping Q cost" are O(log W) prefix queries, however deep the book is.
+// The window never grows past OrderbookConfig::windowLimit: levels further from the best price
+// than that are only counted in Unindexed, and a query that reaches them is answered by the book
+// walking its levels instead, see Answers.
+class DepthIndex
+{
+private:
+    Price origin_ = 0;       // price at position 0
+    Price step_ = 1;         // price difference between positions: +tick for asks, -tick for bids
+    std::vector<std::int64_t> quantity_; // 1-based Fenwick trees
+    std::vector<std::int64_t> notional_;
+    std::int64_t total_ = 0;
+    std::int64_t unindexed_ = 0; // quantity at prices past the end of the window
+
+    std::int64_t Position(Price price) const { return (static_cast<std::int64_t>(price) - origin_) / step_; }
+
+    void Update(std::size_t position, std::int64_t quantity, std::int64_t notional)
+    {
+        for (std::size_t i = position + 1; i < quantity_.size(); i += i & (~i + 1))
+        {
+            quantity_[i] += quantity;
+            notional_[i] += notional;
+        }
+    }
+
+public:
+    Price PriceAt(std::size_t position) const { return origin_ + static_cast<Price>(position) * step_; }
+
+    // positions in the window; 0 until the first rebuild
+    std::size_t Width() const { return quantity_.empty() ? 0 : quantity_.size() - 1; }
+
+    bool Covers(Price price) const
+    {
+        const std::int64_t position = Position(price);
+        return position >= 0 && position < static_cast<std::int64_t>(Width());
+    }
+
+    // worse than every price the window covers
+    bool Beyond(Price price) const { return Width() != 0 && Position(price) >= static_cast<std::int64_t>(Width()); }
+
+    // a level past the end of the window gained or lost quantity
+    void AddUnindexed(std::int64_t delta) { unindexed_ += delta; }
+
+    std::uint64_t Unindexed() const { return static_cast<std::uint64_t>(unindexed_); }
+
+    // whether the index alone knows the quantity at or better than limit
+    bool Answers(Price limit) const { return Width() != 0 && (unindexed_ == 0 || !Beyond(limit)); }
+
+    // a level at price gained (delta > 0) or lost quantity; the price must be covered
+    void Add(Price price, std::int64_t delta)
+    {
+        Update(static_cast<std::size_t>(Position(price)), delta, delta * price);
+        total_ += delta;
+    }
+
+    // Start over on a new window with the given live levels, best first; those past its end are
+    // left unindexed. The new trees are built aside, so a failed allocation leaves the old ones.
+    void Rebuild(Price origin, Price step, std::size_t width, std::span<const std::pair<Price, std::uint64_t>> levels)
+    {
+        DepthIndex fresh;
+        fresh.origin_ = origin;
+        fresh.step_ = step;
+        fresh.quantity_.assign(width + 1, 0);
+        fresh.notional_.assign(width + 1, 0);
+        for (const auto &[price, quantity] : levels)
+        {
+            if (fresh.Covers(price))
+                fresh.Add(price, static_cast<std::int64_t>(quantity));
+            else
+                fresh.AddUnindexed(static_cast<std::int64_t>(quantity));
+        }
+        *this = std::move(fresh);
+    }
+
+    // quantity inside the window
+    std::uint64_t Total() const { return static_cast<std::uint64_t>(total_); }
+
+    // quantity at positions [0, position]
+    std::uint64_t QuantityThrough(Price price) const
+    {
+        std::int64_t position = Position(price);
+        if (position < 0)
+        {
+            return 0;
+        }
+        std::int64_t sum = 0;
+        for (std::size_t i = static_cast<std::size_t>(std::min<std::int64_t>(position + 1, Width())); i > 0; i -= i & (~i + 1))
+        {
+            sum += quantity_[i];
+        }
+        return static_cast<std::uint64_t>(sum);
+    }
+
+    // average price of the first quantity units, best first; the caller checks Total() >= quantity
+    double SweepAverage(std::uint64_t quantity) const
+    {
+        // binary lifting: find how many whole positions fit strictly below quantity
+        std::size_t position = 0;
+        std::int64_t remaining = static_cast<std::int64_t>(quantity);
+        std::int64_t notional = 0;
+        for (std::size_t step = std::bit_floor(Width()); step > 0; step >>= 1)
+        {
+            if (position + step <= Width() && quantity_[position + step] < remaining)
+            {
+                position += step;
+                remaining -= quantity_[position];
+                notional += notional_[position];
+            }
+        }
+        // the rest comes from the level at the next position
+        notional += remaining * static_cast<std::int64_t>(PriceAt(position));
+        return static_cast<double>(notional) / static_cast<double>(quantity);
+    }
+};
+
+// Allocator for big flat tables that are hit at random: anything of a huge page or more is
+// aligned to huge pages and, on Linux, advised to be backed by transparent huge pages before it
+// is first touched, so a table of millions of entries costs a few TLB entries instead of
+// thousands. Only advice: without THP it is ordinary memory. Smaller blocks come from new.
+template <typename T>
+struct HugePageAllocator
+{
+    using value_type = T;
+
+    static constexpr std::size_t HugePage = std::size_t{2} << 20;
+
+    HugePageAllocator() = default;
+    template <typename U>
+    HugePageAllocator(const HugePageAllocator<U> &) {}
+
+    T *allocate(std::size_t n)
+    {
+        const std::size_t bytes = n * sizeof(T);
+        if (bytes < HugePage)
+        {
+            return static_cast<T *>(::operator new(bytes));
+        }
+        const std::size_t rounded = (bytes + HugePage - 1) / HugePage * HugePage;
+        void *memory = std::aligned_alloc(HugePage, rounded);
+        if (memory == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+#ifdef __linux__
+        madvise(memory, rounded, MADV_HUGEPAGE);
+#endif
+        return static_cast<T *>(memory);
+    }
+
+    void deallocate(T *memory, std::size_t n)
+    {
+        if (n * sizeof(T) < HugePage)
+        {
+            ::operator delete(memory);
+        }
+        else
+        {
+            std::free(memory);
+        }
+    }
+
+    template <typename U>
+    bool operator==(const HugePageAllocator<U> &) const { return true; }
+};
+
+// Flat open-addressing map from OrderId to OrderHandle (robin-hood hashing).
+// Slots live in one array: a lookup is a hash and a short linear probe over 16-byte slots,
+// with no per-entry node allocation. Deletion shifts the following entries back instead of
+// leaving tombstones, so probe lengths don't degrade under add/cancel churn. Sized up front
+// from the book's capacity, it only rehashes if that capacity is exceeded.
+class OrderIndex
+{
+private:
+    struct Slot
+    {
+        OrderId key;
+        OrderHandle value;
+        std::uint32_t distance; // 1 + distance from the home slot, 0 when empty
+    };
+
+    std::vector<Slot, HugePageAllocator<Slot>> slots_;
+    std::size_t size_ = 0;
+    std::size_t mask_ = 0;
+    int shift_ = 0;
+
+    // Tuned for mostly sequential ids without trusting them to be: ids come in blocks of 256
+    // consecutive ids, and each block starts at a Fibonacci hash of the block number (the top
+    // bits of it times 2^64 / golden ratio), which spreads consecutive blocks evenly over the
+    // whole table. Within a block the ids go every other slot, so consecutive ids stay on
+    // neighbouring cache lines that the prefetcher follows, and the gaps take the entries of
+    // overlapping blocks without long probes. Ids that wrap past the table size while old
+    // orders still rest land between other blocks' entries, not at the end of one long run.
+    std::size_t Home(OrderId key) const
+    {
+        return static_cast<std::size_t>((((key >> 8) * 0x9E3779B97F4A7C15ull) >> shift_) + (key & 255) * 2) & mask_;
+    }
+
+    void Rehash(std::size_t slotCount)
+    {
+        std::vector<Slot, HugePageAllocator<Slot>> old = std::move(slots_);
+        slots_.assign(slotCount, Slot{0, NullHandle, 0});
+        mask_ = slotCount - 1;
+        shift_ = 64 - std::countr_zero(slotCount);
+        size_ = 0;
+        for (const Slot &slot : old)
+        {
+            if (slot.distance != 0)
+            {
+                insert(slot.key, slot.value);
+            }
+        }
+    }
+
+public:
+    explicit OrderIndex(std::size_t capacity = 0)
+    {
+        Rehash(16);
+        reserve(capacity);
+    }
+
+    // make room for count entries without rehashing (load factor stays at most 3/4)
+    void reserve(std::size_t count)
+    {
+        std::size_t slotCount = slots_.size();
+        while (count * 4 > slotCount * 3)
+        {
+            slotCount *= 2;
+        }
+        if (slotCount != slots_.size())
+        {
+            Rehash(slotCount);
+        }
+    }
+
+    std::size_t size() const { return size_; }
+    bool contains(OrderId key) const { return find(key) != nullptr; }
+
+    const OrderHandle *find(OrderId key) const
+    {
+        std::size_t pos = Home(key);
+        for (std::uint32_t distance = 1;; ++distance, pos = (pos + 1) & mask_)
+        {
+            const Slot &slot = slots_[pos];
+            // robin-hood invariant: once we pass a slot closer to its home than we'd be, the key is absent
+            if (slot.distance < distance)
+            {
+                return nullptr;
+            }
+            if (slot.key == key)
+            {
+                return &slot.value;
+            }
+        }
+    }
+
+    OrderHandle *find(OrderId key)
+    {
+        return const_cast<OrderHandle *>(std::as_const(*this).find(key));
+    }
+
+    // the caller guarantees the key is not present yet
+    void insert(OrderId key, OrderHandle value)
+    {
+        if ((size_ + 1) * 4 > slots_.size() * 3)
+        {
+            Rehash(slots_.size() * 2);
+        }
+        Slot incoming{key, value, 1};
+        for (std::size_t pos = Home(key);; pos = (pos + 1) & mask_, ++incoming.distance)
+        {
+            Slot &slot = slots_[pos];
+            if (slot.distance == 0)
+            {
+                slot = incoming;
+                ++size_;
+                return;
+            }
+            // steal from the rich: whoever is closer to home moves on
+            if (slot.distance < incoming.distance)
+            {
+                std::swap(slot, incoming);
+            }
+        }
+    }
+
+    bool erase(OrderId key)
+    {
+        std::size_t pos = Home(key);
+        for (std::uint32_t distance = 1;; ++distance, pos = (pos + 1) & mask_)
+        {
+            if (slots_[pos].distance < distance)
+            {
+                return false;
+            }
+            if (slots_[pos].key == key)
+            {
+                break;
+            }
+        }
+        // backward shift: pull the following displaced entries one slot closer to home
+        for (std::size_t next = (pos + 1) & mask_; slots_[next].distance > 1; pos = next, next = (next + 1) & mask_)
+        {
+            slots_[pos] = slots_[next];
+            --slots_[pos].distance;
+        }
+        slots_[pos] = Slot{0, NullHandle, 0};
+        --size_;
+        return true;
+    }
+};
+
+// Shares incoming out over resting quantities in proportion, rounded down, and hands the few lots
+// lost to rounding out one at a time in queue order. incoming must be less than the sum of resting.
+inline void AllocateProRata(std::span<const Quantity> resting, Quantity incoming, std::span<Quantity> fills)
+{
+    std::uint64_t total = 0;
+    for (const Quantity quantity : resting)
+    {
+        total += quantity;
+    }
+    // exact floor of each share in one branch-free pass: resting * incoming fits in 64 bits, so
+    // no order is ever shorted by a rounded ratio
+    std::uint64_t allocated = 0;
+    for (std::size_t i = 0; i < resting.size(); ++i)
+    {
+        fills[i] = static_cast<Quantity>(std::uint64_t{resting[i]} * incoming / total);
+        allocated += fills[i];
+    }
+    for (std::size_t i = 0; allocated < incoming; i = (i + 1) % resting.size())
+    {
+        if (fills[i] < resting[i])
+        {
+            ++fills[i];
+            ++allocated;
+        }
+    }
+}
+
+// Allocation policies: how an incoming order that can't take a whole level shares its quantity
+// out among the level's resting orders. Fifo policies keep the price-time loop in MatchOrders;
+// the others get the level's displayed quantities in queue order and write each order's fill.
+
+// strict price-time: the oldest order fills first
+struct FifoAllocation
+{
+    static constexpr bool Fifo = true;
+};
+
+// every order gets a share proportional to its quantity
+struct ProRataAllocation
+{
+    static constexpr bool Fifo = false;
+
+    static void Allocate(std::span<const Quantity> resting, Quantity incoming, std::span<Quantity> fills)
+    {
+        AllocateProRata(resting, incoming, fills);
+    }
+};
+
+// the order at the front of the queue fills first, the rest is shared pro-rata
+struct TopPriorityProRataAllocation
+{
+    static constexpr bool Fifo = false;
+
+    static void Allocate(std::span<const Quantity> resting, Quantity incoming, std::span<Quantity> fills)
+    {
+        fills[0] = std::min(resting[0], incoming);
+        if (incoming > fills[0])
+        {
+            AllocateProRata(resting.subspan(1), incoming - fills[0], fills.subspan(1));
+        }
+        else
+        {
+            std::fill(fills.begin() + 1, fills.end(), Quantity{0});
+        }
+    }
+};
+
+// LevelContainer picks how each side stores its price levels, see MapLevels, LadderLevels and
+// VectorLevels; Allocation how a level's orders share a fill, see FifoAllocation
+template <template <Side> class LevelContainer = MapLevels, typename Allocation = FifoAllocation>
+class Orderbook
+{
+    OrderPool pool_;
+    LevelContainer<Side::Buy> bids_;
+    LevelContainer<Side::Sell> asks_;
+    // the handle is all we need: the order's own links unlink it from its level
+    OrderIndex orders_hashmap;
+    // With containers whose levels stay put (StableLevels): the level each resting order is
+    // queued in, by pool slot, so a cancel reaches the level's totals without a price lookup.
+    static constexpr bool StableLevels = LevelContainer<Side::Buy>::StableLevels;
+    std::vector<OrderQueue *> levelOf_;
+    // when set, ids are issued by the pool as slot ids and orders_hashmap stays empty
+    bool engineIds_;
+    Price tickSize_;
+    std::size_t depthWindow_;
+    std::size_t depthWindowLimit_;
+    bool depthIndex_;
+    DepthIndex bidDepth_;
+    DepthIndex askDepth_;
+    bool queuePositions_;
+    QueuePositions positions_;
+
+    // iceberg reserve of the order in each pool slot, valid while the order's iceberg flag is set
+    struct Reserve
+    {
+        Quantity peak;   // clip size shown at a time
+        Quantity hidden; // not shown yet
+    };
+    std::vector<Reserve> reserves_;
+    std::uint64_t hidden_[2] = {0, 0}; // total reserve per side, indexed by Side
+
+    // Pending stop orders live in the pool and the id index like resting ones (so ids stay unique
+    // and cancel finds them the same way), but sit in a trigger index keyed by stop price instead
+    // of a level. Buy stops fire when the last trade is at or above their stop price, sell stops
+    // at or below, so each index is ordered by which stop fires first.
+    struct Trigger
+    {
+        Price stopPrice;
+        OrderType type; // what the order becomes when it fires
+    };
+    std::vector<Trigger> triggers_; // by pool slot, valid while the order's stop flag is set
+    std::multimap<Price, OrderHandle, std::less<>> buyStops_;
+    std::multimap<Price, OrderHandle, std::greater<>> sellStops_;
+    std::size_t pendingStops_ = 0;
+    std::vector<OrderHandle> fired_; // reused by Sweep
+    std::optional<Price> lastTrade_;
+
+    // a level's orders in queue order, reused by MatchProRata
+    std::vector<OrderHandle> allocHandles_;
+    std::vector<Quantity> allocResting_;
+    std::vector<Quantity> allocFills_;
+
+    // Timers, see Schedule: resting good-till-date orders in a binary min-heap by expiry, day
+    // orders in a plain list, and by pool slot where each order's entry is. Reserved for every
+    // slot of the pool, so adding an entry never allocates.
+    struct Timer
+    {
+        Timestamp expiry;
+        OrderHandle handle;
+    };
+    static constexpr std::uint32_t NoTimer = UINT32_MAX;
+    static constexpr std::uint32_t DayTimer = 1u << 31; // set in timerAt_ for entries of dayOrders_
+    std::vector<Timer> expiries_;
+    std::vector<OrderHandle> dayOrders_;
+    std::vector<std::uint32_t> timerAt_;
+
+    // Every order with an owner is on its owner's doubly linked list, threaded through the pool
+    // slots, so CancelOwner walks exactly the orders of that owner.
+    struct OwnerLink
+    {
+        OwnerId owner;
+        OrderHandle prev;
+        OrderHandle next;
+    };
+    std::vector<OwnerLink> owners_; // by pool slot, valid while the order's owned flag is set
+    OrderIndex ownerHeads_;         // owner -> its newest order
+    std::vector<Price> dropPrices_; // reused by DropRange
+
+    bool auction_ = false; // collecting orders for Uncross instead of matching them
+
+    // With publishTop: the top levels for readers on other threads, and the writer's own copy of
+    // the last publication. On the heap, so the book can move while readers hold on to it.
+    std::unique_ptr<Seqlock<TopOfBook>> topFeed_;
+    TopOfBook top_;
+    // by Side: the levels [from, to) of top_ changed since the last publication, and whether the
+    // side lost a level from a full top and needs the one behind it
+    std::uint32_t topFrom_[2] = {TopLevels, TopLevels};
+    std::uint32_t topTo_[2] = {0, 0};
+    bool topStale_[2] = {false, false};
+
+    void TouchTop(int index, std::uint32_t from, std::uint32_t to)
+    {
+        topFrom_[index] = std::min(topFrom_[index], from);
+        topTo_[index] = std::max(topTo_[index], to);
+    }
+
+    // Every level change goes through TrackDepth, which calls this once the level has changed,
+    // and the writer's copy is patched in place: a level of the top is rewritten, one that
+    // appeared inside the top is slotted in (pushing the last one out), one that emptied is
+    // taken out. Changes behind a full top are ignored. Only when a full top loses a level does
+    // the side have to be walked again, at publication, for the level that moves up into it.
+    void MarkTop(Side side, Price price, const OrderQueue &level)
+    {
+        const int index = static_cast<int>(side);
+        if (topStale_[index])
+        {
+            return;
+        }
+        const bool buy = side == Side::Buy;
+        std::array<LevelInfo, TopLevels> &top = buy ? top_.bids : top_.asks;
+        std::uint32_t &count = buy ? top_.bidLevels : top_.askLevels;
+        std::uint32_t i = 0; // first published level at or behind price
+        while (i < count && (buy ? top[i].price > price : top[i].price < price))
+        {
+            ++i;
+        }
+        if (i < count && top[i].price == price)
+        {
+            if (!level.empty())
+            {
+                top[i].quantity = level.quantity();
+                top[i].orders = level.count();
+                TouchTop(index, i, i + 1);
+            }
+            else if (count == TopLevels)
+            {
+                topStale_[index] = true;
+                TouchTop(index, 0, TopLevels);
+            }
+            else
+            {
+                std::copy(top.begin() + i + 1, top.begin() + count, top.begin() + i);
+                TouchTop(index, i, count--);
+            }
+        }
+        else if (!level.empty() && i < TopLevels)
+        {
+            const std::uint32_t kept = std::min<std::uint32_t>(count, TopLevels - 1);
+            std::copy_backward(top.begin() + i, top.begin() + kept, top.begin() + kept + 1);
+            top[i] = LevelInfo{price, level.quantity(), level.count()};
+            count = kept + 1;
+            TouchTop(index, i, count);
+        }
+    }
+
+    // Publishes the top levels if they changed since the last publication, so a call that changed
+    // nothing there (a deep order, a duplicate, a cancel of an unknown id) costs readers nothing,
+    // not even a cache miss. Only the counts and the levels that changed are rewritten.
+    void PublishTop()
+    {
+        constexpr int Bid = static_cast<int>(Side::Buy);
+        constexpr int Ask = static_cast<int>(Side::Sell);
+        if (topFrom_[Bid] >= topTo_[Bid] && topFrom_[Ask] >= topTo_[Ask])
+        {
+            return;
+        }
+        if (topStale_[Bid])
+        {
+            top_.bidLevels = static_cast<std::uint32_t>(DepthOf(bids_, top_.bids));
+        }
+        if (topStale_[Ask])
+        {
+            top_.askLevels = static_cast<std::uint32_t>(DepthOf(asks_, top_.asks));
+        }
+        ++top_.version;
+        constexpr std::size_t bids = offsetof(TopOfBook, bids);
+        constexpr std::size_t asks = offsetof(TopOfBook, asks);
+        constexpr std::size_t level = sizeof(LevelInfo);
+        topFeed_->Store(top_, {{0, bids},
+                               {bids + topFrom_[Bid] * level, bids + topTo_[Bid] * level},
+                               {asks + topFrom_[Ask] * level, asks + topTo_[Ask] * level}});
+        topFrom_[Bid] = topFrom_[Ask] = TopLevels;
+        topTo_[Bid] = topTo_[Ask] = 0;
+        topStale_[Bid] = topStale_[Ask] = false;
+    }
+
+    // Publishes the top when the call it sits in returns, or throws half way through. It sits in
+    // every entry point that can change levels, and those never call one another.
+    struct PublishTopOnExit
+    {
+        Orderbook &book;
+        ~PublishTopOnExit() { book.PublishTop(); }
+    };
+    std::vector<std::pair<Price, std::uint64_t>> auctionBids_; // reused by Equilibrium
+    std::vector<std::pair<Price, std::uint64_t>> auctionAsks_;
+
+    template <Side S>
+    auto &Levels()
+    {
+        if constexpr (S == Side::Buy)
+            return bids_;
+        else
+            return asks_;
+    }
+
+    template <Side S>
+    const auto &Levels() const
+    {
+        if constexpr (S == Side::Buy)
+            return bids_;
+        else
+            return asks_;
+    }
+
+    // limit price of a market order: crosses every resting price
+    template <Side S>
+    static constexpr Price MarketPrice = S == Side::Buy ? std::numeric_limits<Price>::max()
+                                                        : std::numeric_limits<Price>::min();
+
+    // can an order on side S at limit price fill quantity right now?
+    // Iceberg reserves count: they replenish at the same level while the order is still matching.
+    template <Side S>
+    bool CanFill(Price price, Quantity quantity) const
+    {
+        if (depthIndex_ && (hidden_[static_cast<int>(Opposite(S))] == 0 ||
+                            QuantityAtOrBetter(Opposite(S), price) >= quantity))
+        {
+            return QuantityAtOrBetter(Opposite(S), price) >= quantity;
+        }
+        std::uint64_t available = 0;
+        Levels<Opposite(S)>().ForEach([&available, price, quantity](Price resting, const OrderQueue &level)
+                                      {
+            if (!Crosses<S>(price, resting))
+                return false;
+            available += level.quantity() + level.hidden();
+            return available < quantity; });
+        return available >= quantity;
+    }
+
+    // Match an incoming order according to its type and time in force. Returns the quantity that
+    // should rest: what's left of a limit order that can rest, zero for everything else.
+    // A fill-or-kill order that can't fill completely is rejected before it touches the book.
+    // The caller has checked a limit price against the tick size.
+    template <Side S, TradeSink Sink>
+    Quantity Execute(OrderId id, Price price, Quantity quantity, TimeInForce tif, OrderType type, Sink &sink)
+    {
+        if (auction_)
+        {
+            CheckAuction(tif, type);
+            return quantity;
+        }
+        if (type == OrderType::Market)
+        {
+            price = MarketPrice<S>;
+        }
+        if (tif == TimeInForce::FillOrKill && !CanFill<S>(price, quantity))
+        {
+            return 0;
+        }
+        const Quantity remaining = MatchOrders<S>(id, price, quantity, sink);
+        return Rests(tif) && type == OrderType::Limit ? remaining : 0;
+    }
+
+    static constexpr bool Rests(TimeInForce tif)
+    {
+        return tif != TimeInForce::ImmediateOrCancel && tif != TimeInForce::FillOrKill;
+    }
+
+    // nothing matches until Uncross, so only orders that can wait are accepted
+    void CheckAuction(TimeInForce tif, OrderType type) const
+    {
+        if (auction_ && (type == OrderType::Market || !Rests(tif)))
+        {
+            throw std::logic_error("only limit orders that can rest are accepted during an auction");
+        }
+    }
+
+    // Checked: the caller has done the tick, expiry and duplicate checks, see AddValidated
+    template <bool Checked = false, TradeSink Sink>
+    bool Submit(const OrderRequest &request, Sink &sink)
+    {
+        const PublishTopOnExit publish{*this};
+        RequireEngineIds(false);
+        if constexpr (!Checked)
+        {
+            if (request.type == OrderType::Limit)
+            {
+                CheckTick(request.price);
+            }
+            CheckExpiry(request.timeInForce, request.expiry);
+            if (orders_hashmap.contains(request.id))
+            {
+                return false;
+            }
+        }
+        if (request.type == OrderType::Limit && Rests(request.timeInForce))
+        {
+            CheckWindow(request.side, request.price);
+        }
+
+        const Quantity remaining =
+            request.side == Side::Buy
+                ? Execute<Side::Buy>(request.id, request.price, request.quantity, request.timeInForce, request.type, sink)
+                : Execute<Side::Sell>(request.id, request.price, request.quantity, request.timeInForce, request.type, sink);
+        if (remaining > 0)
+        {
+            Place(request.side == Side::Buy ? bids_[request.price] : asks_[request.price], request, remaining);
+        }
+        if (pendingStops_ != 0)
+        {
+            FireStops(sink);
+        }
+        return true;
+    }
+
+    // ModifyOrder; Checked: the caller has checked newPrice against the tick, see ModifyValidated
+    template <bool Checked, TradeSink Sink>
+    bool Modify(OrderId id, Price newPrice, Quantity newQuantity, Sink &sink)
+    {
+        const PublishTopOnExit publish{*this};
+        const OrderHandle handle = FindHandle(id);
+        if (handle == NullHandle)
+        {
+            return false;
+        }
+        Order &order = pool_[handle];
+        if (newQuantity == 0)
+        {
+            RemoveOrder(handle); // a cancel: newPrice is never used
+            return true;
+        }
+        if constexpr (!Checked)
+        {
+            CheckTick(newPrice);
+        }
+        if (order.isStop())
+        {
+            return false;
+        }
+        if (newPrice != order.getPrice())
+        {
+            CheckWindow(order.getSide(), newPrice);
+        }
+        const Quantity total = TotalQuantity(handle);
+        if (newPrice == order.getPrice() && newQuantity <= total)
+        {
+            OrderQueue &level = LevelOf(handle);
+            if (order.isIceberg())
+            {
+                // the reserve goes first, the displayed clip only once it is gone
+                Reserve &reserve = reserves_[handle];
+                const Quantity cut = std::min(reserve.hidden, total - newQuantity);
+                reserve.hidden -= cut;
+                level.AddHidden(-static_cast<std::int64_t>(cut));
+                hidden_[static_cast<int>(order.getSide())] -= cut;
+                if (order.getQuantity() <= newQuantity)
+                {
+                    return true;
+                }
+            }
+            level.Deduct(order.getQuantity() - newQuantity);
+            TrackDepth(order.getSide(), newPrice, level, -static_cast<std::int64_t>(order.getQuantity() - newQuantity));
+            if (queuePositions_)
+                positions_.Add(level, order, -static_cast<std::int64_t>(order.getQuantity() - newQuantity));
+            order.ReduceTo(newQuantity);
+            return true;
+        }
+        const Side side = order.getSide();
+        const Quantity display = order.isIceberg() ? reserves_[handle].peak : 0; // an iceberg stays one
+        Unlink(handle);
+        const Quantity remaining = auction_            ? newQuantity
+                                   : side == Side::Buy ? MatchOrders<Side::Buy>(id, newPrice, newQuantity, sink)
+                                                       : MatchOrders<Side::Sell>(id, newPrice, newQuantity, sink);
+        if (remaining == 0)
+        {
+            Unindex(id);
+            Free(handle);
+        }
+        else
+        {
+            order.Replace(newPrice, remaining);
+            Show(side == Side::Buy ? bids_[newPrice] : asks_[newPrice], handle, remaining, display);
+        }
+        if (pendingStops_ != 0)
+        {
+            FireStops(sink);
+        }
+        return true;
+    }
+
+    static void CheckExpiry(TimeInForce tif, Timestamp expiry)
+    {
+        if (tif == TimeInForce::GoodTillDate && expiry == 0)
+        {
+            throw std::invalid_argument("good-till-date orders need an expiry");
+        }
+    }
+
+    // Timers: a resting good-till-date order goes on the expiry heap, a day order (or one that
+    // expires at SessionEnd) on the day list. Its slot keeps the entry's position, so a cancel or
+    // fill takes the entry straight out, see Unschedule, and nothing stale is left behind.
+    void Schedule(OrderHandle handle, TimeInForce tif, Timestamp expiry)
+    {
+        if (tif != TimeInForce::GoodTillDate && tif != TimeInForce::Day)
+        {
+            return;
+        }
+        if (timerAt_.size() <= handle)
+        {
+            timerAt_.resize(pool_.Capacity(), NoTimer);
+            expiries_.reserve(pool_.Capacity());
+            dayOrders_.reserve(pool_.Capacity());
+        }
+        if (tif == TimeInForce::Day || expiry == SessionEnd)
+        {
+            timerAt_[handle] = static_cast<std::uint32_t>(dayOrders_.size()) | DayTimer;
+            dayOrders_.push_back(handle);
+        }
+        else
+        {
+            expiries_.push_back(Timer{expiry, handle});
+            SiftUp(expiries_.size() - 1);
+        }
+    }
+
+    // take an order that is leaving the book off its timer: O(log n) from the heap, O(1) from
+    // the day list, where the last entry moves into the hole
+    void Unschedule(OrderHandle handle)
+    {
+        const std::uint32_t at = timerAt_[handle];
+        timerAt_[handle] = NoTimer;
+        if (at & DayTimer)
+        {
+            const OrderHandle last = dayOrders_.back();
+            dayOrders_.pop_back();
+            if (last != handle)
+            {
+                dayOrders_[at & ~DayTimer] = last;
+                timerAt_[last] = at;
+            }
+            return;
+        }
+        const Timer last = expiries_.back();
+        expiries_.pop_back();
+        if (at == expiries_.size())
+        {
+            return;
+        }
+        expiries_[at] = last;
+        timerAt_[last.handle] = at;
+        if (at > 0 && last.expiry < expiries_[(at - 1) / 2].expiry)
+            SiftUp(at);
+        else
+            SiftDown(at);
+    }
+
+    // restore the heap around the entry at i, keeping timerAt_ in step
+    void SiftUp(std::size_t i)
+    {
+        const Timer timer = expiries_[i];
+        for (; i > 0 && timer.expiry < expiries_[(i - 1) / 2].expiry; i = (i - 1) / 2)
+        {
+            expiries_[i] = expiries_[(i - 1) / 2];
+            timerAt_[expiries_[i].handle] = static_cast<std::uint32_t>(i);
+        }
+        expiries_[i] = timer;
+        timerAt_[timer.handle] = static_cast<std::uint32_t>(i);
+    }
+
+    void SiftDown(std::size_t i)
+    {
+        const Timer timer = expiries_[i];
+        for (;;)
+        {
+            std::size_t child = 2 * i + 1;
+            if (child >= expiries_.size())
+            {
+                break;
+            }
+            if (child + 1 < expiries_.size() && expiries_[child + 1].expiry < expiries_[child].expiry)
+            {
+                ++child;
+            }
+            if (!(expiries_[child].expiry < timer.expiry))
+            {
+                break;
+            }
+            expiries_[i] = expiries_[child];
+            timerAt_[expiries_[i].handle] = static_cast<std::uint32_t>(i);
+            i = child;
+        }
+        expiries_[i] = timer;
+        timerAt_[timer.handle] = static_cast<std::uint32_t>(i);
+    }
+
+    // evict a timed order; removing it takes it off its timer too
+    template <typename Expired>
+    void Expire(OrderHandle handle, Expired &expired)
+    {
+        const OrderId id = pool_[handle].getId();
+        RemoveOrder(handle);
+        expired(id);
+    }
+
+    // The price that executes the most volume between the (crossed) sides: one merged pass over
+    // the levels in ascending price, keeping cumulative bid depth at or above and ask depth at or
+    // below each price. Ties go to the smaller imbalance, then to the price nearest the last trade,
+    // then to the lower price. Reserves count, they refill at their level while it trades.
+    std::optional<AuctionResult> Equilibrium()
+    {
+        if (bids_.empty() || asks_.empty() || bids_.BestPrice() < asks_.BestPrice())
+        {
+            return std::nullopt;
+        }
+        auctionBids_.clear();
+        auctionAsks_.clear();
+        std::uint64_t bidTotal = 0;
+        bids_.ForEach([this, &bidTotal](Price price, const OrderQueue &level)
+                      {
+            auctionBids_.emplace_back(price, level.quantity() + level.hidden());
+            bidTotal += auctionBids_.back().second;
+            return true; });
+        asks_.ForEach([this](Price price, const OrderQueue &level)
+                      {
+            auctionAsks_.emplace_back(price, level.quantity() + level.hidden());
+            return true; });
+
+        std::optional<AuctionResult> best;
+        std::uint64_t bestImbalance = 0;
+        std::uint64_t bidBelow = 0; // bids priced under the current price
+        std::uint64_t askAtOrBelow = 0;
+        auto bid = auctionBids_.rbegin(); // ascending
+        auto ask = auctionAsks_.begin();
+        while (bid != auctionBids_.rend() || ask != auctionAsks_.end())
+        {
+            const Price price = bid == auctionBids_.rend() ? ask->first
+                                : ask == auctionAsks_.end() ? bid->first
+                                                            : std::min(bid->first, ask->first);
+            if (ask != auctionAsks_.end() && ask->first == price)
+            {
+                askAtOrBelow += (ask++)->second;
+            }
+            const std::uint64_t demand = bidTotal - bidBelow;
+            const std::uint64_t volume = std::min(demand, askAtOrBelow);
+            const std::uint64_t imbalance = std::max(demand, askAtOrBelow) - volume;
+            if (volume > 0 && (!best || volume > best->volume ||
+                               (volume == best->volume &&
+                                (imbalance < bestImbalance ||
+                                 (imbalance == bestImbalance && lastTrade_ &&
+                                  std::abs(static_cast<std::int64_t>(price) - *lastTrade_) <
+                                      std::abs(static_cast<std::int64_t>(best->price) - *lastTrade_))))))
+            {
+                best = AuctionResult{price, volume};
+                bestImbalance = imbalance;
+            }
+            if (bid != auctionBids_.rend() && bid->first == price)
+            {
+                bidBelow += (bid++)->second;
+            }
+        }
+        return best;
+    }
+
+    // Feed every stop the last trade price has reached back into matching. A fired stop's own
+    // fills move the last price and may reach more, so sweep until nothing fires.
+    // Returns whether anything fired. Nothing fires during an auction, not even a stop the last
+    // trade had reached before it: a fired stop has to match, and only orders that rest are
+    // accepted until Uncross, which fires whatever is due once continuous matching resumes.
+    template <TradeSink Sink>
+    bool FireStops(Sink &sink)
+    {
+        if (auction_)
+        {
+            return false;
+        }
+        bool fired = false;
+        while (Sweep(buyStops_, sink) || Sweep(sellStops_, sink))
+        {
+            fired = true;
+        }
+        return fired;
+    }
+
+    // Take all the stops of one side that the last trade reached out of the index in one ordered
+    // range (first to fire first, arrival order within a stop price), then activate them.
+    template <typename Stops, TradeSink Sink>
+    bool Sweep(Stops &stops, Sink &sink)
+    {
+        if (!lastTrade_)
+        {
+            return false;
+        }
+        const auto end = stops.upper_bound(*lastTrade_);
+        if (end == stops.begin())
+        {
+            return false;
+        }
+        fired_.clear();
+        for (auto it = stops.begin(); it != end; ++it)
+        {
+            fired_.push_back(it->second);
+        }
+        stops.erase(stops.begin(), end);
+        for (const OrderHandle handle : fired_) // Activate doesn't sweep, so fired_ stays put
+        {
+            Activate(handle, sink);
+        }
+        return true;
+    }
+
+    // a stop fired: it becomes a market or limit order and goes through matching like a new one
+    template <TradeSink Sink>
+    void Activate(OrderHandle handle, Sink &sink)
+    {
+        Order &order = pool_[handle];
+        order.setStop(false);
+        --pendingStops_;
+        const Trigger trigger = triggers_[handle];
+        const Side side = order.getSide();
+        const Price price = order.getPrice();
+        const Quantity remaining =
+            side == Side::Buy
+                ? Execute<Side::Buy>(order.getId(), price, order.getQuantity(), TimeInForce::GoodTillCancel, trigger.type, sink)
+                : Execute<Side::Sell>(order.getId(), price, order.getQuantity(), TimeInForce::GoodTillCancel, trigger.type, sink);
+        if (remaining == 0 || !(side == Side::Buy ? bids_.Fits(price) : asks_.Fits(price)))
+        {
+            // nobody is there to take a throw: a remainder too far from the book is dropped
+            Unindex(order.getId());
+            Free(handle);
+        }
+        else
+        {
+            Show(side == Side::Buy ? bids_[price] : asks_[price], handle, remaining, 0);
+        }
+    }
+
+    // take a pending stop out of the trigger index
+    void Disarm(OrderHandle handle)
+    {
+        Order &order = pool_[handle];
+        const Price stopPrice = triggers_[handle].stopPrice;
+        auto erase = [handle, stopPrice](auto &stops)
+        {
+            auto [it, end] = stops.equal_range(stopPrice);
+            while (it->second != handle)
+                ++it;
+            stops.erase(it);
+        };
+        if (order.getSide() == Side::Buy)
+            erase(buyStops_);
+        else
+            erase(sellStops_);
+        order.setStop(false);
+        --pendingStops_;
+    }
+
+    template <TradeSink Sink>
+    bool Arm(OrderId id, Side side, Price stopPrice, Price limitPrice, Quantity quantity, OrderType type, Sink &sink)
+    {
+        RequireEngineIds(false);
+        CheckTick(stopPrice);
+        if (orders_hashmap.contains(id))
+        {
+            return false;
+        }
+        if (!auction_ && lastTrade_ && (side == Side::Buy ? stopPrice <= *lastTrade_ : stopPrice >= *lastTrade_))
+        {
+            // already reached: goes straight in
+            return Submit({.id = id, .side = side, .price = limitPrice, .quantity = quantity, .type = type}, sink);
+        }
+        if (type == OrderType::Limit)
+        {
+            CheckTick(limitPrice);
+            CheckWindow(side, limitPrice); // checked again when it fires, see Activate
+        }
+        const OrderHandle handle = pool_.Allocate(id, side, limitPrice, quantity);
+        if (triggers_.size() <= handle)
+        {
+            triggers_.resize(pool_.Capacity());
+        }
+        triggers_[handle] = Trigger{stopPrice, type};
+        pool_[handle].setStop(true);
+        if (side == Side::Buy)
+            buyStops_.emplace(stopPrice, handle);
+        else
+            sellStops_.emplace(stopPrice, handle);
+        ++pendingStops_;
+        orders_hashmap.insert(id, handle);
+        return true;
+    }
+
+    static constexpr Side Opposite(Side side) { return side == Side::Buy ? Side::Sell : Side::Buy; }
+
+    // true when an incoming order on side S at limit price can trade with a resting order at resting
+    template <Side S>
+    static bool Crosses(Price price, Price resting)
+    {
+        if constexpr (S == Side::Buy)
+            return resting <= price;
+        else
+            return resting >= price;
+    }
+
+    // One fill of match_qty against the resting order at handle in level, reported to sink.
+    template <Side S, TradeSink Sink>
+    void FillResting(OrderQueue &level, OrderHandle handle, Quantity match_qty, OrderId id, Price price, Sink &sink)
+    {
+        const Order &resting = pool_[handle];
+        lastTrade_ = resting.getPrice();
+
+        // a market order has no price of its own, it trades at the resting price
+        TradeSide incomingSide{id, price == MarketPrice<S> ? resting.getPrice() : price, match_qty};
+        TradeSide restingSide{resting.getId(), resting.getPrice(), match_qty};
+        if constexpr (S == Side::Buy)
+            sink(Trade{incomingSide, restingSide});
+        else
+            sink(Trade{restingSide, incomingSide});
+
+        Consume(level, handle, match_qty);
+    }
+
+    // Take a traded quantity off the resting order at handle and keep every aggregate in step.
+    // A filled order leaves the level, unless it is an iceberg with reserve left.
+    void Consume(OrderQueue &level, OrderHandle handle, Quantity match_qty)
+    {
+        Order &resting = pool_[handle];
+        const Side side = resting.getSide();
+        const Price price = resting.getPrice();
+        resting.Fill(match_qty);
+        level.Deduct(match_qty);
+        if (queuePositions_)
+            positions_.Add(level, resting, -static_cast<std::int64_t>(match_qty));
+
+        if (resting.isFilled())
+        {
+            if (resting.isIceberg() && reserves_[handle].hidden > 0)
+            {
+                Replenish(level, handle); // same level, back of the queue
+            }
+            else
+            {
+                level.erase(pool_, handle);
+                Unindex(resting.getId());
+                Free(handle); // slot goes back to the freelist
+            }
+        }
+        TrackDepth(side, price, level, -static_cast<std::int64_t>(match_qty));
+    }
+
+    // Share quantity, which is less than the level's, out over the level with the allocation
+    // policy: snapshot the queue into contiguous buffers, allocate in one pass, then fill in
+    // queue order. Every lot of quantity is used.
+    template <Side S, TradeSink Sink>
+    void MatchProRata(OrderQueue &level, OrderId id, Price price, Quantity quantity, Sink &sink)
+    {
+        allocHandles_.clear();
+        allocResting_.clear();
+        for (OrderHandle handle = level.front(); handle != NullHandle; handle = pool_[handle].getNext())
+        {
+            allocHandles_.push_back(handle);
+            allocResting_.push_back(pool_[handle].getQuantity());
+        }
+        allocFills_.resize(allocResting_.size());
+        Allocation::Allocate(allocResting_, quantity, allocFills_);
+        for (std::size_t i = 0; i < allocHandles_.size(); ++i)
+        {
+            if (allocFills_[i] > 0)
+            {
+                FillResting<S>(level, allocHandles_[i], allocFills_[i], id, price, sink);
+            }
+        }
+    }
+
+    // Match an incoming order on side S against the opposite side, best level first, sharing each
+    // level by the allocation policy, handing every fill to sink. The incoming order is not in the
+    // book yet: returns the quantity left to rest.
+    template <Side S, TradeSink Sink>
+    Quantity MatchOrders(OrderId id, Price price, Quantity quantity, Sink &sink)
+    {
+        auto &opposite = Levels<Opposite(S)>();
+
+        while (quantity > 0 && !opposite.empty() && Crosses<S>(price, opposite.BestPrice()))
+        {
+            OrderQueue &level = opposite.Best();
+
+            while (quantity > 0 && !level.empty())
+            {
+                if constexpr (!Allocation::Fifo)
+                {
+                    // an order taking the whole level fills everyone, FIFO is as good as any
+                    if (quantity < level.quantity())
+                    {
+                        MatchProRata<S>(level, id, price, quantity, sink);
+                        quantity = 0;
+                        break;
+                    }
+                }
+                const OrderHandle oldest = level.front();
+                const Quantity match_qty = std::min(quantity, pool_[oldest].getQuantity());
+                FillResting<S>(level, oldest, match_qty, id, price, sink);
+                quantity -= match_qty;
+            }
+            if (level.empty())
+            {
+                if (queuePositions_)
+                    positions_.Release(level);
+                opposite.PopBest(); // level invalid now
+            }
+        }
+
+        return quantity;
+    }
+
+    // id -> handle: a slot id is resolved by the pool directly, a client id goes through the index
+    OrderHandle FindHandle(OrderId id) const
+    {
+        if (engineIds_)
+        {
+            return pool_.ResolveSlotId(id);
+        }
+        const OrderHandle *handle = orders_hashmap.find(id);
+        return handle == nullptr ? NullHandle : *handle;
+    }
+
+    void Unindex(OrderId id)
+    {
+        if (!engineIds_)
+        {
+            orders_hashmap.erase(id);
+        }
+    }
+
+    void RequireEngineIds(bool expected) const
+    {
+        if (engineIds_ != expected)
+        {
+            throw std::logic_error(engineIds_ ? "this book issues its own order ids" : "this book takes client order ids");
+        }
+    }
+
+    // every change of a level's quantity or order count comes through here, after the level
+    // itself changed and before it is released
+    void TrackDepth(Side side, Price price, const OrderQueue &level, std::int64_t delta)
+    {
+        if (topFeed_)
+        {
+            MarkTop(side, price, level);
+        }
+        if (!depthIndex_)
+        {
+            return;
+        }
+        DepthIndex &index = side == Side::Buy ? bidDepth_ : askDepth_;
+        bool rebuild = false;
+        if (index.Covers(price))
+        {
+            index.Add(price, delta);
+        }
+        else if (index.Beyond(price) && index.Width() >= depthWindowLimit_)
+        {
+            index.AddUnindexed(delta);
+        }
+        else
+        {
+            rebuild = true;
+        }
+        // outside the window, or everything left in it is past its end: move the window
+        if (rebuild || (index.Total() == 0 && index.Unindexed() != 0))
+        {
+            try
+            {
+                if (side == Side::Buy)
+                    RebuildDepth(bids_, bidDepth_, -tickSize_);
+                else
+                    RebuildDepth(asks_, askDepth_, tickSize_);
+            }
+            catch (const std::bad_alloc &)
+            {
+                index = DepthIndex{}; // queries walk the levels until a rebuild succeeds
+            }
+        }
+    }
+
+    // re-center the index on the side's live levels (which already include the change that
+    // fell outside the old window), doubling the window until the live range fits twice or it
+    // reaches the limit, past which levels are left unindexed
+    template <typename Levels>
+    void RebuildDepth(const Levels &levels, DepthIndex &index, Price step)
+    {
+        std::vector<std::pair<Price, std::uint64_t>> live;
+        levels.ForEach([&live](Price price, const OrderQueue &level)
+                       {
+                           if (!level.empty()) // the ladder's level being released is still listed
+                               live.emplace_back(price, level.quantity());
+                           return true; });
+        if (live.empty())
+        {
+            return; // nothing to index; the next add rebuilds around its own price
+        }
+        const Price best = live.front().first;
+        const Price worst = live.back().first;
+        const std::size_t span = static_cast<std::size_t>((static_cast<std::int64_t>(worst) - best) / step) + 1;
+        std::size_t width = depthWindow_;
+        while (width < span * 2 && width < depthWindowLimit_)
+        {
+            width *= 2;
+        }
+        width = std::min(width, depthWindowLimit_);
+        // start the window a quarter before the best price, on the tick grid and within Price
+        const std::int64_t room = step > 0 ? (static_cast<std::int64_t>(best) - std::numeric_limits<Price>::min()) / step
+                                           : (std::numeric_limits<Price>::max() - static_cast<std::int64_t>(best)) / -step;
+        const std::int64_t lead = std::min<std::int64_t>(static_cast<std::int64_t>(width / 4), room);
+        index.Rebuild(static_cast<Price>(best - lead * step), step, width, live);
+    }
+
+    void CheckTick(Price price) const
+    {
+        if (price % tickSize_ != 0)
+        {
+            throw std::invalid_argument("price is not a multiple of the tick size");
+        }
+    }
+
+    // a limit order that may rest needs a level at its price; checked before it trades, since
+    // matching never changes the range of its own side
+    void CheckWindow(Side side, Price price) const
+    {
+        if (!(side == Side::Buy ? bids_.Fits(price) : asks_.Fits(price)))
+        {
+            throw std::invalid_argument("price is too far from the book for the level container");
+        }
+    }
+
+    void Enqueue(OrderQueue &level, OrderHandle handle)
+    {
+        if constexpr (StableLevels)
+        {
+            if (levelOf_.size() <= handle)
+            {
+                levelOf_.resize(pool_.Capacity());
+            }
+            levelOf_[handle] = &level;
+        }
+        level.push_back(pool_, handle);
+        if (queuePositions_)
+            positions_.Push(level, pool_, handle);
+        const Order &order = pool_[handle];
+        TrackDepth(order.getSide(), order.getPrice(), level, order.getQuantity());
+    }
+
+    // Queue order at the back of level showing at most display of quantity (0: all of it); the
+    // rest becomes the order's iceberg reserve.
+    void Show(OrderQueue &level, OrderHandle handle, Quantity quantity, Quantity display)
+    {
+        Order &order = pool_[handle];
+        Quantity hidden = 0;
+        if (display != 0 && display < quantity)
+        {
+            if (reserves_.size() <= handle)
+            {
+                reserves_.resize(pool_.Capacity());
+            }
+            hidden = quantity - display;
+            reserves_[handle] = Reserve{display, hidden};
+            order.setIceberg(true);
+            quantity = display;
+        }
+        order.Refill(quantity);
+        Enqueue(level, handle);
+        // the level's totals only change once the order is linked, see Rest
+        level.AddHidden(hidden);
+        hidden_[static_cast<int>(order.getSide())] += hidden;
+    }
+
+    // the front clip of an iceberg filled: show the next one from the reserve at the back of the level
+    void Replenish(OrderQueue &level, OrderHandle handle)
+    {
+        Reserve &reserve = reserves_[handle];
+        const Quantity clip = std::min(reserve.peak, reserve.hidden);
+        reserve.hidden -= clip;
+        level.AddHidden(-static_cast<std::int64_t>(clip));
+        Order &order = pool_[handle];
+        hidden_[static_cast<int>(order.getSide())] -= clip;
+        level.erase(pool_, handle);
+        order.Refill(clip);
+        Enqueue(level, handle);
+    }
+
+    // displayed plus reserve
+    Quantity TotalQuantity(OrderHandle handle) const
+    {
+        const Order &order = pool_[handle];
+        return order.getQuantity() + (order.isIceberg() ? reserves_[handle].hidden : 0);
+    }
+
+    // Put the unmatched rest of an order at the back of its level. It is indexed before it is
+    // linked, and a throw before it is linked takes it back out of the index and the pool.
+    OrderHandle Rest(OrderQueue &level, OrderId id, Side side, Price price, Quantity quantity, Quantity display = 0)
+    {
+        const OrderHandle handle = pool_.Allocate(id, side, price, quantity);
+        try
+        {
+            orders_hashmap.insert(id, handle);
+            Show(level, handle, quantity, display);
+        }
+        catch (...)
+        {
+            if (level.back() != handle)
+            {
+                orders_hashmap.erase(id);
+                pool_.Release(handle);
+                if (level.empty())
+                {
+                    if (side == Side::Buy)
+                        bids_.Release(price);
+                    else
+                        asks_.Release(price);
+                }
+            }
+            throw;
+        }
+        return handle;
+    }
+
+    // rest what is left of request at the back of level, on its timer and its owner's list
+    void Place(OrderQueue &level, const OrderRequest &request, Quantity remaining)
+    {
+        const OrderHandle handle =
+            Rest(level, request.id, request.side, request.price, remaining, request.displayQuantity);
+        Schedule(handle, request.timeInForce, request.expiry);
+        Own(handle, request.owner);
+    }
+
+    // put handle at the front of owner's list
+    void Own(OrderHandle handle, OwnerId owner)
+    {
+        if (owner == NoOwner)
+        {
+            return;
+        }
+        if (owners_.size() <= handle)
+        {
+            owners_.resize(pool_.Capacity());
+        }
+        OrderHandle *head = ownerHeads_.find(owner);
+        owners_[handle] = OwnerLink{owner, NullHandle, head == nullptr ? NullHandle : *head};
+        if (head == nullptr)
+        {
+            ownerHeads_.insert(owner, handle);
+        }
+        else
+        {
+            owners_[*head].prev = handle;
+            *head = handle;
+        }
+        pool_[handle].setOwned(true);
+    }
+
+    void Disown(OrderHandle handle)
+    {
+        const OwnerLink &link = owners_[handle];
+        if (link.next != NullHandle)
+        {
+            owners_[link.next].prev = link.prev;
+        }
+        if (link.prev != NullHandle)
+        {
+            owners_[link.prev].next = link.next;
+        }
+        else if (link.next != NullHandle)
+        {
+            *ownerHeads_.find(link.owner) = link.next;
+        }
+        else
+        {
+            ownerHeads_.erase(link.owner);
+        }
+        pool_[handle].setOwned(false);
+    }
+
+    // an order left the book for good: off its owner's list and its timer, and its slot back to
+    // the pool
+    void Free(OrderHandle handle)
+    {
+        if (pool_[handle].isOwned())
+        {
+            Disown(handle);
+        }
+        if (handle < timerAt_.size() && timerAt_[handle] != NoTimer)
+        {
+            Unschedule(handle);
+        }
+        pool_.Release(handle);
+    }
+
+    // the level a resting order is queued in: where it was saved when the order joined, or
+    // looked up by price (O(1) on the ladder, the one container that moves its levels)
+    OrderQueue &LevelOf(OrderHandle handle)
+    {
+        if constexpr (StableLevels)
+        {
+            return *levelOf_[handle];
+        }
+        else
+        {
+            const Order &order = pool_[handle];
+            return order.getSide() == Side::Buy ? *bids_.Find(order.getPrice()) : *asks_.Find(order.getPrice());
+        }
+    }
+
+    const OrderQueue &LevelOf(OrderHandle handle) const { return const_cast<Orderbook *>(this)->LevelOf(handle); }
+
+    // Take a resting order out of its level and keep the level's totals right, all in O(1): the
+    // container is only asked about the level when it empties.
+    template <typename Levels>
+    void Unlink(Levels &levels, OrderHandle handle)
+    {
+        const Order &order = pool_[handle];
+        const Price price = order.getPrice();
+        OrderQueue &level = LevelOf(handle);
+        if (queuePositions_)
+            positions_.Add(level, order, -static_cast<std::int64_t>(order.getQuantity()));
+        if (order.isIceberg())
+        {
+            const Quantity hidden = reserves_[handle].hidden;
+            level.AddHidden(-static_cast<std::int64_t>(hidden));
+            hidden_[static_cast<int>(order.getSide())] -= hidden;
+            pool_[handle].setIceberg(false);
+        }
+        level.erase(pool_, handle);
+        TrackDepth(order.getSide(), price, level, -static_cast<std::int64_t>(order.getQuantity()));
+        if (level.empty())
+        {
+            if (queuePositions_)
+                positions_.Release(level);
+            levels.Release(price);
+        }
+    }
+
+    template <typename Levels>
+    static std::optional<LevelInfo> BestOf(const Levels &levels)
+    {
+        if (levels.empty())
+        {
+            return std::nullopt;
+        }
+        const OrderQueue &best = levels.Best();
+        return LevelInfo{levels.BestPrice(), best.quantity(), best.count()};
+    }
+
+    template <typename Levels>
+    static std::size_t DepthOf(const Levels &levels, std::span<LevelInfo> out)
+    {
+        std::size_t written = 0;
+        if (out.empty())
+        {
+            return 0;
+        }
+        levels.ForEach([&](Price price, const OrderQueue &level)
+                       {
+                           out[written++] = LevelInfo{price, level.quantity(), level.count()};
+                           return written < out.size(); });
+        return written;
+    }
+
+    const Seqlock<TopOfBook> &TopFeed() const
+    {
+        if (!topFeed_)
+        {
+            throw std::logic_error("top of book publishing needs OrderbookConfig::publishTop");
+        }
+        return *topFeed_;
+    }
+
+    void Unlink(OrderHandle handle)
+    {
+        if (pool_[handle].getSide() == Side::Buy)
+        {
+            Unlink(bids_, handle);
+        }
+        else
+        {
+            Unlink(asks_, handle);
+        }
+    }
+
+    // take a resting order out of its level (or a pending stop out of the trigger index), then out
+    // of the book, and free its slot
+    void RemoveOrder(OrderHandle handle)
+    {
+        if (pool_[handle].isStop())
+            Disarm(handle);
+        else
+            Unlink(handle);
+        Unindex(pool_[handle].getId());
+        Free(handle);
+    }
+
+    // Bulk cancels drop whole levels: every order of the level goes back to the pool and out of
+    // the index, then the level's totals leave the depth index, the reserve totals and the
+    // queue positions in one step each, instead of unlinking and re-totalling order by order.
+    // The caller takes the emptied level out of its container.
+    template <typename Cancelled>
+    std::size_t DropLevel(Side side, Price price, OrderQueue &level, Cancelled &cancelled)
+    {
+        std::size_t count = 0;
+        for (OrderHandle handle = level.front(); handle != NullHandle; ++count)
+        {
+            Order &order = pool_[handle];
+            const OrderHandle next = order.getNext();
+            const OrderId id = order.getId();
+            order.setIceberg(false);
+            Unindex(id);
+            Free(handle);
+            cancelled(id);
+            handle = next;
+        }
+        const std::uint64_t quantity = level.quantity();
+        hidden_[static_cast<int>(side)] -= level.hidden();
+        if (queuePositions_)
+            positions_.Discard(level);
+        level = OrderQueue{};
+        TrackDepth(side, price, level, -static_cast<std::int64_t>(quantity));
+        return count;
+    }
+
+    template <typename Levels, typename Cancelled>
+    std::size_t DropSide(Side side, Levels &levels, Cancelled &cancelled)
+    {
+        std::size_t count = 0;
+        while (!levels.empty())
+        {
+            count += DropLevel(side, levels.BestPrice(), levels.Best(), cancelled);
+            levels.PopBest();
+        }
+        return count;
+    }
+
+    // levels priced from low to high, both included
+    template <typename Levels, typename Cancelled>
+    std::size_t DropRange(Side side, Levels &levels, Price low, Price high, Cancelled &cancelled)
+    {
+        dropPrices_.clear();
+        levels.ForEach([this, side, low, high](Price price, const OrderQueue &)
+                       {
+            if (price >= low && price <= high)
+                dropPrices_.push_back(price);
+            return side == Side::Buy ? price > low : price < high; });
+        std::size_t count = 0;
+        for (const Price price : dropPrices_)
+        {
+            count += DropLevel(side, price, *levels.Find(price), cancelled);
+            levels.Release(price);
+        }
+        return count;
+    }
+
+    // pending stops of one side, straight out of the trigger index
+    template <typename Stops, typename Cancelled>
+    std::size_t DropStops(Stops &stops, Cancelled &cancelled)
+    {
+        for (const auto &[stopPrice, handle] : stops)
+        {
+            const OrderId id = pool_[handle].getId();
+            pool_[handle].setStop(false);
+            Unindex(id);
+            Free(handle);
+            cancelled(id);
+        }
+        const std::size_t count = stops.size();
+        pendingStops_ -= count;
+        stops.clear();
+        return count;
+    }
+
+public:
+    explicit Orderbook(const OrderbookConfig &config = {})
+        : pool_(config.capacity), bids_(config), asks_(config),
+          orders_hashmap(config.engineIds ? 0 : config.capacity), engineIds_(config.engineIds),
+          tickSize_(config.tickSize), depthWindow_(std::max<std::size_t>(config.ladderLevels, 64)),
+          depthWindowLimit_(std::max(config.windowLimit, depthWindow_)),
+          depthIndex_(config.depthIndex), queuePositions_(config.queuePositions),
+          topFeed_(config.publishTop ? std::make_unique<Seqlock<TopOfBook>>() : nullptr)
+    {
+        if (topFeed_)
+        {
+            topFeed_->Store(top_); // an empty book, version 0
+        }
+    }
+
+    // capacity: number of orders to preallocate pool slots for
+    explicit Orderbook(std::size_t capacity) : Orderbook(OrderbookConfig{.capacity = capacity})
+    {
+    }
+
+    // The order is matched first and only what is left is constructed in the pool and queued,
+    // so an order that fills completely never touches the levels of its own side or the id index.
+    // Immediate-or-cancel and fill-or-kill orders never rest: they only ever cost the matching.
+    // Fills go to sink as they happen; returns false if the id is a duplicate.
+    template <TradeSink Sink>
+    bool AddOrder(OrderId id, Side side, Price price, Quantity quantity, TimeInForce tif, Sink &&sink)
+    {
+        return Submit({.id = id, .side = side, .price = price, .quantity = quantity, .timeInForce = tif}, sink);
+    }
+
+    template <TradeSink Sink>
+    bool AddOrder(OrderId id, Side side, Price price, Quantity quantity, Sink &&sink)
+    {
+        return Submit({.id = id, .side = side, .price = price, .quantity = quantity}, sink);
+    }
+
+    // good-till-date: rests like good-till-cancel until ExpireOrders reaches expiry
+    template <TradeSink Sink>
+    bool AddOrder(OrderId id, Side side, Price price, Quantity quantity, TimeInForce tif, Timestamp expiry, Sink &&sink)
+    {
+        return Submit({.id = id, .side = side, .price = price, .quantity = quantity, .timeInForce = tif, .expiry = expiry},
+                      sink);
+    }
+
+    // the general form: any type, time in force, display and expiry, and an owner for CancelOwner
+    template <TradeSink Sink>
+    bool AddOrder(const OrderRequest &request, Sink &&sink)
+    {
+        return Submit(request, sink);
+    }
+
+    Trades AddOrder(const OrderRequest &request)
+    {
+        Trades trades = {};
+        AddOrder(request, [&trades](const Trade &trade)
+                 { trades.push_back(trade); });
+        return trades;
+    }
+
+    // convenience overloads: collect the fills in a fresh vector
+    Trades AddOrder(OrderId id, Side side, Price price, Quantity quantity,
+                    TimeInForce tif = TimeInForce::GoodTillCancel)
+    {
+        return AddOrder(id, side, price, quantity, tif, Timestamp{0});
+    }
+
+    Trades AddOrder(OrderId id, Side side, Price price, Quantity quantity, TimeInForce tif, Timestamp expiry)
+    {
+        Trades trades = {};
+        AddOrder(id, side, price, quantity, tif, expiry, [&trades](const Trade &trade)
+                 { trades.push_back(trade); });
+        return trades;
+    }
+
+    // Iceberg: matches like any limit order, then rests showing clips of at most display out of
+    // what is left. When a clip fills, the next one comes out of the hidden reserve and joins the
+    // back of the same level, all inside matching. Depth and market data see only the clips.
+    template <TradeSink Sink>
+    bool AddIcebergOrder(OrderId id, Side side, Price price, Quantity quantity, Quantity display, Sink &&sink)
+    {
+        if (display == 0)
+        {
+            throw std::invalid_argument("iceberg display quantity must be positive");
+        }
+        return Submit({.id = id, .side = side, .price = price, .quantity = quantity, .displayQuantity = display}, sink);
+    }
+
+    Trades AddIcebergOrder(OrderId id, Side side, Price price, Quantity quantity, Quantity display)
+    {
+        Trades trades = {};
+        AddIcebergOrder(id, side, price, quantity, display, [&trades](const Trade &trade)
+                        { trades.push_back(trade); });
+        return trades;
+    }
+
+    // Stop order: waits outside the book until a trade prints at or through stopPrice (at or
+    // above for a buy, at or below for a sell), then enters as a market order. If the last trade
+    // has already reached it, it enters right away. Cancel it like any other order; modifying a
+    // pending stop isn't supported.
+    template <TradeSink Sink>
+    bool AddStopOrder(OrderId id, Side side, Price stopPrice, Quantity quantity, Sink &&sink)
+    {
+        return Arm(id, side, stopPrice, 0, quantity, OrderType::Market, sink);
+    }
+
+    Trades AddStopOrder(OrderId id, Side side, Price stopPrice, Quantity quantity)
+    {
+        Trades trades = {};
+        AddStopOrder(id, side, stopPrice, quantity, [&trades](const Trade &trade)
+                     { trades.push_back(trade); });
+        return trades;
+    }
+
+    // stop-limit: like a stop order, but enters as a limit order at limitPrice
+    template <TradeSink Sink>
+    bool AddStopLimitOrder(OrderId id, Side side, Price stopPrice, Price limitPrice, Quantity quantity, Sink &&sink)
+    {
+        return Arm(id, side, stopPrice, limitPrice, quantity, OrderType::Limit, sink);
+    }
+
+    Trades AddStopLimitOrder(OrderId id, Side side, Price stopPrice, Price limitPrice, Quantity quantity)
+    {
+        Trades trades = {};
+        AddStopLimitOrder(id, side, stopPrice, limitPrice, quantity, [&trades](const Trade &trade)
+                          { trades.push_back(trade); });
+        return trades;
+    }
+
+    std::optional<Price> LastTradePrice() const { return lastTrade_; }
+
+    // Call auction: from StartAuction until Uncross, orders only accumulate (the book may cross)
+    // and nothing trades. Only good-till-cancel limit orders are accepted; cancels and modifies
+    // work as usual, without matching, and stops wait for the trades of the uncross.
+    void StartAuction() { auction_ = true; }
+    bool InAuction() const { return auction_; }
+
+    // price and volume Uncross would execute at now, if the book is crossed
+    std::optional<AuctionResult> IndicativeUncross() { return Equilibrium(); }
+
+    // Ends the auction: finds the equilibrium price, then executes the whole volume there in one
+    // bulk pass, best bid against best ask in price-time order, every fill at the one price.
+    // Continuous matching resumes afterwards, starting with any stops the auction price reached.
+    template <TradeSink Sink>
+    std::optional<AuctionResult> Uncross(Sink &&sink)
+    {
+        const PublishTopOnExit publish{*this};
+        const std::optional<AuctionResult> result = Equilibrium();
+        auction_ = false;
+        if (!result)
+        {
+            if (pendingStops_ != 0)
+            {
+                FireStops(sink); // reached before the auction, held back by it
+            }
+            return result;
+        }
+        const Price price = result->price;
+        for (std::uint64_t remaining = result->volume; remaining > 0;)
+        {
+            OrderQueue &bidLevel = bids_.Best();
+            OrderQueue &askLevel = asks_.Best();
+            const OrderHandle bid = bidLevel.front();
+            const OrderHandle ask = askLevel.front();
+            const Quantity quantity = static_cast<Quantity>(
+                std::min<std::uint64_t>({remaining, pool_[bid].getQuantity(), pool_[ask].getQuantity()}));
+            sink(Trade{TradeSide{pool_[bid].getId(), price, quantity}, TradeSide{pool_[ask].getId(), price, quantity}});
+            Consume(bidLevel, bid, quantity);
+            Consume(askLevel, ask, quantity);
+            remaining -= quantity;
+            if (bidLevel.empty())
+            {
+                if (queuePositions_)
+                    positions_.Release(bidLevel);
+                bids_.PopBest();
+            }
+            if (askLevel.empty())
+            {
+                if (queuePositions_)
+                    positions_.Release(askLevel);
+                asks_.PopBest();
+            }
+        }
+        lastTrade_ = price;
+        if (pendingStops_ != 0)
+        {
+            FireStops(sink);
+        }
+        return result;
+    }
+
+    std::optional<AuctionResult> Uncross(Trades &trades)
+    {
+        return Uncross([&trades](const Trade &trade)
+                       { trades.push_back(trade); });
+    }
+    std::size_t PendingStops() const { return pendingStops_; }
+
+    // Market orders trade against whatever the other side has, best price first, and never rest:
+    // immediate-or-cancel by default, or fill-or-kill.
+    template <TradeSink Sink>
+    bool AddMarketOrder(OrderId id, Side side, Quantity quantity, TimeInForce tif, Sink &&sink)
+    {
+        return Submit({.id = id, .side = side, .price = 0, .quantity = quantity, .timeInForce = tif, .type = OrderType::Market},
+                      sink);
+    }
+
+    Trades AddMarketOrder(OrderId id, Side side, Quantity quantity, TimeInForce tif = TimeInForce::ImmediateOrCancel)
+    {
+        Trades trades = {};
+        AddMarketOrder(id, side, quantity, tif, [&trades](const Trade &trade)
+                       { trades.push_back(trade); });
+        return trades;
+    }
+
+    // Engine-id mode (OrderbookConfig::engineIds): the book issues the id and returns it.
+    // The id is the order's slot id, so there is no duplicate check, and cancel/modify find the
+    // order by indexing the pool with no hashing at all. Client ids are meant to be mapped to
+    // these once, at the gateway.
+    template <TradeSink Sink>
+    OrderId AddOrder(Side side, Price price, Quantity quantity, TimeInForce tif, Sink &&sink)
+    {
+        return AddOrder(side, price, quantity, tif, Timestamp{0}, sink);
+    }
+
+    template <TradeSink Sink>
+    OrderId AddOrder(Side side, Price price, Quantity quantity, TimeInForce tif, Timestamp expiry, Sink &&sink)
+    {
+        const PublishTopOnExit publish{*this};
+        RequireEngineIds(true);
+        CheckTick(price);
+        CheckExpiry(tif, expiry);
+        CheckAuction(tif, OrderType::Limit); // before the slot is taken: a throw must not leak it
+        if (Rests(tif))
+        {
+            CheckWindow(side, price);
+        }
+        const OrderHandle handle = pool_.AllocateWithSlotId(side, price, quantity);
+        Order &order = pool_[handle];
+        const OrderId id = order.getId();
+        const Quantity remaining =
+            side == Side::Buy ? Execute<Side::Buy>(id, price, quantity, tif, OrderType::Limit, sink)
+                              : Execute<Side::Sell>(id, price, quantity, tif, OrderType::Limit, sink);
+        if (remaining == 0)
+        {
+            pool_.Release(handle);
+        }
+        else
+        {
+            order.ReduceTo(remaining);
+            Enqueue(side == Side::Buy ? bids_[price] : asks_[price], handle);
+            Schedule(handle, tif, expiry);
+        }
+        return id;
+    }
+
+    template <TradeSink Sink>
+    OrderId AddOrder(Side side, Price price, Quantity quantity, Sink &&sink)
+    {
+        return AddOrder(side, price, quantity, TimeInForce::GoodTillCancel, sink);
+    }
+
+    // Adds a batch of orders one after the other, with exactly the semantics of calling AddOrder
+    // on each. Every fill is appended to one contiguous buffer: trades is cleared, then the fills
+    // of batch[i] are trades[offsets[i]] .. trades[offsets[i + 1]] (offsets gets batch.size() + 1
+    // entries). Reuse both vectors across batches and the steady state allocates nothing.
+    // Consecutive orders resting at the same price reuse the level found for the previous one
+    // instead of looking it up again. Returns how many orders were accepted (not duplicates).
+    // With publishTop, the top is published once, after the whole batch.
+    std::size_t AddOrders(std::span<const OrderRequest> batch, Trades &trades, std::vector<std::uint32_t> &offsets)
+    {
+        const PublishTopOnExit publish{*this};
+        RequireEngineIds(false);
+        trades.clear();
+        offsets.clear();
+        offsets.reserve(batch.size() + 1);
+        auto sink = [&trades](const Trade &trade)
+        { trades.push_back(trade); };
+
+        // last level each side rested into. Only fills can pop levels here (there are no cancels
+        // inside a batch), so a hint stays valid until the other side trades against its side.
+        OrderQueue *hint[2] = {nullptr, nullptr};
+        Price hintPrice[2] = {0, 0};
+
+        std::size_t accepted = 0;
+        for (const OrderRequest &request : batch)
+        {
+            if (request.type == OrderType::Limit)
+            {
+                CheckTick(request.price);
+            }
+            CheckExpiry(request.timeInForce, request.expiry);
+            if (request.type == OrderType::Limit && Rests(request.timeInForce))
+            {
+                CheckWindow(request.side, request.price);
+            }
+            offsets.push_back(static_cast<std::uint32_t>(trades.size()));
+            if (orders_hashmap.contains(request.id))
+            {
+                continue;
+            }
+            ++accepted;
+
+            const std::size_t before = trades.size();
+            const Quantity remaining =
+                request.side == Side::Buy
+                    ? Execute<Side::Buy>(request.id, request.price, request.quantity, request.timeInForce, request.type, sink)
+                    : Execute<Side::Sell>(request.id, request.price, request.quantity, request.timeInForce, request.type, sink);
+            const std::size_t own = static_cast<std::size_t>(request.side);
+            if (trades.size() != before)
+            {
+                hint[1 - own] = nullptr; // the opposite side may have lost levels
+            }
+            if (remaining > 0)
+            {
+                if (hint[own] == nullptr || hintPrice[own] != request.price)
+                {
+                    hint[own] = request.side == Side::Buy ? &bids_[request.price] : &asks_[request.price];
+                    hintPrice[own] = request.price;
+                }
+                Place(*hint[own], request, remaining);
+            }
+            // fired stops count as this order's fills, and may have traded either side
+            if (pendingStops_ != 0 && FireStops(sink))
+            {
+                hint[0] = hint[1] = nullptr;
+            }
+        }
+        offsets.push_back(static_cast<std::uint32_t>(trades.size()));
+        return accepted;
+    }
+
+    // Evicts every good-till-date order whose expiry is at or before now, soonest first, calling
+    // expired(id) for each. Returns how many were evicted.
+    template <std::invocable<OrderId> Expired>
+    std::size_t ExpireOrders(Timestamp now, Expired &&expired)
+    {
+        const PublishTopOnExit publish{*this};
+        std::size_t count = 0;
+        for (; !expiries_.empty() && expiries_.front().expiry <= now; ++count)
+        {
+            Expire(expiries_.front().handle, expired);
+        }
+        return count;
+    }
+
+    std::size_t ExpireOrders(Timestamp now)
+    {
+        return ExpireOrders(now, [](OrderId) {});
+    }
+
+    // End of session: evicts every day order in one sweep over their list, newest first.
+    template <std::invocable<OrderId> Expired>
+    std::size_t ExpireDayOrders(Expired &&expired)
+    {
+        const PublishTopOnExit publish{*this};
+        std::size_t count = 0;
+        for (; !dayOrders_.empty(); ++count)
+        {
+            Expire(dayOrders_.back(), expired);
+        }
+        return count;
+    }
+
+    std::size_t ExpireDayOrders()
+    {
+        return ExpireDayOrders([](OrderId) {});
+    }
+
+    // returns false when no resting order has this id
+    bool CancelOrder(OrderId id)
+    {
+        const PublishTopOnExit publish{*this};
+        const OrderHandle handle = FindHandle(id);
+        if (handle == NullHandle)
+        {
+            return false;
+        }
+        RemoveOrder(handle);
+        return true;
+    }
+
+    // Bulk cancels, for a disconnect or a risk breach. Each calls cancelled(id) for every order it
+    // takes out and returns how many that was.
+
+    // Every order of side, resting or pending stop: whole levels at a time, best first, then the
+    // side's trigger index in one go.
+    template <std::invocable<OrderId> Cancelled>
+    std::size_t CancelSide(Side side, Cancelled &&cancelled)
+    {
+        const PublishTopOnExit publish{*this};
+        return side == Side::Buy ? DropSide(side, bids_, cancelled) + DropStops(buyStops_, cancelled)
+                                 : DropSide(side, asks_, cancelled) + DropStops(sellStops_, cancelled);
+    }
+
+    std::size_t CancelSide(Side side)
+    {
+        return CancelSide(side, [](OrderId) {});
+    }
+
+    // Every order of side resting at a price from low to high, both included, whole levels at a
+    // time. Pending stops aren't resting anywhere yet and stay.
+    template <std::invocable<OrderId> Cancelled>
+    std::size_t CancelRange(Side side, Price low, Price high, Cancelled &&cancelled)
+    {
+        const PublishTopOnExit publish{*this};
+        return side == Side::Buy ? DropRange(side, bids_, low, high, cancelled)
+                                 : DropRange(side, asks_, low, high, cancelled);
+    }
+
+    std::size_t CancelRange(Side side, Price low, Price high)
+    {
+        return CancelRange(side, low, high, [](OrderId) {});
+    }
+
+    // Every order added with owner (OrderRequest::owner), newest first. Walks the owner's own
+    // list, so it costs O(orders owned) whatever the size of the book.
+    template <std::invocable<OrderId> Cancelled>
+    std::size_t CancelOwner(OwnerId owner, Cancelled &&cancelled)
+    {
+        const PublishTopOnExit publish{*this};
+        const OrderHandle *head = owner == NoOwner ? nullptr : ownerHeads_.find(owner);
+        if (head == nullptr)
+        {
+            return 0;
+        }
+        OrderHandle handle = *head;
+        ownerHeads_.erase(owner); // the whole list goes, no need to unlink its orders one by one
+        std::size_t count = 0;
+        for (; handle != NullHandle; ++count)
+        {
+            const OrderHandle next = owners_[handle].next;
+            const OrderId id = pool_[handle].getId();
+            pool_[handle].setOwned(false);
+            RemoveOrder(handle);
+            cancelled(id);
+            handle = next;
+        }
+        return count;
+    }
+
+    std::size_t CancelOwner(OwnerId owner)
+    {
+        return CancelOwner(owner, [](OrderId) {});
+    }
+
+    // A quantity reduction at the same price is done in place and keeps queue priority.
+    // Anything else (new price, larger quantity) is a cancel-replace that goes to the back of the
+    // queue and may trade right away; the order keeps its id and its pool slot.
+    // A new quantity of 0 cancels the order. Returns false when no resting order has this id
+    // (a pending stop can only be cancelled).
+    // For an iceberg the new quantity is the total, displayed plus reserve, and a reduction takes
+    // from the reserve first.
+    template <TradeSink Sink>
+    bool ModifyOrder(OrderId id, Price newPrice, Quantity newQuantity, Sink &&sink)
+    {
+        return Modify<false>(id, newPrice, newQuantity, sink);
+    }
+
+    // AddOrder and ModifyOrder for a caller that has already checked the request itself, the way
+    // OrderPipeline's validate stage does: the price on the tick, a good-till-date expiry set,
+    // and (for an add) an id never used before. Those checks are skipped here; anything else the
+    // book would reject, it still rejects.
+    template <TradeSink Sink>
+    bool AddValidated(const OrderRequest &request, Sink &&sink)
+    {
+        return Submit<true>(request, sink);
+    }
+
+    template <TradeSink Sink>
+    bool ModifyValidated(OrderId id, Price newPrice, Quantity newQuantity, Sink &&sink)
+    {
+        return Modify<true>(id, newPrice, newQuantity, sink);
+    }
+
+    Trades ModifyOrder(OrderId id, Price newPrice, Quantity newQuantity)
+    {
+        Trades trades = {};
+        ModifyOrder(id, newPrice, newQuantity, [&trades](const Trade &trade)
+                    { trades.push_back(trade); });
+        return trades;
+    }
+
+    std::optional<LevelInfo> BestBid() const { return BestOf(bids_); }
+    std::optional<LevelInfo> BestAsk() const { return BestOf(asks_); }
+
+    // best ask - best bid, when both sides have orders
+    std::optional<Price> Spread() const
+    {
+        if (bids_.empty() || asks_.empty())
+        {
+            return std::nullopt;
+        }
+        return asks_.BestPrice() - bids_.BestPrice();
+    }
+
+    // With publishTop: the top TopLevels levels of both sides as last published, read from any
+    // thread while this book's own thread keeps matching. Readers never block or slow down the
+    // matching thread; a reader that overlaps a publication retries, and TryReadTop returns
+    // false instead. The book's own thread can read Depth directly.
+    TopOfBook ReadTop() const
+    {
+        return TopFeed().Load();
+    }
+
+    bool TryReadTop(TopOfBook &top) const
+    {
+        return TopFeed().TryLoad(top);
+    }
+
+    // Top out.size() levels of one side, best first, from the per-level totals (no order walks).
+    // Returns how many levels were written.
+    std::size_t Depth(Side side, std::span<LevelInfo> out) const
+    {
+        return side == Side::Buy ? DepthOf(bids_, out) : DepthOf(asks_, out);
+    }
+
+    // Quantity resting on side at prices at or better than limit (>= limit for bids, <= for asks).
+    // O(log W) with the depth index, a walk over the levels without it.
+    std::uint64_t QuantityAtOrBetter(Side side, Price limit) const
+    {
+        const DepthIndex &index = side == Side::Buy ? bidDepth_ : askDepth_;
+        if (depthIndex_ && index.Answers(limit))
+        {
+            return index.QuantityThrough(limit);
+        }
+        std::uint64_t total = 0;
+        auto sum = [&total, side, limit](Price price, const OrderQueue &level)
+        {
+            if (side == Side::Buy ? price < limit : price > limit)
+                return false;
+            total += level.quantity();
+            return true;
+        };
+        if (side == Side::Buy)
+            bids_.ForEach(sum);
+        else
+            asks_.ForEach(sum);
+        return total;
+    }
+
+    // Average price an order on side aggressor would trade at if it swept quantity from the other
+    // side, or nothing if the book can't fill it. O(log W) with the depth index.
+    std::optional<double> SweepVwap(Side aggressor, std::uint64_t quantity) const
+    {
+        if (quantity == 0)
+        {
+            return std::nullopt;
+        }
+        const DepthIndex &index = aggressor == Side::Buy ? askDepth_ : bidDepth_;
+        if (depthIndex_ && index.Width() != 0 && (index.Total() >= quantity || index.Unindexed() == 0))
+        {
+            if (index.Total() < quantity)
+            {
+                return std::nullopt;
+            }
+            return index.SweepAverage(quantity);
+        }
+        std::uint64_t remaining = quantity;
+        double notional = 0;
+        auto sweep = [&remaining, &notional](Price price, const OrderQueue &level)
+        {
+            const std::uint64_t taken = std::min(remaining, level.quantity());
+            notional += static_cast<double>(taken) * price;
+            remaining -= taken;
+            return remaining > 0;
+        };
+        if (aggressor == Side::Buy)
+            asks_.ForEach(sweep);
+        else
+            bids_.ForEach(sweep);
+        if (remaining > 0)
+        {
+            return std::nullopt;
+        }
+        return notional / static_cast<double>(quantity);
+    }
+
+    // Quantity resting ahead of order id at its price level, or nothing if the order isn't resting.
+    // O(log n) in the level's orders with queuePositions, a walk towards the front without it.
+    std::optional<std::uint64_t> QuantityAhead(OrderId id) const
+    {
+        const OrderHandle handle = FindHandle(id);
+        if (handle == NullHandle || pool_[handle].isStop())
+        {
+            return std::nullopt;
+        }
+        const Order &order = pool_[handle];
+        if (queuePositions_)
+        {
+            return positions_.Ahead(LevelOf(handle), order);
+        }
+        std::uint64_t ahead = 0;
+        for (OrderHandle h = order.getPrev(); h != NullHandle; h = pool_[h].getPrev())
+        {
+            ahead += pool_[h].getQuantity();
+        }
+        return ahead;
+    }
+
+    int Size() const
+    {
+        return static_cast<int>(pool_.Live() - pendingStops_); // every other live slot is a resting order
+    }
+
+    // number of order slots the pool has allocated so far
+    std::size_t Capacity() const
+    {
+        return pool_.Capacity();
+    }
+
+    // Friend functions for printing
+    template <template <Side> class L, typename A>
+    friend void print(const Orderbook<L, A> &ob);
+    template <template <Side> class L, typename A>
+    friend void printLevel(const Orderbook<L, A> &ob, Price price, const OrderQueue &orders);
+};
+
+using LadderOrderbook = Orderbook<LadderLevels>;
+using VectorOrderbook = Orderbook<VectorLevels>;
@@ -0,0 +1,1052 @@
+/*
+ * Micro-benchmarks for the limit order matching engine in orderbook.h, the multi-symbol
+ * engines in matching_engine.h and work_stealing.h, the ring in spsc_ring.h and the pipeline
+ * in pipeline.h
+ *
+ * Build with optimizations, e.g. g++ -std=c++20 -O2 orderbook_bench.cpp -o orderbook_bench
+ * Hardware cache misses are read through perf_event_open on Linux; where the counter is not
+ * available (other OSes, containers, VMs without a PMU) only the timings are reported.
+ */
+
+#include "orderbook.h"
+#include "matching_engine.h"
+#include "pipeline.h"
+#include "work_stealing.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <span>
+#include <map>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// counts last-level cache misses of this thread between Start and Stop
+class CacheMissCounter
+{
+private:
+    int fd_ = -1;
+
+public:
+    CacheMissCounter()
+    {
+#ifdef __linux__
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd_ = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+#endif
+    }
+    ~CacheMissCounter()
+    {
+#ifdef __linux__
+        if (fd_ >= 0)
+            close(fd_);
+#endif
+    }
+    CacheMissCounter(const CacheMissCounter &) = delete;
+    CacheMissCounter &operator=(const CacheMissCounter &) = delete;
+
+    bool Available() const { return fd_ >= 0; }
+
+    void Start()
+    {
+#ifdef __linux__
+        if (fd_ >= 0)
+        {
+            ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    // returns the number of misses since Start, 0 if the counter is not available
+    long long Stop()
+    {
+        long long count = 0;
+#ifdef __linux__
+        if (fd_ >= 0)
+        {
+            ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(fd_, &count, sizeof(count)) != sizeof(count))
+                count = 0;
+        }
+#endif
+        return count;
+    }
+};
+
+// The book as it was before pooled, intrusive storage: a shared_ptr per order,
+// a std::list node per resting order and the list iterator kept in the id index.
+// Kept here only as the "before" side of the comparison.
+namespace legacy
+{
+    using OrderPointer = std::shared_ptr<Order>;
+    using OrderPointers = std::list<OrderPointer>;
+
+    class Orderbook
+    {
+        struct OrderEntry
+        {
+            OrderPointer order_;
+            OrderPointers::iterator iter_;
+        };
+
+        std::map<Price, OrderPointers, std::greater<>> bids_;
+        std::map<Price, OrderPointers, std::less<>> asks_;
+        std::unordered_map<OrderId, OrderEntry> orders_hashmap;
+
+        Trades MatchOrders()
+        {
+            Trades trades = {};
+            while (!asks_.empty() && !bids_.empty())
+            {
+                auto &[bestBidPrice, bestBids] = *bids_.begin();
+                auto &[bestAskPrice, bestAsks] = *asks_.begin();
+                if (bestBidPrice < bestAskPrice)
+                    return trades;
+
+                while (!bestBids.empty() && !bestAsks.empty())
+                {
+                    const auto &oldestBid = bestBids.front();
+                    const auto &oldestAsk = bestAsks.front();
+                    const Quantity match_qty = std::min(oldestBid->getQuantity(), oldestAsk->getQuantity());
+                    const OrderId buyId = oldestBid->getId();
+                    const OrderId sellId = oldestAsk->getId();
+                    oldestBid->Fill(match_qty);
+                    oldestAsk->Fill(match_qty);
+                    trades.push_back({{buyId, oldestBid->getPrice(), match_qty}, {sellId, oldestAsk->getPrice(), match_qty}});
+                    if (oldestBid->isFilled())
+                    {
+                        bestBids.pop_front();
+                        orders_hashmap.erase(buyId);
+                    }
+                    if (oldestAsk->isFilled())
+                    {
+                        bestAsks.pop_front();
+                        orders_hashmap.erase(sellId);
+                    }
+                }
+                if (bestAsks.empty())
+                    asks_.erase(asks_.begin());
+                if (bestBids.empty())
+                    bids_.erase(bids_.begin());
+            }
+            return trades;
+        }
+
+    public:
+        Trades AddOrder(OrderPointer new_order)
+        {
+            if (orders_hashmap.contains(new_order->getId()))
+                return {};
+            OrderPointers::iterator it;
+            if (new_order->getSide() == Side::Buy)
+            {
+                auto &level = bids_[new_order->getPrice()];
+                it = level.insert(level.end(), new_order);
+            }
+            else
+            {
+                auto &level = asks_[new_order->getPrice()];
+                it = level.insert(level.end(), new_order);
+            }
+            orders_hashmap[new_order->getId()] = {new_order, it};
+            return MatchOrders();
+        }
+    };
+}
+
+using Clock = std::chrono::steady_clock;
+
+struct FillStats
+{
+    double nsPerFill;
+    double missesPerFill;
+};
+
+// Rest `resting` one-lot sells round-robin over `levels` prices, so neighbours in a level's FIFO
+// were created far apart in time (as they are in a live book), then sweep the book with buys
+// that each take `sweep` orders. Only the sweeping phase is measured.
+template <typename Book, typename AddFn>
+FillStats SweepFills(Book &book, AddFn add, std::size_t resting, Price levels, Quantity sweep)
+{
+    OrderId id = 1;
+    for (std::size_t i = 0; i < resting; ++i)
+    {
+        add(book, id++, Side::Sell, 1000 + static_cast<Price>(i % levels), 1);
+    }
+
+    CacheMissCounter misses;
+    std::size_t fills = 0;
+    const auto start = Clock::now();
+    misses.Start();
+    for (std::size_t done = 0; done < resting; done += sweep)
+    {
+        fills += add(book, id++, Side::Buy, 1000 + levels, sweep).size();
+    }
+    const long long missCount = misses.Stop();
+    const auto elapsed = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+
+    return {elapsed / fills, misses.Available() ? static_cast<double>(missCount) / fills : -1.0};
+}
+
+std::string FormatMisses(const FillStats &stats)
+{
+    if (stats.missesPerFill < 0)
+        return "n/a";
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "%.2f", stats.missesPerFill);
+    return buffer;
+}
+
+void BenchFifoFills()
+{
+    std::printf("\n=== FIFO fills: std::list<shared_ptr<Order>> vs intrusive pooled queues ===\n");
+    std::printf("%10s %8s | %14s %14s | %14s %14s\n", "resting", "levels", "before ns/fill", "before miss/f",
+                "after ns/fill", "after miss/f");
+
+    for (const std::size_t resting : {10'000, 100'000, 1'000'000})
+    {
+        const Price levels = 64;
+        const Quantity sweep = 32;
+
+        legacy::Orderbook before;
+        const FillStats b = SweepFills(before, [](legacy::Orderbook &ob, OrderId id, Side side, Price price, Quantity qty)
+                                       { return ob.AddOrder(std::make_shared<Order>(id, side, price, qty)); },
+                                       resting, levels, sweep);
+
+        Orderbook after(resting);
+        const FillStats a = SweepFills(after, [](Orderbook<> &ob, OrderId id, Side side, Price price, Quantity qty)
+                                       { return ob.AddOrder(id, side, price, qty); },
+                                       resting, levels, sweep);
+
+        std::printf("%10zu %8d | %14.1f %14s | %14.1f %14s\n", resting, levels, b.nsPerFill, FormatMisses(b).c_str(),
+                    a.nsPerFill, FormatMisses(a).c_str());
+    }
+}
+
+// Steady-state flow against a book `depth` levels deep on each side around a mid of 10000:
+// every round adds a one-lot bid and ask at a uniformly random level, then sends one-lot
+// marketable orders that take the best bid and the best ask. Returns ns per order.
+template <typename Book>
+double LevelFlow(Price depth, std::size_t rounds)
+{
+    Book book(static_cast<std::size_t>(depth) * 8 + 64);
+    OrderId id = 1;
+    for (Price level = 1; level <= depth; ++level)
+    {
+        book.AddOrder(id++, Side::Sell, 10000 + level, 2);
+        book.AddOrder(id++, Side::Buy, 10000 - level, 2);
+    }
+
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<Price> offset(1, depth);
+    const auto start = Clock::now();
+    for (std::size_t i = 0; i < rounds; ++i)
+    {
+        book.AddOrder(id++, Side::Sell, 10000 + offset(rng), 1);
+        book.AddOrder(id++, Side::Buy, 10000 - offset(rng), 1);
+        book.AddOrder(id++, Side::Buy, 10000 + depth, 1);
+        book.AddOrder(id++, Side::Sell, 10000 - depth, 1);
+    }
+    return std::chrono::duration<double, std::nano>(Clock::now() - start).count() / (rounds * 4);
+}
+
+void BenchLevelContainers()
+{
+    std::printf("\n=== Level containers across book depths (ns per order, lower is better) ===\n");
+    std::printf("%8s | %10s %10s %10s\n", "depth", "map", "vector", "ladder");
+    for (const Price depth : {4, 16, 64, 256, 1024, 4096})
+    {
+        const std::size_t rounds = 200'000;
+        const double map = LevelFlow<Orderbook<MapLevels>>(depth, rounds);
+        const double vector = LevelFlow<VectorOrderbook>(depth, rounds);
+        const double ladder = LevelFlow<LadderOrderbook>(depth, rounds);
+        std::printf("%8d | %10.1f %10.1f %10.1f\n", depth, map, vector, ladder);
+    }
+}
+
+// Bursts from a gateway: each burst is a run of passive orders at a handful of prices with an
+// occasional marketable one. Compares one AddOrder call per order against one AddOrders call
+// per batch, both writing into a reused trade buffer. Returns ns per order.
+double BatchFlow(std::size_t batchSize, bool batched, std::size_t orders)
+{
+    Orderbook book(1 << 20);
+    std::mt19937 rng(3);
+    std::uniform_int_distribution<Price> offset(1, 8);
+    std::vector<OrderRequest> flow;
+    flow.reserve(orders);
+    Price runPrice = 1;
+    for (OrderId id = 1; id <= orders; ++id)
+    {
+        // runs of 8 orders on one side at one price
+        const Side side = id / 8 % 2 ? Side::Buy : Side::Sell;
+        if (id % 8 == 0)
+        {
+            runPrice = offset(rng);
+        }
+        const bool marketable = id % 16 == 0;
+        const Price price = side == Side::Buy ? (marketable ? 10010 : 10000 - runPrice)
+                                              : (marketable ? 9990 : 10000 + runPrice);
+        flow.push_back({id, side, price, 1 + static_cast<Quantity>(rng() % 5)});
+    }
+
+    Trades trades;
+    trades.reserve(4096);
+    std::vector<std::uint32_t> offsets;
+    auto sink = [&trades](const Trade &trade)
+    { trades.push_back(trade); };
+
+    const auto start = Clock::now();
+    for (std::size_t first = 0; first < flow.size(); first += batchSize)
+    {
+        const std::span<const OrderRequest> batch(flow.data() + first, std::min(batchSize, flow.size() - first));
+        if (batched)
+        {
+            book.AddOrders(batch, trades, offsets);
+        }
+        else
+        {
+            trades.clear();
+            for (const OrderRequest &request : batch)
+            {
+                book.AddOrder(request.id, request.side, request.price, request.quantity, sink);
+            }
+        }
+    }
+    return std::chrono::duration<double, std::nano>(Clock::now() - start).count() / flow.size();
+}
+
+void BenchBatchSubmission()
+{
+    std::printf("\n=== Batch submission: AddOrder per order vs AddOrders per batch (ns per order) ===\n");
+    std::printf("%8s | %10s %10s\n", "batch", "single", "batched");
+    for (const std::size_t batchSize : {1, 4, 16, 64, 256, 1024})
+    {
+        const std::size_t orders = 1 << 20;
+        double single = 1e9;
+        double batched = 1e9;
+        for (int repeat = 0; repeat < 3; ++repeat) // best of 3, the runs are short
+        {
+            single = std::min(single, BatchFlow(batchSize, false, orders));
+            batched = std::min(batched, BatchFlow(batchSize, true, orders));
+        }
+        std::printf("%8zu | %10.1f %10.1f\n", batchSize, single, batched);
+    }
+}
+
+// Per-operation latency of the order index under add/cancel churn with sequential ids.
+// std::unordered_map allocates a node per insert and rehashes the whole table as it grows,
+// which shows up in the tail; the flat index is presized from the book capacity.
+template <typename Index, typename Insert, typename Erase>
+void IndexLatency(const char *name, Index &index, Insert insert, Erase erase, std::size_t live, std::size_t ops)
+{
+    std::vector<double> samples;
+    samples.reserve(ops);
+    OrderId next = 1;
+    for (std::size_t i = 0; i < ops; ++i)
+    {
+        const auto start = Clock::now();
+        insert(index, next);
+        if (next > live)
+        {
+            erase(index, next - live); // keep `live` orders resting
+        }
+        samples.push_back(std::chrono::duration<double, std::nano>(Clock::now() - start).count());
+        ++next;
+    }
+    std::sort(samples.begin(), samples.end());
+    auto at = [&samples](double q)
+    { return samples[static_cast<std::size_t>(q * (samples.size() - 1))]; };
+    std::printf("%16s | %8.0f %8.0f %8.0f %10.0f\n", name, at(0.5), at(0.99), at(0.9999), samples.back());
+}
+
+void BenchOrderIndex()
+{
+    std::printf("\n=== Order index latency, insert + erase per op, 1M live orders (ns) ===\n");
+    std::printf("%16s | %8s %8s %8s %10s\n", "index", "p50", "p99", "p99.99", "max");
+    const std::size_t live = 1'000'000;
+    const std::size_t ops = 4'000'000;
+
+    std::unordered_map<OrderId, OrderHandle> node_map;
+    IndexLatency("unordered_map", node_map, [](auto &m, OrderId id)
+                 { m.emplace(id, static_cast<OrderHandle>(id)); },
+                 [](auto &m, OrderId id)
+                 { m.erase(id); },
+                 live, ops);
+
+    OrderIndex flat(live + 1);
+    IndexLatency("OrderIndex", flat, [](auto &m, OrderId id)
+                 { m.insert(id, static_cast<OrderHandle>(id)); },
+                 [](auto &m, OrderId id)
+                 { m.erase(id); },
+                 live, ops);
+}
+
+// One level of `orders` resting orders, each hit by a stream of aggressive orders that take about
+// ten lots per resting order. FIFO fills the front order; pro-rata shares every incoming order over
+// the whole level, so its cost grows with the level. Returns ns per incoming order.
+template <typename Book>
+double AllocationFlow(std::size_t orders, std::size_t rounds)
+{
+    Book book(orders + 64);
+    OrderId id = 1;
+    for (std::size_t i = 0; i < orders; ++i)
+    {
+        book.AddOrder(id++, Side::Buy, 10000, 1'000'000 + static_cast<Quantity>(i % 7) * 1000);
+    }
+    Trades trades;
+    auto sink = [&trades](const Trade &trade)
+    { trades.push_back(trade); };
+    const Quantity take = static_cast<Quantity>(orders * 10);
+    const auto start = Clock::now();
+    for (std::size_t i = 0; i < rounds; ++i)
+    {
+        trades.clear();
+        book.AddOrder(id++, Side::Sell, 10000, take, sink);
+    }
+    return std::chrono::duration<double, std::nano>(Clock::now() - start).count() / rounds;
+}
+
+void BenchAllocationPolicies()
+{
+    std::printf("\n=== Allocation policies on one level (ns per incoming order) ===\n");
+    std::printf("%8s | %10s %10s %10s\n", "orders", "fifo", "pro-rata", "top+pr");
+    for (const std::size_t orders : {4, 16, 64, 256, 1024, 4096})
+    {
+        const std::size_t rounds = 20'000;
+        const double fifo = AllocationFlow<Orderbook<MapLevels, FifoAllocation>>(orders, rounds);
+        const double proRata = AllocationFlow<Orderbook<MapLevels, ProRataAllocation>>(orders, rounds);
+        const double top = AllocationFlow<Orderbook<MapLevels, TopPriorityProRataAllocation>>(orders, rounds);
+        std::printf("%8zu | %10.1f %10.1f %10.1f\n", orders, fifo, proRata, top);
+    }
+}
+
+// An opening auction over `orders` random limit orders, timed in parts: replaying them through
+// continuous matching as a crossed book would have to be, collecting them in auction mode, and the
+// single Uncross. Returns ns per order for each part.
+struct AuctionTimes
+{
+    double replay;
+    double collect;
+    double uncross;
+};
+
+AuctionTimes AuctionFlow(std::size_t orders)
+{
+    std::mt19937 rng(18);
+    std::uniform_int_distribution<Price> price(9900, 10100);
+    std::uniform_int_distribution<Quantity> qty(1, 100);
+    std::vector<OrderRequest> flow;
+    flow.reserve(orders);
+    for (std::size_t i = 0; i < orders; ++i)
+    {
+        flow.push_back(OrderRequest{i + 1, i % 2 ? Side::Buy : Side::Sell, price(rng), qty(rng)});
+    }
+    std::size_t trades = 0;
+    auto sink = [&trades](const Trade &)
+    { ++trades; };
+    auto elapsed = [orders](Clock::time_point start)
+    { return std::chrono::duration<double, std::nano>(Clock::now() - start).count() / orders; };
+
+    AuctionTimes times{};
+    Orderbook continuous(orders + 64);
+    auto start = Clock::now();
+    for (const OrderRequest &request : flow)
+    {
+        continuous.AddOrder(request.id, request.side, request.price, request.quantity, sink);
+    }
+    times.replay = elapsed(start);
+
+    Orderbook auction(orders + 64);
+    auction.StartAuction();
+    start = Clock::now();
+    for (const OrderRequest &request : flow)
+    {
+        auction.AddOrder(request.id, request.side, request.price, request.quantity, sink);
+    }
+    times.collect = elapsed(start);
+    start = Clock::now();
+    auction.Uncross(sink);
+    times.uncross = elapsed(start);
+    return times;
+}
+
+void BenchCallAuction()
+{
+    std::printf("\n=== Opening auction: continuous replay vs collect + Uncross (ns per order) ===\n");
+    std::printf("%8s | %10s %10s %10s\n", "orders", "replay", "collect", "uncross");
+    for (const std::size_t orders : {1'000, 10'000, 100'000, 1'000'000})
+    {
+        AuctionTimes best{1e9, 1e9, 1e9};
+        for (int repeat = 0; repeat < 3; ++repeat)
+        {
+            const AuctionTimes times = AuctionFlow(orders);
+            best.replay = std::min(best.replay, times.replay);
+            best.collect = std::min(best.collect, times.collect);
+            best.uncross = std::min(best.uncross, times.uncross);
+        }
+        std::printf("%8zu | %10.1f %10.1f %10.1f\n", orders, best.replay, best.collect, best.uncross);
+    }
+}
+
+// End of session with `orders` day orders resting across 200 levels a side: the gateway
+// cancelling them one by one, against one ExpireDayOrders sweep. Returns ns per order.
+double DayPurge(std::size_t orders, bool sweep)
+{
+    Orderbook book(orders + 64);
+    for (std::size_t i = 0; i < orders; ++i)
+    {
+        const bool buy = i % 2 == 0;
+        book.AddOrder(i + 1, buy ? Side::Buy : Side::Sell, buy ? 9999 - Price(i % 200) : 10001 + Price(i % 200), 1,
+                      TimeInForce::Day);
+    }
+    const auto start = Clock::now();
+    if (sweep)
+    {
+        book.ExpireDayOrders();
+    }
+    else
+    {
+        for (std::size_t i = 0; i < orders; ++i)
+        {
+            book.CancelOrder(i + 1);
+        }
+    }
+    return std::chrono::duration<double, std::nano>(Clock::now() - start).count() / orders;
+}
+
+void BenchDayPurge()
+{
+    std::printf("\n=== End-of-day purge: CancelOrder per order vs ExpireDayOrders (ns per order) ===\n");
+    std::printf("%8s | %10s %10s\n", "orders", "cancels", "sweep");
+    for (const std::size_t orders : {10'000, 100'000, 300'000})
+    {
+        std::printf("%8zu | %10.1f %10.1f\n", orders, DayPurge(orders, false), DayPurge(orders, true));
+    }
+}
+
+// `orders` resting across 200 levels a side, spread round-robin over 100 owners. Pulls the
+// bid side with one CancelOrder per order (in arrival order) or with CancelSide, or one owner
+// with CancelOwner. Interleaved, consecutive orders go to different levels, so a level's orders
+// are scattered over the pool; grouped, each level's orders arrived together. Returns ns per
+// order pulled.
+enum class Pull
+{
+    Cancels,
+    Side,
+    Owner
+};
+
+double BulkCancel(std::size_t orders, bool grouped, Pull pull)
+{
+    constexpr OwnerId Owners = 100;
+    Orderbook book(orders + 64);
+    for (std::size_t i = 0; i < orders; ++i)
+    {
+        const bool buy = i % 2 == 0;
+        const Price offset = grouped ? Price(i * 200 / orders) : Price(i % 400 / 2);
+        book.AddOrder(OrderRequest{.id = i + 1,
+                                   .side = buy ? Side::Buy : Side::Sell,
+                                   .price = buy ? 9999 - offset : 10001 + offset,
+                                   .quantity = 1,
+                                   .owner = static_cast<OwnerId>(1 + i % Owners)});
+    }
+    std::size_t pulled = 0;
+    const auto start = Clock::now();
+    switch (pull)
+    {
+    case Pull::Cancels:
+        for (std::size_t i = 0; i < orders; i += 2)
+        {
+            pulled += book.CancelOrder(i + 1);
+        }
+        break;
+    case Pull::Side:
+        pulled = book.CancelSide(Side::Buy);
+        break;
+    case Pull::Owner:
+        pulled = book.CancelOwner(1);
+        break;
+    }
+    return std::chrono::duration<double, std::nano>(Clock::now() - start).count() / pulled;
+}
+
+void BenchBulkCancel()
+{
+    std::printf("\n=== Bulk cancel: a side by CancelOrder vs CancelSide, one owner of 100 by CancelOwner (ns per order) ===\n");
+    std::printf("%8s %12s | %10s %10s %10s\n", "orders", "levels", "cancels", "side", "owner");
+    for (const std::size_t orders : {10'000, 100'000, 300'000})
+    {
+        for (const bool grouped : {false, true})
+        {
+            std::printf("%8zu %12s | %10.1f %10.1f %10.1f\n", orders, grouped ? "grouped" : "interleaved",
+                        BulkCancel(orders, grouped, Pull::Cancels), BulkCancel(orders, grouped, Pull::Side),
+                        BulkCancel(orders, grouped, Pull::Owner));
+        }
+    }
+}
+
+// Order flow over many symbols, each symbol picked by symbolOf(rng): per symbol, passive orders
+// around 10000 on both sides, one in eight marketable, one in eight a cancel of an order
+// that symbol added earlier (which may have filled already).
+template <typename SymbolOf>
+std::vector<OrderCommand> MultiSymbolFlow(std::size_t symbols, std::size_t orders, SymbolOf symbolOf)
+{
+    std::mt19937 rng(11);
+    std::vector<OrderId> nextId(symbols, 1);
+    std::vector<OrderCommand> flow;
+    flow.reserve(orders);
+    for (std::size_t i = 0; i < orders; ++i)
+    {
+        const SymbolId symbol = symbolOf(rng);
+        const OrderId id = nextId[symbol]++;
+        if (id > 8 && rng() % 8 == 0)
+        {
+            flow.push_back({CommandType::Cancel, symbol, {.id = id - 1 - rng() % 8}});
+            continue;
+        }
+        const Side side = rng() % 2 ? Side::Buy : Side::Sell;
+        const bool marketable = rng() % 8 == 0;
+        const Price offset = marketable ? -2 : static_cast<Price>(1 + rng() % 8);
+        flow.push_back({CommandType::Add, symbol,
+                        {.id = id, .side = side, .price = side == Side::Buy ? 10000 - offset : 10000 + offset,
+                         .quantity = 1 + static_cast<Quantity>(rng() % 5)}});
+    }
+    return flow;
+}
+
+// Submits the whole flow from this thread and waits for the shards to apply it.
+// Returns millions of commands per second, end to end.
+double EngineFlow(const std::vector<OrderCommand> &flow, std::size_t symbols, std::size_t shards)
+{
+    MatchingEngine<> engine(EngineConfig{.symbols = symbols, .shards = shards});
+    const auto start = Clock::now();
+    for (const OrderCommand &command : flow)
+    {
+        engine.Submit(command);
+    }
+    engine.Drain();
+    return flow.size() / std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+}
+
+// the same flow applied straight to the books on this thread, for reference
+double DirectFlow(const std::vector<OrderCommand> &flow, std::size_t symbols)
+{
+    std::vector<Orderbook<>> books(symbols);
+    auto ignore = [](const Trade &) {};
+    const auto start = Clock::now();
+    for (const OrderCommand &command : flow)
+    {
+        Orderbook<> &book = books[command.symbol];
+        if (command.type == CommandType::Add)
+            book.AddOrder(command.order, ignore);
+        else
+            book.CancelOrder(command.order.id);
+    }
+    return flow.size() / std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+}
+
+void BenchShardedEngine()
+{
+    constexpr std::size_t Symbols = 5000;
+    const auto flow = MultiSymbolFlow(Symbols, 2'000'000, [](std::mt19937 &rng)
+                                      { return static_cast<SymbolId>(rng() % Symbols); });
+    std::printf("\n=== Sharded engine: %zu symbols, uniform flow (%u hardware threads) ===\n", Symbols,
+                std::thread::hardware_concurrency());
+    std::printf("%8s | %14s\n", "shards", "Mcommands/s");
+    std::printf("%8s | %14.2f\n", "direct", DirectFlow(flow, Symbols));
+    for (const std::size_t shards : {1, 2, 4, 8})
+    {
+        std::printf("%8zu | %14.2f\n", shards, EngineFlow(flow, Symbols, shards));
+    }
+}
+
+// Two threads over one ring of order commands: this one pushes, publishing every publishEvery
+// pushes, the other consumes in batches of up to 256. Returns millions of messages per second.
+template <WaitStrategy Wait>
+double RingThroughput(std::size_t messages, std::size_t publishEvery)
+{
+    auto ring = std::make_unique<SpscRing<OrderCommand, 1 << 14>>();
+    std::uint64_t checksum = 0;
+    const auto start = Clock::now();
+    std::thread consumer([&ring, &checksum, messages]
+                         {
+        const Wait wait;
+        for (std::size_t seen = 0, idle = 0; seen < messages;)
+        {
+            const std::size_t n = ring->Consume([&checksum](const OrderCommand &command)
+                                                { checksum += command.order.id; }, 256);
+            seen += n;
+            if (n == 0)
+                wait(static_cast<std::uint32_t>(idle++));
+            else
+                idle = 0;
+        } });
+    const Wait wait;
+    OrderCommand command{CommandType::Add, 0, {.side = Side::Buy, .price = 10000, .quantity = 1}};
+    for (std::size_t i = 0; i < messages; ++i)
+    {
+        command.order.id = i;
+        for (std::uint32_t idle = 0; !ring->TryPush(command); ++idle)
+        {
+            ring->Publish();
+            wait(idle);
+        }
+        if ((i + 1) % publishEvery == 0)
+        {
+            ring->Publish();
+        }
+    }
+    ring->Publish();
+    consumer.join();
+    const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    if (checksum != messages * (messages - 1) / 2)
+    {
+        std::printf("ring lost messages\n");
+    }
+    return messages / seconds / 1e6;
+}
+
+// Ping-pong over two rings: stamp a message, the other thread echoes it back, time the round
+// trip. Returns the sorted round trips in ns.
+template <WaitStrategy Wait>
+std::vector<double> RingRoundTrips(std::size_t trips)
+{
+    auto ping = std::make_unique<SpscRing<std::uint64_t, 1024>>();
+    auto pong = std::make_unique<SpscRing<std::uint64_t, 1024>>();
+    std::thread echo([&ping, &pong, trips]
+                     {
+        const Wait wait;
+        for (std::size_t done = 0, idle = 0; done < trips;)
+        {
+            const std::size_t n = ping->Consume([&pong](std::uint64_t value)
+                                                { pong->TryPush(value); });
+            if (n == 0)
+            {
+                wait(static_cast<std::uint32_t>(idle++));
+                continue;
+            }
+            pong->Publish();
+            done += n;
+            idle = 0;
+        } });
+    const Wait wait;
+    std::vector<double> rtt;
+    rtt.reserve(trips);
+    for (std::size_t i = 0; i < trips; ++i)
+    {
+        const auto sent = Clock::now();
+        ping->TryPush(i);
+        ping->Publish();
+        for (std::uint32_t idle = 0; pong->Consume([](std::uint64_t) {}) == 0; ++idle)
+        {
+            wait(idle);
+        }
+        rtt.push_back(std::chrono::duration<double, std::nano>(Clock::now() - sent).count());
+    }
+    echo.join();
+    std::sort(rtt.begin(), rtt.end());
+    return rtt;
+}
+
+void BenchSpscRing()
+{
+    constexpr std::size_t Messages = 10'000'000;
+    std::printf("\n=== SPSC ring, two threads (%u hardware threads) ===\n", std::thread::hardware_concurrency());
+    std::printf("%-16s %8s | %12s\n", "wait", "publish", "Mmsg/s");
+    for (const std::size_t every : {1, 64})
+    {
+        std::printf("%-16s %8zu | %12.1f\n", "SpinThenYield", every, RingThroughput<SpinThenYield>(Messages, every));
+    }
+    const bool spare = std::thread::hardware_concurrency() >= 2;
+    if (spare)
+    {
+        std::printf("%-16s %8d | %12.1f\n", "BusySpin", 64, RingThroughput<BusySpin>(Messages, 64));
+    }
+
+    auto report = [](const char *name, const std::vector<double> &rtt)
+    {
+        auto at = [&rtt](double q)
+        { return rtt[std::min(rtt.size() - 1, static_cast<std::size_t>(q * rtt.size()))]; };
+        std::printf("%-16s | %9.0f %9.0f %9.0f %9.0f\n", name, at(0.5), at(0.99), at(0.999), rtt.back());
+    };
+    std::printf("\nround trip (ns)  | %9s %9s %9s %9s\n", "p50", "p99", "p99.9", "max");
+    report("SpinThenYield", RingRoundTrips<SpinThenYield>(100'000));
+    if (spare)
+    {
+        report("BusySpin", RingRoundTrips<BusySpin>(100'000));
+    }
+    else
+    {
+        std::printf("(BusySpin needs a core per thread, skipped)\n");
+    }
+}
+
+struct CountEvents
+{
+    std::uint64_t events = 0;
+    void operator()(const PipelineEvent &) { ++events; }
+};
+
+// One symbol's flow as wire messages, through the five-stage pipeline in gateway batches of 64,
+// against decoding and applying the same messages straight to a book on this thread.
+// Returns millions of messages per second.
+template <WaitStrategy Wait>
+double PipelineFlow(const std::vector<WireMessage> &wire)
+{
+    OrderPipeline<CountEvents, CountEvents, Wait> pipeline(PipelineConfig{.slots = 1 << 14});
+    const auto start = Clock::now();
+    for (std::size_t first = 0; first < wire.size(); first += 64)
+    {
+        pipeline.Submit(std::span<const WireMessage>(wire.data() + first, std::min<std::size_t>(64, wire.size() - first)));
+    }
+    pipeline.Drain();
+    return wire.size() / std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+}
+
+double InlineFlow(const std::vector<WireMessage> &wire)
+{
+    Orderbook<> book;
+    auto ignore = [](const Trade &) {};
+    const auto start = Clock::now();
+    for (const WireMessage &message : wire)
+    {
+        OrderCommand command{};
+        std::memcpy(&command.order.id, message.bytes.data(), sizeof(OrderId));
+        std::memcpy(&command.order.price, message.bytes.data() + 16, sizeof(Price));
+        std::memcpy(&command.order.quantity, message.bytes.data() + 20, sizeof(Quantity));
+        std::memcpy(&command.type, message.bytes.data() + 32, 1);
+        std::memcpy(&command.order.side, message.bytes.data() + 33, 1);
+        if (command.type == CommandType::Add)
+            book.AddOrder(command.order, ignore);
+        else
+            book.CancelOrder(command.order.id);
+    }
+    return wire.size() / std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+}
+
+void BenchPipeline()
+{
+    const auto flow = MultiSymbolFlow(1, 2'000'000, [](std::mt19937 &)
+                                      { return SymbolId{0}; });
+    std::vector<WireMessage> wire;
+    wire.reserve(flow.size());
+    for (const OrderCommand &command : flow)
+    {
+        wire.push_back(EncodeWire(command));
+    }
+    std::printf("\n=== Staged pipeline, one symbol (%u hardware threads) ===\n", std::thread::hardware_concurrency());
+    std::printf("%-28s | %12s\n", "", "Mmsg/s");
+    std::printf("%-28s | %12.2f\n", "inline, one thread", InlineFlow(wire));
+    std::printf("%-28s | %12.2f\n", "pipeline, SpinThenYield", PipelineFlow<SpinThenYield>(wire));
+    if (std::thread::hardware_concurrency() >= 6)
+    {
+        std::printf("%-28s | %12.2f\n", "pipeline, BusySpin", PipelineFlow<BusySpin>(wire));
+    }
+}
+
+// Symbol s drawn with probability proportional to 1 / (s + 1)^exponent: a few hot symbols and a
+// long quiet tail, the way volume spreads over a real listing. 0 is uniform.
+class ZipfSymbols
+{
+private:
+    std::vector<double> cdf_;
+
+public:
+    ZipfSymbols(std::size_t symbols, double exponent) : cdf_(symbols)
+    {
+        double total = 0;
+        for (std::size_t s = 0; s < symbols; ++s)
+        {
+            total += 1 / std::pow(double(s + 1), exponent);
+            cdf_[s] = total;
+        }
+        for (double &p : cdf_)
+        {
+            p /= total;
+        }
+    }
+
+    SymbolId operator()(std::mt19937 &rng) const
+    {
+        const double u = std::uniform_real_distribution<double>(0, 1)(rng);
+        const auto it = std::lower_bound(cdf_.begin(), cdf_.end(), u);
+        return static_cast<SymbolId>(std::min<std::ptrdiff_t>(it - cdf_.begin(), cdf_.size() - 1));
+    }
+
+    // share of the flow on the hottest symbol
+    double Top() const { return cdf_.front(); }
+};
+
+// EngineFlow for the work-stealing engine; also reports the tasks stolen
+double StealingFlow(const std::vector<OrderCommand> &flow, std::size_t symbols, std::size_t workers, std::uint64_t &steals)
+{
+    WorkStealingEngine<> engine(ExecutorConfig{.symbols = symbols, .workers = workers});
+    const auto start = Clock::now();
+    for (const OrderCommand &command : flow)
+    {
+        engine.Submit(command);
+    }
+    engine.Drain();
+    const double rate = flow.size() / std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+    steals = engine.Steals();
+    return rate;
+}
+
+// Static sharding against work stealing, same flow and thread counts, as the flow gets more
+// skewed: under static sharding the shard holding the hottest symbols bounds the whole engine.
+void BenchWorkStealing()
+{
+    constexpr std::size_t Symbols = 5000;
+    std::printf("\n=== Static shards vs work stealing: %zu symbols, Zipf flow (%u hardware threads) ===\n", Symbols,
+                std::thread::hardware_concurrency());
+    std::printf("%8s %8s | %14s %14s %10s\n", "zipf s", "threads", "sharded Mc/s", "stealing Mc/s", "steals");
+    for (const double exponent : {0.0, 1.0, 1.5})
+    {
+        const ZipfSymbols zipf(Symbols, exponent);
+        const auto flow = MultiSymbolFlow(Symbols, 2'000'000, zipf);
+        std::printf("%8.1f %8s | %14.2f %14s %10s   (hottest symbol: %.1f%% of the flow)\n", exponent, "direct",
+                    DirectFlow(flow, Symbols), "", "", 100 * zipf.Top());
+        for (const std::size_t threads : {1, 2, 4, 8})
+        {
+            std::uint64_t steals = 0;
+            const double sharded = EngineFlow(flow, Symbols, threads);
+            const double stealing = StealingFlow(flow, Symbols, threads, steals);
+            std::printf("%8.1f %8zu | %14.2f %14.2f %10llu\n", exponent, threads, sharded, stealing,
+                        static_cast<unsigned long long>(steals));
+        }
+    }
+}
+
+// How strategy threads read the book while the matching thread works on it
+enum class TopAccess
+{
+    Alone,   // no readers: the matching thread on its own, for reference
+    Mutex,   // one lock around the book, taken for every order and every read
+    Seqlock  // publishTop: readers copy the published TopOfBook, the writer never waits
+};
+
+// One matching thread adding orders of 3 lots around 10000, some crossing, and cancelling about
+// half of them, while `readers` threads read the top 8 levels of both sides as fast as they can.
+// Returns the matching thread's ns per operation; reads gets the total reads.
+double TopOfBookFlow(TopAccess access, std::size_t readers, std::size_t orders, std::uint64_t &reads)
+{
+    Orderbook<> book(OrderbookConfig{.capacity = orders, .publishTop = access == TopAccess::Seqlock});
+    std::mutex mutex;
+    std::atomic<bool> done{false};
+    std::atomic<std::uint64_t> total{0};
+    std::atomic<std::uint64_t> checksums{0}; // keeps the reads from being optimized away
+    std::vector<std::thread> threads;
+    for (std::size_t r = 0; r < readers && access != TopAccess::Alone; ++r)
+    {
+        threads.emplace_back([&]
+                             {
+            std::uint64_t count = 0;
+            std::uint64_t checksum = 0;
+            LevelInfo levels[TopLevels];
+            while (!done.load(std::memory_order_relaxed))
+            {
+                if (access == TopAccess::Mutex)
+                {
+                    const std::lock_guard lock(mutex);
+                    checksum += book.Depth(Side::Buy, levels) + book.Depth(Side::Sell, levels);
+                }
+                else
+                {
+                    checksum += book.ReadTop().version;
+                }
+                ++count;
+            }
+            total.fetch_add(count, std::memory_order_relaxed);
+            checksums.fetch_add(checksum, std::memory_order_relaxed); });
+    }
+    std::mt19937 rng(25);
+    std::vector<OrderRequest> adds(orders);
+    for (std::size_t i = 0; i < orders; ++i)
+    {
+        const Side side = rng() % 2 ? Side::Buy : Side::Sell;
+        adds[i] = {.id = i + 1, .side = side, .price = static_cast<Price>(side == Side::Buy ? 9990 + rng() % 12 : 9999 + rng() % 12),
+                   .quantity = 3};
+    }
+    auto ignore = [](const Trade &) {};
+    std::size_t operations = 0;
+    const auto start = Clock::now();
+    for (std::size_t i = 0; i < orders; ++i)
+    {
+        std::unique_lock lock(mutex, std::defer_lock);
+        if (access == TopAccess::Mutex)
+            lock.lock();
+        book.AddOrder(adds[i], ignore);
+        if (i >= 16 && i % 2 == 0)
+        {
+            book.CancelOrder(adds[i - 16].id);
+            ++operations;
+        }
+        ++operations;
+    }
+    const double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / operations;
+    done.store(true, std::memory_order_relaxed);
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+    reads = total;
+    return ns;
+}
+
+void BenchTopOfBook()
+{
+    constexpr std::size_t Orders = 1'000'000;
+    std::printf("\n=== Top of book for reader threads (%u hardware threads) ===\n", std::thread::hardware_concurrency());
+    std::printf("%8s %8s | %14s %14s\n", "access", "readers", "writer ns/op", "reads");
+    std::uint64_t reads = 0;
+    std::printf("%8s %8d | %14.1f %14s\n", "alone", 0, TopOfBookFlow(TopAccess::Alone, 0, Orders, reads), "-");
+    std::printf("%8s %8d | %14.1f %14s\n", "seqlock", 0, TopOfBookFlow(TopAccess::Seqlock, 0, Orders, reads), "-");
+    for (const std::size_t readers : {1, 2, 4})
+    {
+        const double mutex = TopOfBookFlow(TopAccess::Mutex, readers, Orders, reads);
+        std::printf("%8s %8zu | %14.1f %14llu\n", "mutex", readers, mutex, static_cast<unsigned long long>(reads));
+        const double seqlock = TopOfBookFlow(TopAccess::Seqlock, readers, Orders, reads);
+        std::printf("%8s %8zu | %14.1f %14llu\n", "seqlock", readers, seqlock, static_cast<unsigned long long>(reads));
+    }
+}
+
+int main()
+{
+    BenchFifoFills();
+    BenchLevelContainers();
+    BenchBatchSubmission();
+    BenchOrderIndex();
+    BenchAllocationPolicies();
+    BenchCallAuction();
+    BenchDayPurge();
+    BenchBulkCancel();
+    BenchShardedEngine();
+    BenchSpscRing();
+    BenchPipeline();
+    BenchWorkStealing();
+    BenchTopOfBook();
+    return 0;
+}
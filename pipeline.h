@@ -0,0 +1,408 @@
+/*
+ * Staged order pipeline for one book, disruptor style
+ *
+ * Every order goes through the same preallocated ring of events, identified by a sequence
+ * number, and through one thread per stage:
+ *
+ *   gateway -> decode -> validate/risk -> match -> publish
+ *                                              \-> journal
+ *
+ * The gateway copies the wire message into the next free event; decode turns it into a
+ * command; validate rejects malformed, duplicate, badly priced or over-limit orders; match
+ * applies what is left to the book and records the fills in the event; publish and journal
+ * both read the finished event, side by side. Each stage owns one cursor, the sequence it has
+ * finished, and only waits on the cursor of the stage before it, so there are no locks and no
+ * queues between stages: an event never moves, the stages walk over it in turn. A stage that
+ * finds several events ready handles all of them before advancing its cursor once. The gateway
+ * reuses an event once both publish and journal are past it. Only match touches the book, so it
+ * stays single-writer, and the matching thread does nothing but matching.
+ *
+ * Client ids are expected to grow, as a session's sequence numbers do (gaps are fine). Validate
+ * remembers which of the last PipelineConfig::idWindow ids below the highest one it accepted
+ * have been used, in a fixed bitmap, and rejects anything older as a duplicate it can no longer
+ * tell apart. That keeps its memory fixed however long the session runs, needs nothing back from
+ * match, and still never lets an id through twice, which the book relies on (AddValidated).
+ *
+ * Tests live in orderbook.cpp, benchmarks in orderbook_bench.cpp.
+ */
+
+#pragma once
+
+#include "matching_engine.h"
+#include "orderbook.h"
+#include "spsc_ring.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <span>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+// An order command as it arrives on the wire: fixed size, little-endian, no padding between
+// fields. See EncodeWire.
+struct WireMessage
+{
+    std::array<std::byte, 40> bytes;
+};
+
+// gateway side of the format: id, expiry, price, quantity, display, owner, then one byte each
+// for command type, side, time in force and order type
+inline WireMessage EncodeWire(const OrderCommand &command)
+{
+    WireMessage message{};
+    std::byte *out = message.bytes.data();
+    const OrderRequest &order = command.order;
+    auto put = [&out](const auto &field)
+    {
+        std::memcpy(out, &field, sizeof(field));
+        out += sizeof(field);
+    };
+    put(order.id);
+    put(order.expiry);
+    put(order.price);
+    put(order.quantity);
+    put(order.displayQuantity);
+    put(order.owner);
+    put(command.type);
+    put(order.side);
+    put(order.timeInForce);
+    put(order.type);
+    return message;
+}
+
+enum class Verdict : std::uint8_t
+{
+    Accepted,  // matched; any fills are in the event's trades
+    Malformed, // undecodable, or fields that don't make an order
+    Duplicate, // id already used on this pipeline, or too far behind the newest to tell
+    BadPrice,  // off the tick or outside the price band
+    RiskLimit, // over the quantity or notional limit
+    Refused    // the book said no: cancel or modify of an order that isn't resting
+};
+
+struct PipelineEvent
+{
+    WireMessage wire;
+    OrderCommand command; // decoded; command.symbol is unused
+    Verdict verdict;
+    Trades trades; // fills of this command, reused from event to event
+};
+
+// publish and journal stages: called with every finished event, in sequence order
+template <typename F>
+concept EventHandler = std::invocable<F &, const PipelineEvent &>;
+
+struct PipelineConfig
+{
+    std::size_t slots = 1 << 12; // events in the ring, a power of two
+    OrderbookConfig book = {};   // client ids only
+    // pre-trade risk, per order
+    Quantity maxQuantity = std::numeric_limits<Quantity>::max();
+    std::uint64_t maxNotional = std::numeric_limits<std::uint64_t>::max(); // price * quantity, maxPrice for a market order
+    // price band; limit prices outside it are rejected
+    Price minPrice = 1;
+    Price maxPrice = std::numeric_limits<Price>::max();
+    // duplicate detection: how far below the highest accepted id an id may still come, a power
+    // of two and a multiple of 64. Costs idWindow / 8 bytes.
+    std::size_t idWindow = std::size_t{1} << 20;
+};
+
+template <EventHandler Publish, EventHandler Journal, WaitStrategy Wait = SpinThenYield, typename Book = Orderbook<>>
+class OrderPipeline
+{
+private:
+    // the sequence a stage has finished, alone on its line
+    struct alignas(CacheLine) Cursor
+    {
+        std::atomic<std::int64_t> value{-1};
+    };
+
+    PipelineConfig config_;
+    std::vector<PipelineEvent> events_;
+    std::size_t mask_;
+    Book book_;
+    // ids the validate stage has let through, bit id % idWindow for ids in (newest_ - idWindow, newest_]
+    std::vector<std::uint64_t> seen_;
+    OrderId newest_ = 0;
+    Publish publish_;
+    Journal journal_;
+
+    std::int64_t claimed_ = -1; // gateway's last written sequence
+    Cursor received_;           // published by the gateway
+    Cursor decoded_;
+    Cursor validated_;
+    Cursor matched_;
+    Cursor published_;
+    Cursor journaled_;
+    std::atomic<bool> stopping_{false};
+    std::vector<std::thread> threads_;
+
+    // The loop every stage thread runs: wait for upstream to move past own, handle every event
+    // in between, then advance own once for the lot. Stops when told to and the gateway's last
+    // event has gone through.
+    template <typename Handle>
+    void Stage(const Cursor &upstream, Cursor &own, Handle handle)
+    {
+        const Wait wait;
+        std::int64_t done = own.value.load(std::memory_order_relaxed);
+        for (std::uint32_t idle = 0;;)
+        {
+            const bool stopping = stopping_.load(std::memory_order_acquire);
+            const std::int64_t ready = upstream.value.load(std::memory_order_acquire);
+            if (ready > done)
+            {
+                for (std::int64_t sequence = done + 1; sequence <= ready; ++sequence)
+                {
+                    handle(events_[static_cast<std::size_t>(sequence) & mask_]);
+                }
+                done = ready;
+                own.value.store(done, std::memory_order_release);
+                idle = 0;
+            }
+            else if (stopping && done == received_.value.load(std::memory_order_acquire))
+            {
+                return;
+            }
+            else
+            {
+                wait(idle++);
+            }
+        }
+    }
+
+    static void Decode(PipelineEvent &event)
+    {
+        const std::byte *in = event.wire.bytes.data();
+        OrderRequest &order = event.command.order;
+        auto get = [&in](auto &field)
+        {
+            std::memcpy(&field, in, sizeof(field));
+            in += sizeof(field);
+        };
+        std::uint8_t type, side, tif, orderType;
+        get(order.id);
+        get(order.expiry);
+        get(order.price);
+        get(order.quantity);
+        get(order.displayQuantity);
+        get(order.owner);
+        get(type);
+        get(side);
+        get(tif);
+        get(orderType);
+        event.command.type = static_cast<CommandType>(type);
+        order.side = static_cast<Side>(side);
+        order.timeInForce = static_cast<TimeInForce>(tif);
+        order.type = static_cast<OrderType>(orderType);
+        const bool valid = type <= static_cast<std::uint8_t>(CommandType::Modify) &&
+                           side <= static_cast<std::uint8_t>(Side::Sell) &&
+                           tif <= static_cast<std::uint8_t>(TimeInForce::Day) &&
+                           orderType <= static_cast<std::uint8_t>(OrderType::Market);
+        event.verdict = valid ? Verdict::Accepted : Verdict::Malformed;
+    }
+
+    // clear the bits of count ids from first on, to make room for them
+    void Forget(OrderId first, OrderId count)
+    {
+        const OrderId window = seen_.size() * 64;
+        for (count = std::min(count, window); count != 0;)
+        {
+            const std::size_t bit = static_cast<std::size_t>(first & (window - 1));
+            const OrderId take = std::min<OrderId>(64 - bit % 64, count);
+            const std::uint64_t mask = take == 64 ? ~std::uint64_t{0} : ((std::uint64_t{1} << take) - 1) << (bit % 64);
+            seen_[bit / 64] &= ~mask;
+            first += take;
+            count -= take;
+        }
+    }
+
+    // marks id used; false when it was already, or is too old to know
+    bool Claim(OrderId id)
+    {
+        const OrderId window = seen_.size() * 64;
+        if (id > newest_)
+        {
+            Forget(newest_ + 1, id - newest_);
+            newest_ = id;
+        }
+        else if (newest_ - id >= window)
+        {
+            return false;
+        }
+        std::uint64_t &word = seen_[static_cast<std::size_t>(id & (window - 1)) / 64];
+        const std::uint64_t bit = std::uint64_t{1} << (id % 64);
+        if (word & bit)
+        {
+            return false;
+        }
+        word |= bit;
+        return true;
+    }
+
+    // everything the book would otherwise check itself, plus the risk limits
+    void Validate(PipelineEvent &event)
+    {
+        if (event.verdict != Verdict::Accepted || event.command.type == CommandType::Cancel)
+        {
+            return;
+        }
+        const OrderRequest &order = event.command.order;
+        // a modify to quantity 0 is a cancel: its price is never used, so it isn't checked
+        const bool limit = event.command.type == CommandType::Modify ? order.quantity != 0 : order.type == OrderType::Limit;
+        if (order.quantity == 0 && event.command.type == CommandType::Add)
+        {
+            event.verdict = Verdict::Malformed;
+        }
+        else if (order.timeInForce == TimeInForce::GoodTillDate && order.expiry == 0)
+        {
+            event.verdict = Verdict::Malformed;
+        }
+        else if (limit && (order.price % config_.book.tickSize != 0 || order.price < config_.minPrice ||
+                           order.price > config_.maxPrice))
+        {
+            event.verdict = Verdict::BadPrice;
+        }
+        else if (order.quantity > config_.maxQuantity ||
+                 std::uint64_t(limit ? order.price : config_.maxPrice) * order.quantity > config_.maxNotional)
+        {
+            event.verdict = Verdict::RiskLimit;
+        }
+        else if (event.command.type == CommandType::Add && !Claim(order.id))
+        {
+            event.verdict = Verdict::Duplicate;
+        }
+    }
+
+    void Match(PipelineEvent &event)
+    {
+        event.trades.clear();
+        if (event.verdict != Verdict::Accepted)
+        {
+            return;
+        }
+        auto sink = [&event](const Trade &trade)
+        { event.trades.push_back(trade); };
+        // validate has done the book's own tick, expiry and duplicate checks already
+        bool applied = false;
+        try
+        {
+            const OrderRequest &order = event.command.order;
+            switch (event.command.type)
+            {
+            case CommandType::Add:
+                applied = book_.AddValidated(order, sink);
+                break;
+            case CommandType::Cancel:
+                applied = book_.CancelOrder(order.id);
+                break;
+            case CommandType::Modify:
+                applied = book_.ModifyValidated(order.id, order.price, order.quantity, sink);
+                break;
+            }
+        }
+        catch (const std::exception &)
+        {
+        }
+        if (!applied)
+        {
+            event.verdict = Verdict::Refused;
+        }
+    }
+
+public:
+    explicit OrderPipeline(const PipelineConfig &config = {}, const Publish &publish = {}, const Journal &journal = {})
+        : config_(config), events_(config.slots), mask_(config.slots - 1), book_(config.book),
+          seen_(config.idWindow / 64), publish_(publish), journal_(journal)
+    {
+        if (!std::has_single_bit(config.slots))
+        {
+            throw std::invalid_argument("pipeline slots must be a power of two");
+        }
+        if (!std::has_single_bit(config.idWindow) || config.idWindow < 64)
+        {
+            throw std::invalid_argument("pipeline id window must be a power of two of at least 64");
+        }
+        if (config.book.engineIds)
+        {
+            throw std::invalid_argument("the pipeline takes client order ids");
+        }
+        threads_.emplace_back([this]
+                              { Stage(received_, decoded_, [](PipelineEvent &event)
+                                      { Decode(event); }); });
+        threads_.emplace_back([this]
+                              { Stage(decoded_, validated_, [this](PipelineEvent &event)
+                                      { Validate(event); }); });
+        threads_.emplace_back([this]
+                              { Stage(validated_, matched_, [this](PipelineEvent &event)
+                                      { Match(event); }); });
+        threads_.emplace_back([this]
+                              { Stage(matched_, published_, [this](const PipelineEvent &event)
+                                      { publish_(event); }); });
+        threads_.emplace_back([this]
+                              { Stage(matched_, journaled_, [this](const PipelineEvent &event)
+                                      { journal_(event); }); });
+    }
+
+    OrderPipeline(const OrderPipeline &) = delete;
+    OrderPipeline &operator=(const OrderPipeline &) = delete;
+
+    // lets every event already submitted through all the stages, then stops them
+    ~OrderPipeline()
+    {
+        stopping_.store(true, std::memory_order_release);
+        for (std::thread &thread : threads_)
+        {
+            thread.join();
+        }
+    }
+
+    // Gateway: copy a batch of wire messages into the ring and hand them to decode with one
+    // store, waiting for free events if the downstream stages are a whole ring behind.
+    // Call from one thread.
+    void Submit(std::span<const WireMessage> messages)
+    {
+        const Wait wait;
+        for (const WireMessage &message : messages)
+        {
+            const std::int64_t sequence = ++claimed_;
+            const std::int64_t reusable = sequence - static_cast<std::int64_t>(events_.size());
+            for (std::uint32_t idle = 0;
+                 std::min(published_.value.load(std::memory_order_acquire),
+                          journaled_.value.load(std::memory_order_acquire)) < reusable;
+                 ++idle)
+            {
+                received_.value.store(sequence - 1, std::memory_order_release); // let the stages catch up
+                wait(idle);
+            }
+            events_[static_cast<std::size_t>(sequence) & mask_].wire = message;
+        }
+        received_.value.store(claimed_, std::memory_order_release);
+    }
+
+    void Submit(const WireMessage &message)
+    {
+        Submit(std::span<const WireMessage>(&message, 1));
+    }
+
+    // wait until publish and journal have seen every event submitted so far
+    void Drain() const
+    {
+        while (std::min(published_.value.load(std::memory_order_acquire),
+                        journaled_.value.load(std::memory_order_acquire)) < claimed_)
+        {
+            std::this_thread::yield();
+        }
+    }
+
+    // the book, for reading once the pipeline is quiet: after Drain, with nothing submitted since
+    const Book &book() const { return book_; }
+    const Publish &publisher() const { return publish_; }
+    const Journal &journal() const { return journal_; }
+};
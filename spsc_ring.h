@@ -0,0 +1,162 @@
+/*
+ * Bounded single-producer/single-consumer ring buffer, and wait strategies for polling one
+ *
+ * One thread pushes, one other thread pops, and neither ever takes a lock or does a
+ * read-modify-write: each side owns one index and only reads the other's. The two indices live
+ * on separate cache lines, each next to a private copy of the other side's index, so a push
+ * only touches the consumer's line when the copy says the ring looks full, and a pop only
+ * touches the producer's line when it looks empty. Both sides publish their index once per
+ * batch rather than once per element: pushes become visible on Publish, and Consume hands
+ * back all the slots it read in one store.
+ *
+ * Tests live in orderbook.cpp, benchmarks in orderbook_bench.cpp.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <type_traits>
+
+// keeps the two sides' indices (and whatever follows the ring) off each other's lines
+inline constexpr std::size_t CacheLine = 64;
+
+template <typename T, std::size_t Capacity>
+class SpscRing
+{
+    static_assert(std::has_single_bit(Capacity), "capacity must be a power of two");
+    static_assert(std::is_trivially_copyable_v<T>, "elements are copied in and out by value");
+
+private:
+    static constexpr std::uint64_t Mask = Capacity - 1;
+
+    // producer's line: the published tail, what it has written beyond it, its view of head
+    alignas(CacheLine) std::atomic<std::uint64_t> tail_{0};
+    std::uint64_t written_ = 0;
+    std::uint64_t cachedHead_ = 0;
+
+    // consumer's line
+    alignas(CacheLine) std::atomic<std::uint64_t> head_{0};
+    std::uint64_t cachedTail_ = 0;
+
+    alignas(CacheLine) T slots_[Capacity];
+
+public:
+    static constexpr std::size_t capacity() { return Capacity; }
+
+    // Producer: write value into the next slot, visible to the consumer from the next Publish.
+    // Returns false, writing nothing, when the ring is full.
+    bool TryPush(const T &value)
+    {
+        if (written_ - cachedHead_ == Capacity)
+        {
+            cachedHead_ = head_.load(std::memory_order_acquire);
+            if (written_ - cachedHead_ == Capacity)
+            {
+                return false;
+            }
+        }
+        slots_[written_++ & Mask] = value;
+        return true;
+    }
+
+    // Producer: make every push so far visible, with one store.
+    void Publish()
+    {
+        tail_.store(written_, std::memory_order_release);
+    }
+
+    // Producer: pushes since the last Publish.
+    std::size_t Unpublished() const
+    {
+        return static_cast<std::size_t>(written_ - tail_.load(std::memory_order_relaxed));
+    }
+
+    // Consumer: calls fn on up to max published elements in order, then frees their slots with
+    // one store. Returns how many it consumed. The tail is only reread once the elements seen
+    // at the last read are used up, so a call may leave newer ones for the next.
+    template <typename Fn>
+    std::size_t Consume(Fn &&fn, std::size_t max = Capacity)
+    {
+        const std::uint64_t head = head_.load(std::memory_order_relaxed);
+        if (cachedTail_ == head)
+        {
+            cachedTail_ = tail_.load(std::memory_order_acquire);
+            if (cachedTail_ == head)
+            {
+                return 0;
+            }
+        }
+        const std::uint64_t end = head + std::min<std::uint64_t>(cachedTail_ - head, max);
+        for (std::uint64_t i = head; i != end; ++i)
+        {
+            fn(slots_[i & Mask]);
+        }
+        head_.store(end, std::memory_order_release);
+        return static_cast<std::size_t>(end - head);
+    }
+
+    // Any thread: whether every published element has been consumed, as of the two loads.
+    // Touches neither side's private state, so it is safe while another thread consumes.
+    bool Empty() const
+    {
+        return tail_.load(std::memory_order_acquire) == head_.load(std::memory_order_acquire);
+    }
+};
+
+// Wait strategies: what a thread polling a ring does after `idle` polls in a row found nothing.
+// Called with 0, 1, 2... and the count restarts as soon as a poll finds work.
+template <typename W>
+concept WaitStrategy = std::default_initializable<W> && std::invocable<const W &, std::uint32_t>;
+
+inline void CpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+// lowest latency; burns its core whether there is work or not
+struct BusySpin
+{
+    void operator()(std::uint32_t) const { CpuRelax(); }
+};
+
+// spins for a while, then gives the core away between polls
+struct SpinThenYield
+{
+    static constexpr std::uint32_t Spins = 256;
+
+    void operator()(std::uint32_t idle) const
+    {
+        if (idle < Spins)
+            CpuRelax();
+        else
+            std::this_thread::yield();
+    }
+};
+
+// spins, yields, then sleeps: for rings that are quiet most of the time
+struct SpinYieldSleep
+{
+    static constexpr std::uint32_t Spins = 256;
+    static constexpr std::uint32_t Yields = 256;
+
+    void operator()(std::uint32_t idle) const
+    {
+        if (idle < Spins)
+            CpuRelax();
+        else if (idle < Spins + Yields)
+            std::this_thread::yield();
+        else
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+};
@@ -0,0 +1,349 @@
+/*
+ * Multi-symbol matching engine with work stealing
+ *
+ * The sharded engine (matching_engine.h) fixes each symbol to one thread, which is as fast as it
+ * gets while the load is even and leaves cores idle while one hot symbol buries its shard. This
+ * one keeps the same single-writer books but lets the symbols move: each symbol has its own small
+ * inbox ring, and a symbol with commands waiting is a task, queued on a worker. A worker takes the
+ * oldest task from its own queue, or steals the oldest from another worker's when its own is
+ * empty, applies up to one batch of that symbol's commands, and queues the symbol again if more
+ * are waiting.
+ *
+ * A symbol's scheduled flag is set by whoever queues it and cleared by the worker that ran it, so
+ * a symbol is queued at most once and run by at most one worker at a time: its book stays
+ * single-writer and its inbox single-consumer, the consumer end simply changing threads between
+ * batches. Commands of one symbol are applied in submission order, as they come out of one ring.
+ * After clearing the flag the worker looks at the inbox again, and the gateway looks at the flag
+ * after publishing, so a command published while the last batch ran is never left unscheduled.
+ *
+ * Tests live in orderbook.cpp, benchmarks in orderbook_bench.cpp.
+ */
+
+#pragma once
+
+#include "matching_engine.h"
+#include "orderbook.h"
+#include "spsc_ring.h"
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+struct ExecutorConfig
+{
+    std::size_t symbols = 0;   // symbol ids are 0 .. symbols - 1
+    std::size_t workers = 0;   // worker threads; 0: one per hardware thread
+    bool pinThreads = true;    // pin worker i to core i (modulo the cores there are)
+    OrderbookConfig book = {}; // every book is built with this; client ids only
+};
+
+// Sink: called with every trade on the thread of the worker that matched it. Each worker has its
+// own copy; the batches of one symbol may run on different workers, one at a time and in order.
+// Wait: what an idle worker does between looks at the queues, and what Submit does while a
+// symbol's inbox is full.
+template <SymbolTradeSink Sink = IgnoreTrades, WaitStrategy Wait = SpinThenYield, typename Book = Orderbook<>>
+class WorkStealingEngine
+{
+public:
+    // per symbol, so they stay small: a busy symbol is queued again after every TaskBatch rather
+    // than waiting for its inbox to fill
+    static constexpr std::size_t InboxSlots = 64;
+    static constexpr std::size_t PublishEvery = 16;
+    static constexpr std::size_t TaskBatch = 64;
+
+private:
+    struct Symbol
+    {
+        SpscRing<OrderCommand, InboxSlots> inbox;
+        // from the moment the symbol is queued until the worker that takes it is done with it
+        alignas(CacheLine) std::atomic<bool> scheduled{false};
+        bool listed = false; // gateway's: in flush_, with commands not yet published
+        Book book;
+
+        explicit Symbol(const OrderbookConfig &config) : book(config) {}
+    };
+
+    // One worker thread and its task queue. The queue is a ring as long as there are symbols,
+    // which is always enough: a symbol is on one queue at most once. Thieves read queued without
+    // the lock to skip empty queues; a task is a whole batch, so the lock is paid once per batch.
+    struct Worker
+    {
+        std::mutex mutex;
+        std::vector<SymbolId> queue;
+        std::size_t front = 0;
+        std::atomic<std::size_t> queued{0};
+        alignas(CacheLine) std::atomic<std::uint64_t> processed{0};
+        std::atomic<std::uint64_t> rejected{0};
+        std::atomic<std::uint64_t> stolen{0};
+        Sink sink;
+        std::thread thread;
+
+        Worker(std::size_t symbols, const Sink &sink) : queue(symbols), sink(sink) {}
+    };
+
+    std::vector<std::unique_ptr<Symbol>> symbols_;
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::vector<SymbolId> flush_; // gateway's: symbols with unpublished commands
+    std::uint64_t submitted_ = 0; // gateway's
+    std::atomic<bool> stopping_{false};
+
+    static void Push(Worker &worker, SymbolId id)
+    {
+        const std::lock_guard lock(worker.mutex);
+        const std::size_t queued = worker.queued.load(std::memory_order_relaxed);
+        worker.queue[(worker.front + queued) % worker.queue.size()] = id;
+        worker.queued.store(queued + 1, std::memory_order_relaxed);
+    }
+
+    static bool Pop(Worker &worker, SymbolId &id)
+    {
+        if (worker.queued.load(std::memory_order_relaxed) == 0)
+        {
+            return false;
+        }
+        const std::lock_guard lock(worker.mutex);
+        const std::size_t queued = worker.queued.load(std::memory_order_relaxed);
+        if (queued == 0)
+        {
+            return false;
+        }
+        id = worker.queue[worker.front];
+        worker.front = (worker.front + 1) % worker.queue.size();
+        worker.queued.store(queued - 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Queue the symbol on worker unless it is queued or running already. Callers have just made
+    // commands visible and fenced, so whoever clears the flag next is sure to see them.
+    static void Schedule(Symbol &symbol, SymbolId id, Worker &worker)
+    {
+        if (!symbol.scheduled.load(std::memory_order_relaxed) &&
+            !symbol.scheduled.exchange(true, std::memory_order_acq_rel))
+        {
+            Push(worker, id);
+        }
+    }
+
+    // gateway: hand the symbol's pushed commands to the workers
+    void Publish(Symbol &symbol, SymbolId id)
+    {
+        symbol.inbox.Publish();
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        Schedule(symbol, id, *workers_[HomeOf(id)]);
+    }
+
+    // own queue first, then the others', starting from the next worker along
+    bool Take(std::size_t index, SymbolId &id)
+    {
+        if (Pop(*workers_[index], id))
+        {
+            return true;
+        }
+        for (std::size_t i = 1; i < workers_.size(); ++i)
+        {
+            if (Pop(*workers_[(index + i) % workers_.size()], id))
+            {
+                workers_[index]->stolen.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // one batch of the symbol's commands; a rejected command is counted and otherwise dropped
+    void RunTask(Worker &worker, SymbolId id)
+    {
+        Symbol &symbol = *symbols_[id];
+        auto sink = [&worker, id](const Trade &trade)
+        { worker.sink(id, trade); };
+        std::uint64_t rejected = 0;
+        const std::size_t applied = symbol.inbox.Consume([&symbol, &sink, &rejected](const OrderCommand &command)
+                                                         { rejected += !ApplyCommand(symbol.book, command, sink); },
+                                                         TaskBatch);
+        if (rejected != 0)
+        {
+            worker.rejected.fetch_add(rejected, std::memory_order_relaxed);
+        }
+        worker.processed.fetch_add(applied, std::memory_order_release);
+        // let go of the symbol, then look again: the gateway may have published after the batch
+        // was read and found the symbol still scheduled. From here on another worker may own
+        // the inbox, so only look at it through Empty.
+        symbol.scheduled.store(false, std::memory_order_release);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!symbol.inbox.Empty())
+        {
+            Schedule(symbol, id, worker);
+        }
+    }
+
+    void Run(std::size_t index)
+    {
+        Worker &worker = *workers_[index];
+        const Wait wait;
+        for (std::uint32_t idle = 0;;)
+        {
+            // read before looking: the destructor drains everything before it stops the workers
+            const bool stopping = stopping_.load(std::memory_order_acquire);
+            SymbolId id;
+            if (Take(index, id))
+            {
+                RunTask(worker, id);
+                idle = 0;
+            }
+            else if (stopping)
+            {
+                return;
+            }
+            else
+            {
+                wait(idle++);
+            }
+        }
+    }
+
+public:
+    explicit WorkStealingEngine(const ExecutorConfig &config, const Sink &sink = {})
+    {
+        if (config.book.engineIds)
+        {
+            throw std::invalid_argument("the engine routes client order ids");
+        }
+        symbols_.reserve(config.symbols);
+        for (std::size_t symbol = 0; symbol < config.symbols; ++symbol)
+        {
+            symbols_.push_back(std::make_unique<Symbol>(config.book));
+        }
+        flush_.reserve(config.symbols);
+        const std::size_t workers = config.workers != 0 ? config.workers
+                                                        : std::max(1u, std::thread::hardware_concurrency());
+        workers_.reserve(workers);
+        for (std::size_t i = 0; i < workers; ++i)
+        {
+            workers_.push_back(std::make_unique<Worker>(std::max<std::size_t>(1, config.symbols), sink));
+        }
+        for (std::size_t i = 0; i < workers; ++i)
+        {
+            Worker &worker = *workers_[i];
+            worker.thread = std::thread([this, i]
+                                        { Run(i); });
+            if (config.pinThreads)
+            {
+                PinToCore(worker.thread, i);
+            }
+        }
+    }
+
+    WorkStealingEngine(const WorkStealingEngine &) = delete;
+    WorkStealingEngine &operator=(const WorkStealingEngine &) = delete;
+
+    // applies everything already submitted, then stops the workers
+    ~WorkStealingEngine()
+    {
+        Drain();
+        stopping_.store(true, std::memory_order_release);
+        for (const auto &worker : workers_)
+        {
+            worker->thread.join();
+        }
+    }
+
+    std::size_t Symbols() const { return symbols_.size(); }
+    std::size_t Workers() const { return workers_.size(); }
+
+    // the worker a symbol is queued on by the gateway; it runs wherever a worker is free
+    std::size_t HomeOf(SymbolId symbol) const { return symbol % workers_.size(); }
+
+    // Queue command for its symbol; commands for one symbol are applied in the order they were
+    // submitted. Submit, Flush and Drain are the gateway: call them from one thread. A symbol's
+    // commands reach the workers every PublishEvery of them, or on Flush. Waits while the
+    // symbol's inbox is full.
+    void Submit(const OrderCommand &command)
+    {
+        if (command.symbol >= symbols_.size())
+        {
+            throw std::out_of_range("unknown symbol");
+        }
+        Symbol &symbol = *symbols_[command.symbol];
+        const Wait wait;
+        for (std::uint32_t idle = 0; !symbol.inbox.TryPush(command); ++idle)
+        {
+            Publish(symbol, command.symbol);
+            wait(idle);
+        }
+        ++submitted_;
+        if (symbol.inbox.Unpublished() == PublishEvery)
+        {
+            Publish(symbol, command.symbol);
+        }
+        else if (!symbol.listed)
+        {
+            symbol.listed = true;
+            flush_.push_back(command.symbol);
+        }
+    }
+
+    // hand every command submitted so far to the workers, e.g. at the end of each gateway read
+    void Flush()
+    {
+        for (const SymbolId id : flush_)
+        {
+            Symbol &symbol = *symbols_[id];
+            symbol.listed = false;
+            if (symbol.inbox.Unpublished() != 0)
+            {
+                Publish(symbol, id);
+            }
+        }
+        flush_.clear();
+    }
+
+    // wait until every command submitted so far has been applied
+    void Drain()
+    {
+        Flush();
+        for (;;)
+        {
+            std::uint64_t processed = 0;
+            for (const auto &worker : workers_)
+            {
+                processed += worker->processed.load(std::memory_order_acquire);
+            }
+            if (processed >= submitted_)
+            {
+                return;
+            }
+            std::this_thread::yield();
+        }
+    }
+
+    // commands that were dropped: duplicate ids, unknown orders, invalid prices...
+    std::uint64_t Rejected() const
+    {
+        std::uint64_t rejected = 0;
+        for (const auto &worker : workers_)
+        {
+            rejected += worker->rejected.load(std::memory_order_relaxed);
+        }
+        return rejected;
+    }
+
+    // tasks a worker took from another worker's queue
+    std::uint64_t Steals() const
+    {
+        std::uint64_t stolen = 0;
+        for (const auto &worker : workers_)
+        {
+            stolen += worker->stolen.load(std::memory_order_relaxed);
+        }
+        return stolen;
+    }
+
+    // A symbol's book, for reading once the engine is quiet: only after Drain, with nothing
+    // submitted since. Whichever worker runs the symbol owns it the rest of the time.
+    const Book &book(SymbolId symbol) const { return symbols_[symbol]->book; }
+};